@@ -40,6 +40,7 @@ extern apic_spurious_handler
 global ipi_abort
 global ipi_resched
 global ipi_abortexec
+global ipi_tlb
 
 ; Misc.
 extern task_resched_bsp
@@ -89,6 +90,7 @@ isr_handler_%1:
     push r13
     push r14
     push r15
+    cld
     mov r12, 1
   .loop:
     mov rbx, [isr_%1_functions + r12 * 8]
@@ -186,7 +188,8 @@ isr_fnaddr_add i
     iretq
 %endmacro
 
-; Save registers.
+; Save registers, and clear the direction flag for the C code which runs
+; next, as whatever got interrupted may have set it.
 %macro pusham 0
     push rax
     push rbx
@@ -203,6 +206,7 @@ isr_fnaddr_add i
     push r13
     push r14
     push r15
+    cld
 %endmacro
 
 %macro popam 0
@@ -272,6 +276,23 @@ exc_ss_fault_handler:
 exc_gpf_handler:
     except_handler_err_code 0xd
 exc_page_fault_handler:
+    ; Faults from userspace arrive on the per-CPU stack. Move the frame to the
+    ; thread's kernel stack, as resolving the fault may have to block.
+    test qword [rsp+2*8], 3
+    jz .kernel
+    push rax
+    push rbx
+    mov rbx, rsp
+    mov rsp, qword [gs:0016]
+    push qword [rbx+7*8] ; ss
+    push qword [rbx+6*8] ; rsp
+    push qword [rbx+5*8] ; rflags
+    push qword [rbx+4*8] ; cs
+    push qword [rbx+3*8] ; rip
+    push qword [rbx+2*8] ; error code
+    mov rax, qword [rbx+1*8]
+    mov rbx, qword [rbx]
+  .kernel:
     except_handler_err_code 0xe
 exc_x87_fp_handler:
     except_handler 0x10
@@ -291,6 +312,7 @@ exc_security_handler:
 ipi_abortexec:
     mov rdi, qword [rsp]
     mov rsp, qword [gs:0008]
+    cld
     extern abort_thread_exec
     call abort_thread_exec
   .wait:
@@ -311,6 +333,18 @@ ipi_resched:
     popam
     iretq
 
+ipi_tlb:
+    pusham
+
+    extern tlb_shootdown_handler
+    call tlb_shootdown_handler
+
+    mov rax, qword [lapic_eoi_ptr]
+    mov dword [rax], 0
+
+    popam
+    iretq
+
 invalid_syscall:
     mov rax, -1
     ret
@@ -393,6 +427,18 @@ syscall_table:
     dq syscall_unlink ;34
     extern syscall_mkdir
     dq syscall_mkdir ;35
+    extern syscall_mmap
+    dq syscall_mmap ;36
+    extern syscall_munmap
+    dq syscall_munmap ;37
+    extern syscall_msync
+    dq syscall_msync ;38
+    extern syscall_ftruncate
+    dq syscall_ftruncate ;39
+    extern syscall_shm_open
+    dq syscall_shm_open ;40
+    extern syscall_shm_unlink
+    dq syscall_shm_unlink ;41
   .end:
 
 section .text
@@ -68,6 +68,8 @@ smp_init_cpu0_local:
     mov rax, cr0
     and al, 0xfb
     or al, 0x02
+    ; write protect supervisor writes too, needed for copy-on-write
+    or rax, 1 << 16
     mov cr0, rax
     mov rax, cr4
     or ax, 3 << 9
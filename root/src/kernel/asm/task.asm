@@ -51,8 +51,8 @@ task_spinup:
     mov es, ax
 
     ; release relevant locks
-    lock inc qword [scheduler_lock]
-    lock inc qword [resched_lock]
+    lock inc word [scheduler_lock]
+    lock inc word [resched_lock]
 
     pop rax
 
@@ -86,7 +86,7 @@ force_resched:
     push r15
 
     ; release relevant locks
-    lock inc qword [scheduler_lock]
+    lock inc word [scheduler_lock]
 
     mov rdi, rsp
   .retry:
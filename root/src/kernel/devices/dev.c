@@ -1,6 +1,5 @@
 #include <devices/dev.h>
 #include <fs/devfs/devfs.h>
-#include <proc/task.h>
 
 void init_dev_streams(void);
 void init_dev_tty(void);
@@ -15,6 +14,6 @@ void init_dev(void) {
     init_dev_sata();
     init_dev_vesafb();
 
-    /* Launch the device cache sync worker */
-    task_tcreate(0, tcreate_fn_call, tcreate_fn_call_data(0, device_sync_worker, 0));
+    /* Start flushing the device caches */
+    init_device_sync();
 }
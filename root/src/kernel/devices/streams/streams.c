@@ -1,6 +1,13 @@
 #include <fs/devfs/devfs.h>
 #include <lib/klib.h>
 #include <lib/rand.h>
+#include <lib/klog.h>
+#include <lib/lockstat.h>
+#include <lib/errno.h>
+#include <lib/lock.h>
+#include <mm/mm.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
 
 /** /dev/urandom **/
 
@@ -16,10 +23,7 @@ static int urandom_read(int unused1, void *buf, uint64_t unused2, size_t count)
     (void)unused1;
     (void)unused2;
 
-    uint8_t *buf1 = buf;
-
-    for (size_t i = 0; i < count; i++)
-        buf1[i] = (uint8_t)(rand32() % 0x100);
+    rand_fill(buf, count);
 
     return count;
 }
@@ -65,6 +69,165 @@ static int zero_read(int unused1, void *buf, uint64_t unused2, size_t count) {
     return (int)count;
 }
 
+/** /dev/kmsg **/
+
+static int kmsg_write(int unused1, const void *buf, uint64_t unused2, size_t count) {
+    (void)unused1;
+    (void)unused2;
+
+    /* One message per write, without its final newline */
+    size_t len = count;
+    if (len && ((const char *)buf)[len - 1] == '\n')
+        len--;
+
+    kprint(KPRN_INFO, "%S", len, buf);
+
+    return (int)count;
+}
+
+static int kmsg_read(int unused1, void *buf, uint64_t loc, size_t count) {
+    (void)unused1;
+
+    return (int)klog_read_backlog(buf, loc, count);
+}
+
+/** /dev/loglevel **/
+
+#define LOGLEVEL_NAME_MAX 16
+
+static int loglevel_write(int unused1, const void *buf, uint64_t unused2, size_t count) {
+    (void)unused1;
+    (void)unused2;
+
+    char name[LOGLEVEL_NAME_MAX] = {0};
+    size_t len = count;
+    while (len && (((const char *)buf)[len - 1] == '\n'
+                || ((const char *)buf)[len - 1] == ' '))
+        len--;
+    if (len >= LOGLEVEL_NAME_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(name, buf, len);
+
+    int level = klog_parse_level(name);
+    if (level == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    klog_level = level;
+
+    return (int)count;
+}
+
+static int loglevel_read(int unused1, void *buf, uint64_t loc, size_t count) {
+    (void)unused1;
+
+    char name[LOGLEVEL_NAME_MAX];
+    strcpy(name, klog_level_name(klog_level));
+    size_t len = strlen(name);
+    name[len++] = '\n';
+
+    if (loc >= len)
+        return 0;
+    if (count > len - loc)
+        count = len - loc;
+    memcpy(buf, name + loc, count);
+
+    return (int)count;
+}
+
+/** /dev/memstat **/
+
+/* One "name value" line per counter */
+#define MEMSTAT_SIZE 1024
+
+static void memstat_put(char *text, size_t *len, const char *name, uint64_t value) {
+    char digits[20];
+    size_t n = 0;
+
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    strcpy(text + *len, name);
+    *len += strlen(name);
+    text[(*len)++] = ' ';
+    while (n)
+        text[(*len)++] = digits[--n];
+    text[(*len)++] = '\n';
+}
+
+static int memstat_read(int unused1, void *buf, uint64_t loc, size_t count) {
+    (void)unused1;
+
+    char text[MEMSTAT_SIZE];
+    size_t len = 0;
+
+    memstat_put(text, &len, "free_pages", locked_read(size_t, &pmm_free_pages));
+    memstat_put(text, &len, "zero_pool_depth", locked_read(size_t, &zero_pool_depth));
+    memstat_put(text, &len, "zero_pool_hits", locked_read(uint64_t, &zero_pool_hits));
+    memstat_put(text, &len, "zero_pool_misses", locked_read(uint64_t, &zero_pool_misses));
+    memstat_put(text, &len, "zero_pool_zeroed", locked_read(uint64_t, &zero_pool_zeroed));
+
+    /* Per-CPU page cache counters, summed up. Each CPU updates its own
+     * without atomics, the sums may be slightly out of date. */
+    uint64_t hits = 0, misses = 0, refills = 0, drains = 0;
+    for (int i = 0; i < smp_cpu_count; i++) {
+        hits += *(volatile uint64_t *)&cpu_locals[i].page_cache_hits;
+        misses += *(volatile uint64_t *)&cpu_locals[i].page_cache_misses;
+        refills += *(volatile uint64_t *)&cpu_locals[i].page_cache_refills;
+        drains += *(volatile uint64_t *)&cpu_locals[i].page_cache_drains;
+    }
+    memstat_put(text, &len, "page_cache_hits", hits);
+    memstat_put(text, &len, "page_cache_misses", misses);
+    memstat_put(text, &len, "page_cache_refills", refills);
+    memstat_put(text, &len, "page_cache_drains", drains);
+
+    /* TLB shootdown counters, likewise per CPU */
+    uint64_t ipis = 0, invalidated = 0, full_flushes = 0;
+    for (int i = 0; i < smp_cpu_count; i++) {
+        ipis += *(volatile uint64_t *)&cpu_locals[i].tlb_ipis_sent;
+        invalidated += *(volatile uint64_t *)&cpu_locals[i].tlb_pages_invalidated;
+        full_flushes += *(volatile uint64_t *)&cpu_locals[i].tlb_full_flushes;
+    }
+    memstat_put(text, &len, "tlb_ipis_sent", ipis);
+    memstat_put(text, &len, "tlb_pages_invalidated", invalidated);
+    memstat_put(text, &len, "tlb_full_flushes", full_flushes);
+
+    if (loc >= len)
+        return 0;
+    if (count > len - loc)
+        count = len - loc;
+    memcpy(buf, text + loc, count);
+
+    return (int)count;
+}
+
+#ifdef _LOCKSTAT_
+
+/** /dev/lockstat **/
+
+/* Any write resets the counters */
+static int lockstat_write(int unused1, const void *unused2, uint64_t unused3, size_t count) {
+    (void)unused1;
+    (void)unused2;
+    (void)unused3;
+
+    lockstat_reset();
+
+    return (int)count;
+}
+
+static int lockstat_dev_read(int unused1, void *buf, uint64_t loc, size_t count) {
+    (void)unused1;
+
+    return (int)lockstat_read(buf, loc, count);
+}
+
+#endif
+
 /** initialise **/
 
 void init_dev_streams(void) {
@@ -86,4 +249,30 @@ void init_dev_streams(void) {
     device.calls.read = urandom_read;
     device.calls.write = urandom_write;
     device_add(&device);
+
+    strcpy(device.name, "kmsg");
+    device.size = KLOG_BACKLOG_SIZE;
+    device.calls.read = kmsg_read;
+    device.calls.write = kmsg_write;
+    device_add(&device);
+
+    strcpy(device.name, "loglevel");
+    device.size = LOGLEVEL_NAME_MAX;
+    device.calls.read = loglevel_read;
+    device.calls.write = loglevel_write;
+    device_add(&device);
+
+    strcpy(device.name, "memstat");
+    device.size = MEMSTAT_SIZE;
+    device.calls.read = memstat_read;
+    device.calls.write = default_device_calls.write;
+    device_add(&device);
+
+#ifdef _LOCKSTAT_
+    strcpy(device.name, "lockstat");
+    device.size = lockstat_size();
+    device.calls.read = lockstat_dev_read;
+    device.calls.write = lockstat_write;
+    device_add(&device);
+#endif
 }
@@ -19,15 +19,17 @@ int dup(int fd) {
     struct file_descriptor_t *fd_ptr = dynarray_getelem(struct file_descriptor_t, file_descriptors, fd);
     int intern_fd = fd_ptr->intern_fd;
     int new_intern_fd = fd_ptr->fd_handler.dup(intern_fd);
-    dynarray_unref(file_descriptors, fd);
 
-    if (new_intern_fd == -1)
+    if (new_intern_fd == -1) {
+        dynarray_unref(file_descriptors, fd);
         return -1;
+    }
 
     struct file_descriptor_t new_fd = {0};
 
     new_fd.intern_fd = new_intern_fd;
-    new_fd.fd_handler = file_descriptors[fd]->data.fd_handler;
+    new_fd.fd_handler = fd_ptr->fd_handler;
+    dynarray_unref(file_descriptors, fd);
 
     return fd_create(&new_fd);
 }
@@ -102,6 +104,36 @@ int perfmon_attach(int fd) {
     return ret;
 }
 
+int ftruncate(int fd, off_t length) {
+    struct file_descriptor_t *fd_ptr = dynarray_getelem(struct file_descriptor_t, file_descriptors, fd);
+    int intern_fd = fd_ptr->intern_fd;
+    int ret = fd_ptr->fd_handler.ftruncate(intern_fd, length);
+    dynarray_unref(file_descriptors, fd);
+    return ret;
+}
+
+/* Map len bytes at offset of an object which provides its own pages into
+ * [base, base + len) of a pagemap. Whatever was mapped there is unmapped
+ * by the object, once it has checked the request. */
+int mmap(int fd, struct pagemap_t *pagemap, size_t base, size_t len,
+         size_t offset, size_t flags) {
+    struct file_descriptor_t *fd_ptr = dynarray_getelem(struct file_descriptor_t, file_descriptors, fd);
+    int intern_fd = fd_ptr->intern_fd;
+    int ret = fd_ptr->fd_handler.mmap(intern_fd, pagemap, base, len, offset, flags);
+    dynarray_unref(file_descriptors, fd);
+    return ret;
+}
+
+/* Open whatever fd refers to once more, with a file offset and mode of its
+ * own, unlike dup(). Returns the new file descriptor. */
+int reopen(int fd, int mode) {
+    struct file_descriptor_t *fd_ptr = dynarray_getelem(struct file_descriptor_t, file_descriptors, fd);
+    int intern_fd = fd_ptr->intern_fd;
+    int ret = fd_ptr->fd_handler.reopen(intern_fd, mode);
+    dynarray_unref(file_descriptors, fd);
+    return ret;
+}
+
 int readdir(int fd, struct dirent *buf) {
     struct file_descriptor_t *fd_ptr = dynarray_getelem(struct file_descriptor_t, file_descriptors, fd);
     int intern_fd = fd_ptr->intern_fd;
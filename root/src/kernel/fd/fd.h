@@ -86,6 +86,8 @@ struct dirent {
     char d_name[1024];
 };
 
+struct pagemap_t;
+
 struct fd_handler_t {
     int (*close)(int);
     int (*fstat)(int, struct stat *);
@@ -102,6 +104,9 @@ struct fd_handler_t {
     int (*setflflags)(int, int);
     int (*perfmon_attach)(int);
     int (*unlink)(int);
+    int (*ftruncate)(int, off_t);
+    int (*mmap)(int, struct pagemap_t *, size_t, size_t, size_t, size_t);
+    int (*reopen)(int, int);
 };
 
 struct file_descriptor_t {
@@ -126,6 +131,9 @@ int tcflow(int, int);
 int getflflags(int);
 int setflflags(int, int);
 int perfmon_attach(int);
+int ftruncate(int, off_t);
+int mmap(int, struct pagemap_t *, size_t, size_t, size_t, size_t);
+int reopen(int, int);
 
 void init_fd(void);
 int getfdflags(int);
@@ -209,6 +217,21 @@ __attribute__((unused)) static int bogus_unlink() {
     return -1;
 }
 
+__attribute__((unused)) static int bogus_ftruncate() {
+    errno = EINVAL;
+    return -1;
+}
+
+__attribute__((unused)) static int bogus_mmap() {
+    errno = ENODEV;
+    return -1;
+}
+
+__attribute__((unused)) static int bogus_reopen() {
+    errno = EINVAL;
+    return -1;
+}
+
 __attribute__((unused)) static struct fd_handler_t default_fd_handler = {
     (void *)bogus_close,
     (void *)bogus_fstat,
@@ -224,7 +247,10 @@ __attribute__((unused)) static struct fd_handler_t default_fd_handler = {
     (void *)bogus_getflflags,
     (void *)bogus_setflflags,
     (void *)bogus_perfmon_attach,
-    (void *)bogus_unlink
+    (void *)bogus_unlink,
+    (void *)bogus_ftruncate,
+    (void *)bogus_mmap,
+    (void *)bogus_reopen
 };
 
 #endif
@@ -6,7 +6,9 @@
 #include <lib/time.h>
 #include <proc/task.h>
 
-dynarray_new(struct perfmon_t, perfmons);
+/* The perfmons are refcounted on their own, and outlive their slot when
+ * still attached to a process */
+dynarray_new(struct perfmon_t *, perfmons);
 
 void perfmon_ref(struct perfmon_t *perfmon) {
     int refs;
@@ -22,13 +24,18 @@ void perfmon_unref(struct perfmon_t *perfmon) {
         kfree(perfmon);
 }
 
+static struct perfmon_t *perfmon_get(int fd) {
+    struct perfmon_t **perfmon = dynarray_getelem(struct perfmon_t *, perfmons, fd);
+    struct perfmon_t *ret = *perfmon;
+    dynarray_unref(perfmons, fd);
+    return ret;
+}
+
 int perfmon_do_attach(int intern_fd) {
-    struct perfmon_t *perfmon = &perfmons[intern_fd]->data;
+    struct perfmon_t *perfmon = perfmon_get(intern_fd);
     perfmon_ref(perfmon);
 
-    spinlock_acquire(&scheduler_lock);
     struct process_t *process = process_table[CURRENT_PROCESS];
-    spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->perfmon_lock);
     if (process->active_perfmon) {
@@ -63,7 +70,7 @@ struct perfstats {
 };
 
 static int perfmon_read(int fd, void *buf, size_t count) {
-    struct perfmon_t *perfmon = &perfmons[fd]->data;
+    struct perfmon_t *perfmon = perfmon_get(fd);
 
     if (count < sizeof(struct perfstats)) {
         errno = EINVAL;
@@ -82,7 +89,7 @@ static int perfmon_read(int fd, void *buf, size_t count) {
 }
 
 static int perfmon_dup(int fd) {
-    struct perfmon_t *perfmon = &perfmons[fd]->data;
+    struct perfmon_t *perfmon = perfmon_get(fd);
     perfmon_ref(perfmon);
     return fd;
 }
@@ -97,18 +104,22 @@ static int perfmon_write(int fd, const void *buf, size_t len) {
 }
 
 static int perfmon_close(int fd) {
-    struct perfmon_t *perfmon = &perfmons[fd]->data;
+    struct perfmon_t *perfmon = perfmon_get(fd);
     perfmon_unref(perfmon);
     return 0;
 }
 
 int perfmon_create(void) {
-    struct perfmon_t perfmon = {0};
-    perfmon.refcount = 1;
+    struct perfmon_t *perfmon = kalloc(sizeof(struct perfmon_t));
+    if (!perfmon)
+        return -1;
+    perfmon->refcount = 1;
 
-    int x = dynarray_add(struct perfmon_t, perfmons, &perfmon);
-    if (x == -1)
+    int x = dynarray_add(struct perfmon_t *, perfmons, &perfmon);
+    if (x == -1) {
+        kfree(perfmon);
         return -1;
+    }
 
     struct fd_handler_t perfmon_functions = default_fd_handler;
     perfmon_functions.close = perfmon_close;
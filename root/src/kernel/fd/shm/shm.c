@@ -0,0 +1,439 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <lib/klib.h>
+#include <lib/lock.h>
+#include <lib/errno.h>
+#include <lib/alloc.h>
+#include <fd/fd.h>
+#include <fd/shm/shm.h>
+#include <mm/mm.h>
+
+/* Shared memory objects. The pages of an object are mapped straight into
+ * every address space which maps it, so nothing is ever copied between
+ * them. The object holds one reference to each of its pages and every
+ * mapping another one, so pages outlive the object for as long as they
+ * are mapped somewhere. An object goes away once it is unlinked (or was
+ * anonymous to begin with) and the last descriptor to it is closed. */
+
+#define SHM_NAME_MAX 256
+
+struct shm_t {
+    lock_t lock;
+    char name[SHM_NAME_MAX];
+    /* Whether the object can still be opened by name */
+    int linked;
+    /* Open descriptors */
+    int refcount;
+    off_t offset;
+    size_t size;
+    size_t page_count;
+    /* Physical address of each page */
+    size_t *pages;
+};
+
+dynarray_new(struct shm_t, shms);
+
+/* Serialises looking objects up by name against creating and unlinking */
+static lock_t shm_lock = new_lock;
+
+static struct fd_handler_t shm_functions;
+
+/* Drop the object's own references to its pages from the index'th on.
+ * Call with the object lock held. */
+static void shm_release_pages(struct shm_t *shm, size_t index) {
+    for (size_t i = index; i < shm->page_count; i++) {
+        if (!pmm_page_unref((void *)shm->pages[i]))
+            pmm_free((void *)shm->pages[i], 1);
+    }
+    shm->page_count = index;
+}
+
+/* Free an object nobody can reach anymore. Call with shm_lock held. */
+static void shm_destroy(int shm_fd, struct shm_t *shm) {
+    shm_release_pages(shm, 0);
+    kfree(shm->pages);
+    dynarray_unref(shms, shm_fd);
+    dynarray_remove(shms, shm_fd);
+}
+
+static int shm_close(int fd) {
+    struct shm_t *shm = dynarray_getelem(struct shm_t, shms, fd);
+
+    spinlock_acquire(&shm_lock);
+    spinlock_acquire(&shm->lock);
+
+    if (--shm->refcount || shm->linked) {
+        spinlock_release(&shm->lock);
+        spinlock_release(&shm_lock);
+        dynarray_unref(shms, fd);
+        return 0;
+    }
+
+    spinlock_release(&shm->lock);
+    shm_destroy(fd, shm);
+    spinlock_release(&shm_lock);
+    return 0;
+}
+
+static int shm_dup(int fd) {
+    struct shm_t *shm = dynarray_getelem(struct shm_t, shms, fd);
+    spinlock_acquire(&shm->lock);
+    shm->refcount++;
+    spinlock_release(&shm->lock);
+    dynarray_unref(shms, fd);
+    return fd;
+}
+
+static int shm_ftruncate(int fd, off_t length) {
+    if (length < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct shm_t *shm = dynarray_getelem(struct shm_t, shms, fd);
+    size_t page_count = ((size_t)length + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    spinlock_acquire(&shm->lock);
+
+    /* What gets cut off the last page must read as zero if it grows back */
+    if ((size_t)length < shm->size && (length % PAGE_SIZE))
+        memset((void *)(shm->pages[length / PAGE_SIZE] + MEM_PHYS_OFFSET
+                        + length % PAGE_SIZE),
+               0, PAGE_SIZE - length % PAGE_SIZE);
+
+    if (page_count < shm->page_count) {
+        /* Mappings of the dropped pages keep them alive on their own */
+        shm_release_pages(shm, page_count);
+    } else if (page_count > shm->page_count) {
+        size_t *pages = krealloc(shm->pages, page_count * sizeof(size_t));
+        if (!pages)
+            goto enomem;
+        shm->pages = pages;
+        while (shm->page_count < page_count) {
+            void *page = pmm_allocz(1);
+            if (!page)
+                goto enomem;
+            shm->pages[shm->page_count++] = (size_t)page;
+        }
+    }
+
+    shm->size = length;
+
+    spinlock_release(&shm->lock);
+    dynarray_unref(shms, fd);
+    return 0;
+
+enomem:
+    spinlock_release(&shm->lock);
+    dynarray_unref(shms, fd);
+    errno = ENOMEM;
+    return -1;
+}
+
+/* Copy between buf and the object at its current offset. Call with the
+ * object lock held. */
+static size_t shm_copy(struct shm_t *shm, void *buf, size_t count, int write) {
+    if ((size_t)shm->offset >= shm->size)
+        return 0;
+    if (count > shm->size - shm->offset)
+        count = shm->size - shm->offset;
+
+    for (size_t done = 0; done < count; ) {
+        size_t page_off = (shm->offset + done) % PAGE_SIZE;
+        size_t chunk = PAGE_SIZE - page_off;
+        if (chunk > count - done)
+            chunk = count - done;
+
+        char *page = (char *)(shm->pages[(shm->offset + done) / PAGE_SIZE]
+                              + MEM_PHYS_OFFSET);
+        if (write)
+            memcpy(page + page_off, buf + done, chunk);
+        else
+            memcpy(buf + done, page + page_off, chunk);
+
+        done += chunk;
+    }
+
+    shm->offset += count;
+    return count;
+}
+
+static int shm_read(int fd, void *buf, size_t count) {
+    struct shm_t *shm = dynarray_getelem(struct shm_t, shms, fd);
+
+    spinlock_acquire(&shm->lock);
+    int ret = shm_copy(shm, buf, count, 0);
+    spinlock_release(&shm->lock);
+
+    dynarray_unref(shms, fd);
+    return ret;
+}
+
+/* Writes never grow an object, that is what ftruncate() is for */
+static int shm_write(int fd, const void *buf, size_t count) {
+    struct shm_t *shm = dynarray_getelem(struct shm_t, shms, fd);
+
+    spinlock_acquire(&shm->lock);
+    int ret = shm_copy(shm, (void *)buf, count, 1);
+    spinlock_release(&shm->lock);
+
+    dynarray_unref(shms, fd);
+    return ret;
+}
+
+static int shm_lseek(int fd, off_t offset, int type) {
+    struct shm_t *shm = dynarray_getelem(struct shm_t, shms, fd);
+
+    spinlock_acquire(&shm->lock);
+
+    off_t base;
+    switch (type) {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = shm->offset;
+            break;
+        case SEEK_END:
+            base = shm->size;
+            break;
+        default:
+            goto einval;
+    }
+    if (base + offset < 0)
+        goto einval;
+
+    int ret = shm->offset = base + offset;
+
+    spinlock_release(&shm->lock);
+    dynarray_unref(shms, fd);
+    return ret;
+
+einval:
+    spinlock_release(&shm->lock);
+    dynarray_unref(shms, fd);
+    errno = EINVAL;
+    return -1;
+}
+
+static int shm_fstat(int fd, struct stat *st) {
+    struct shm_t *shm = dynarray_getelem(struct shm_t, shms, fd);
+
+    spinlock_acquire(&shm->lock);
+    st->st_size = shm->size;
+    spinlock_release(&shm->lock);
+
+    st->st_dev = 0;
+    st->st_ino = fd + 1;
+    st->st_nlink = 1;
+    st->st_uid = 0;
+    st->st_gid = 0;
+    st->st_rdev = 0;
+    st->st_blksize = PAGE_SIZE;
+    st->st_blocks = (st->st_size + 512 - 1) / 512;
+    st->st_atim.tv_sec = unix_epoch;
+    st->st_atim.tv_nsec = 0;
+    st->st_mtim.tv_sec = unix_epoch;
+    st->st_mtim.tv_nsec = 0;
+    st->st_ctim.tv_sec = unix_epoch;
+    st->st_ctim.tv_nsec = 0;
+    st->st_mode = S_IFREG | 0666;
+
+    dynarray_unref(shms, fd);
+    return 0;
+}
+
+/* Map the object's pages from offset on into [base, base + len), in place
+ * of what was mapped there. Shared mappings get the pages themselves,
+ * private ones get them copy-on-write. */
+static int shm_mmap(int fd, struct pagemap_t *pagemap, size_t base, size_t len,
+                    size_t offset, size_t flags) {
+    struct shm_t *shm = dynarray_getelem(struct shm_t, shms, fd);
+    int ret = -1;
+
+    spinlock_acquire(&shm->lock);
+
+    if (offset & (PAGE_SIZE - 1)) {
+        errno = EINVAL;
+        goto out;
+    }
+
+    /* offset + len may wrap */
+    size_t size = shm->page_count * PAGE_SIZE;
+    if (offset >= size || len > size - offset) {
+        errno = ENXIO;
+        goto out;
+    }
+
+    /* Whatever was mapped there goes away, once the request is known good */
+    if (vmm_unmap(pagemap, base, len) && errno == ENOMEM)
+        goto out;
+
+    if (vmm_add_vma(pagemap, base, len, flags, NULL, 0, 0)) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    /* Nothing to map for PROT_NONE, the region just reserves the range */
+    if (!(flags & 0x01)) {
+        ret = 0;
+        goto out;
+    }
+
+    int attr = VMM_ATTR_REG;
+    size_t page_flags = flags & ~VMM_FLAG_SHARED;
+    if (flags & VMM_FLAG_SHARED)
+        attr = VMM_ATTR_SHARED;
+    else if (flags & 0x02)
+        page_flags = (page_flags & ~(size_t)0x02) | VMM_FLAG_COW;
+
+    for (size_t i = 0; i < len / PAGE_SIZE; i++) {
+        size_t page = shm->pages[offset / PAGE_SIZE + i];
+        pmm_page_ref((void *)page);
+        if (map_page(pagemap, page, base + i * PAGE_SIZE, page_flags, attr)) {
+            pmm_page_unref((void *)page);
+            vmm_unmap(pagemap, base, len);
+            errno = ENOMEM;
+            goto out;
+        }
+    }
+
+    ret = 0;
+
+out:
+    spinlock_release(&shm->lock);
+    dynarray_unref(shms, fd);
+    return ret;
+}
+
+static int shm_new_fd(int shm_fd) {
+    struct file_descriptor_t fd = {0};
+
+    fd.intern_fd = shm_fd;
+    fd.fd_handler = shm_functions;
+
+    return fd_create(&fd);
+}
+
+/* Open the object called name, or a new anonymous one if name is NULL or
+ * empty. Supports O_CREAT, O_EXCL and O_TRUNC. */
+int shm_open(const char *name, int oflag) {
+    if (name && !*name)
+        name = NULL;
+    if (name && strlen(name) >= SHM_NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    spinlock_acquire(&shm_lock);
+
+    if (!shm_functions.close) {
+        shm_functions = default_fd_handler;
+        shm_functions.close = shm_close;
+        shm_functions.fstat = shm_fstat;
+        shm_functions.read = shm_read;
+        shm_functions.write = shm_write;
+        shm_functions.lseek = shm_lseek;
+        shm_functions.dup = shm_dup;
+        shm_functions.ftruncate = shm_ftruncate;
+        shm_functions.mmap = shm_mmap;
+    }
+
+    if (name) {
+        for (size_t i = 0; i < shms_i; i++) {
+            struct shm_t *shm = dynarray_getelem(struct shm_t, shms, i);
+            if (!shm)
+                continue;
+
+            spinlock_acquire(&shm->lock);
+            if (!shm->linked || strcmp(shm->name, name)) {
+                spinlock_release(&shm->lock);
+                dynarray_unref(shms, i);
+                continue;
+            }
+
+            if ((oflag & O_CREAT) && (oflag & O_EXCL)) {
+                spinlock_release(&shm->lock);
+                dynarray_unref(shms, i);
+                spinlock_release(&shm_lock);
+                errno = EEXIST;
+                return -1;
+            }
+
+            shm->refcount++;
+            spinlock_release(&shm->lock);
+            dynarray_unref(shms, i);
+            spinlock_release(&shm_lock);
+
+            if (oflag & O_TRUNC)
+                shm_ftruncate(i, 0);
+
+            int fd = shm_new_fd(i);
+            if (fd == -1)
+                shm_close(i);
+            return fd;
+        }
+
+        if (!(oflag & O_CREAT)) {
+            spinlock_release(&shm_lock);
+            errno = ENOENT;
+            return -1;
+        }
+    }
+
+    struct shm_t new_shm = {0};
+    new_shm.lock = new_lock;
+    new_shm.refcount = 1;
+    if (name) {
+        strcpy(new_shm.name, name);
+        new_shm.linked = 1;
+    }
+
+    int shm_fd = dynarray_add(struct shm_t, shms, &new_shm);
+
+    spinlock_release(&shm_lock);
+
+    if (shm_fd == -1) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int fd = shm_new_fd(shm_fd);
+    if (fd == -1)
+        shm_close(shm_fd);
+    return fd;
+}
+
+/* Make an object unreachable by name, it lives on while still open */
+int shm_unlink(const char *name) {
+    spinlock_acquire(&shm_lock);
+
+    for (size_t i = 0; i < shms_i; i++) {
+        struct shm_t *shm = dynarray_getelem(struct shm_t, shms, i);
+        if (!shm)
+            continue;
+
+        spinlock_acquire(&shm->lock);
+        if (!shm->linked || strcmp(shm->name, name)) {
+            spinlock_release(&shm->lock);
+            dynarray_unref(shms, i);
+            continue;
+        }
+
+        shm->linked = 0;
+        if (shm->refcount) {
+            spinlock_release(&shm->lock);
+            dynarray_unref(shms, i);
+        } else {
+            spinlock_release(&shm->lock);
+            shm_destroy(i, shm);
+        }
+
+        spinlock_release(&shm_lock);
+        return 0;
+    }
+
+    spinlock_release(&shm_lock);
+    errno = ENOENT;
+    return -1;
+}
@@ -0,0 +1,7 @@
+#ifndef __SHM_H__
+#define __SHM_H__
+
+int shm_open(const char *, int);
+int shm_unlink(const char *);
+
+#endif
@@ -5,72 +5,72 @@
 #include <lib/errno.h>
 #include <lib/dynarray.h>
 #include <lib/ht.h>
+#include <lib/rcu.h>
+#include <lib/workqueue.h>
+
+#define VFS_SYNC_INTERVAL_MS 2000
 
 struct vfs_handle_t {
     struct fs_t *fs;
     int intern_fd;
+    /* As passed to open(), for getflflags() and reopen() */
+    int flags;
+    char *path;
 };
 
+/* Flags which only matter while opening */
+#define VFS_OPEN_ONLY_FLAGS (O_CREAT | O_EXCL | O_NOCTTY | O_TRUNC \
+                           | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+
 struct mnt_t {
     char name[2048];
+    size_t len;
     struct fs_t *fs;
     int magic;
 };
 
+/* Mountpoints are never freed. The table of them is replaced as a whole on
+   mount, under RCU, and kept sorted longest name first, so the first
+   match of a path is the closest one. */
+struct mnt_table_t {
+    struct rcu_head_t rcu;
+    size_t count;
+    struct mnt_t *mnt[];
+};
+
 ht_new(struct fs_t, filesystems);
-ht_new(struct mnt_t, mountpoints);
+static struct mnt_table_t *mountpoints = NULL;
+static lock_t mountpoints_lock = new_lock;
 dynarray_new(struct vfs_handle_t, vfs_handles);
 
-/* Return index into mountpoints array corresponding to the mountpoint
-   inside which this file/path is located.
+/* Return the mountpoint inside which this file/path is located.
    char **local_path will return a pointer (in *local_path) to the
    part of the path inside the mountpoint. */
 static struct mnt_t *vfs_get_mountpoint(const char *path, char **local_path) {
-    size_t size;
-
-    spinlock_acquire(&mountpoints_lock);
-
-    struct mnt_t **mnts = ht_dump(struct mnt_t, mountpoints, &size);
-    if (!mnts)
-        return NULL;
-
-    ssize_t guess = -1;
-    size_t guess_size = 0;
-
-    for (size_t i = 0; i < size; i++) {
-        if (!mnts[i])
-            continue;
-
-        size_t len = strlen(mnts[i]->name);
-
-        if (!strncmp(path, mnts[i]->name, len)) {
-            if ( (((path[len] == '/') || (path[len] == '\0'))
-                 || (!strcmp(mnts[i]->name, "/")))
-               && (len > guess_size)) {
-                guess = i;
-                guess_size = len;
-            }
+    struct mnt_t *guess = NULL;
+
+    uint64_t flags = rcu_read_lock();
+    struct mnt_table_t *table = rcu_dereference(mountpoints);
+    for (size_t i = 0; table && i < table->count; i++) {
+        struct mnt_t *mnt = table->mnt[i];
+        if (!strncmp(path, mnt->name, mnt->len)
+         && ((path[mnt->len] == '/') || (path[mnt->len] == '\0')
+          || (!strcmp(mnt->name, "/")))) {
+            guess = mnt;
+            break;
         }
     }
+    rcu_read_unlock(flags);
 
     *local_path = (char *)path;
 
-    if (guess_size > 1)
-        *local_path += guess_size;
+    if (guess && guess->len > 1)
+        *local_path += guess->len;
 
     if (!**local_path)
         *local_path = "/";
 
-    struct mnt_t *ret = mnts[guess];
-
-    kfree(mnts);
-
-    spinlock_release(&mountpoints_lock);
-
-    if (guess != -1)
-        return ret;
-    else
-        return NULL;
+    return guess;
 }
 
 /* Convert a relative path into an absolute path.
@@ -142,31 +142,24 @@ term:
 }
 
 int vfs_sync(void) {
-    size_t size;
-
-    spinlock_acquire(&filesystems_lock);
-
-    struct fs_t **fs = ht_dump(struct fs_t, filesystems, &size);
-    if (!fs)
-        return 0;
-
-    for (size_t i = 0; i < size; i++)
-        fs[i]->sync();
-
-    kfree(fs);
+    struct fs_t *fs;
 
-    spinlock_release(&filesystems_lock);
+    ht_foreach(struct fs_t, fs, filesystems)
+        fs->sync();
 
     return 0;
 }
 
-void vfs_sync_worker(void *arg) {
-    (void)arg;
+static void vfs_sync_work_fn(struct work_t *work) {
+    vfs_sync();
+    queue_delayed_work(work, VFS_SYNC_INTERVAL_MS);
+}
 
-    for (;;) {
-        relaxed_sleep(2000);
-        vfs_sync();
-    }
+static struct work_t vfs_sync_work = new_work(vfs_sync_work_fn);
+
+/* Syncs the filesystem caches periodically from now on */
+void init_vfs_sync(void) {
+    queue_delayed_work(&vfs_sync_work, VFS_SYNC_INTERVAL_MS);
 }
 
 static int vfs_call_invalid(void) {
@@ -190,16 +183,48 @@ int vfs_install_fs(struct fs_t *filesystem) {
 
 static int vfs_dup(int fd) {
     struct vfs_handle_t *fd_ptr = dynarray_getelem(struct vfs_handle_t, vfs_handles, fd);
-    int intern_fd = fd_ptr->intern_fd;
-    int ret = fd_ptr->fs->dup(intern_fd);
+    struct vfs_handle_t new_handle = *fd_ptr;
 
-    if (ret == -1) {
+    new_handle.path = kalloc(strlen(fd_ptr->path) + 1);
+    if (!new_handle.path) {
         dynarray_unref(vfs_handles, fd);
+        errno = ENOMEM;
         return -1;
     }
+    strcpy(new_handle.path, fd_ptr->path);
 
-    ret = dynarray_add(struct vfs_handle_t, vfs_handles, fd_ptr);
+    int ret = fd_ptr->fs->dup(fd_ptr->intern_fd);
     dynarray_unref(vfs_handles, fd);
+
+    if (ret == -1) {
+        kfree(new_handle.path);
+        return -1;
+    }
+
+    return dynarray_add(struct vfs_handle_t, vfs_handles, &new_handle);
+}
+
+static int vfs_getflflags(int fd) {
+    struct vfs_handle_t *fd_ptr = dynarray_getelem(struct vfs_handle_t, vfs_handles, fd);
+    int ret = fd_ptr->flags & ~VFS_OPEN_ONLY_FLAGS;
+    dynarray_unref(vfs_handles, fd);
+    return ret;
+}
+
+static int vfs_reopen(int fd, int mode) {
+    struct vfs_handle_t *fd_ptr = dynarray_getelem(struct vfs_handle_t, vfs_handles, fd);
+    char *path = kalloc(strlen(fd_ptr->path) + 1);
+    if (path)
+        strcpy(path, fd_ptr->path);
+    dynarray_unref(vfs_handles, fd);
+
+    if (!path) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int ret = open(path, mode & ~VFS_OPEN_ONLY_FLAGS);
+    kfree(path);
     return ret;
 }
 
@@ -231,6 +256,7 @@ static int vfs_close(int fd) {
     struct vfs_handle_t fd_copy = *dynarray_getelem(struct vfs_handle_t, vfs_handles, fd);
     dynarray_unref(vfs_handles, fd);
     dynarray_remove(vfs_handles, fd);
+    kfree(fd_copy.path);
     int intern_fd = fd_copy.intern_fd;
     if (fd_copy.fs->close(intern_fd))
         return -1;
@@ -318,12 +344,22 @@ int open(const char *path, int mode) {
     int magic = mountpoint->magic;
     struct fs_t *fs = mountpoint->fs;
 
+    vfs_handle.path = kalloc(strlen(path) + 1);
+    if (!vfs_handle.path) {
+        errno = ENOMEM;
+        return -1;
+    }
+    strcpy(vfs_handle.path, path);
+
     int intern_fd = fs->open(loc_path, mode, magic);
-    if (intern_fd == -1)
+    if (intern_fd == -1) {
+        kfree(vfs_handle.path);
         return -1;
+    }
 
     vfs_handle.fs = fs;
     vfs_handle.intern_fd = intern_fd;
+    vfs_handle.flags = mode;
 
     int vfs_fd = dynarray_add(struct vfs_handle_t, vfs_handles, &vfs_handle);
 
@@ -344,6 +380,8 @@ int open(const char *path, int mode) {
     vfs_functions.tcflow = vfs_tcflow;
     vfs_functions.isatty = vfs_isatty;
     vfs_functions.unlink = vfs_unlink;
+    vfs_functions.getflflags = vfs_getflflags;
+    vfs_functions.reopen = vfs_reopen;
 
     fd.fd_handler = vfs_functions;
 
@@ -352,7 +390,6 @@ int open(const char *path, int mode) {
 
 void init_fd_vfs(void) {
     ht_init(filesystems);
-    ht_init(mountpoints);
 }
 
 int mount(const char *source, const char *target,
@@ -367,13 +404,51 @@ int mount(const char *source, const char *target,
         return -1;
 
     struct mnt_t *mount = kalloc(sizeof(struct mnt_t));
+    if (!mount)
+        return -1;
 
     strcpy(mount->name, target);
+    mount->len = strlen(target);
     mount->fs = fs;
     mount->magic = res;
 
-    if (ht_add(struct mnt_t, mountpoints, mount) == -1)
+    spinlock_acquire(&mountpoints_lock);
+
+    struct mnt_table_t *old = mountpoints;
+    size_t count = old ? old->count : 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (!strcmp(old->mnt[i]->name, target)) {
+            spinlock_release(&mountpoints_lock);
+            kfree(mount);
+            return -1;
+        }
+    }
+
+    struct mnt_table_t *new =
+        kalloc(sizeof(struct mnt_table_t) + (count + 1) * sizeof(struct mnt_t *));
+    if (!new) {
+        spinlock_release(&mountpoints_lock);
+        kfree(mount);
         return -1;
+    }
+
+    size_t j = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (j == i && old->mnt[i]->len < mount->len)
+            new->mnt[j++] = mount;
+        new->mnt[j++] = old->mnt[i];
+    }
+    if (j == count)
+        new->mnt[j++] = mount;
+    new->count = j;
+
+    rcu_assign_pointer(mountpoints, new);
+
+    spinlock_release(&mountpoints_lock);
+
+    if (old)
+        call_rcu(&old->rcu, rcu_kfree);
 
     kprint(KPRN_INFO, "vfs: Mounted `%s` on `%s`, type `%s`.", source, target, fs_type);
 
@@ -80,7 +80,7 @@ int open(const char *, int);
 int mkdir(const char *);
 
 int vfs_sync(void);
-void vfs_sync_worker(void *);
+void init_vfs_sync(void);
 void vfs_get_absolute_path(char *, const char *, const char *);
 int vfs_install_fs(struct fs_t *);
 
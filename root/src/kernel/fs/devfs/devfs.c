@@ -5,10 +5,24 @@
 #include <fd/vfs/vfs.h>
 #include <fs/devfs/devfs.h>
 #include <lib/lock.h>
+#include <lib/rcu.h>
 #include <lib/errno.h>
 #include <sys/panic.h>
+#include <sys/smp.h>
 
-dynarray_new(struct device_t, devices);
+#define DEVICE_SYNC_INTERVAL_MS 1000
+
+/* Devices are never removed, so a device looked up here stays valid
+ * without holding a reference. The table of them is replaced as a whole
+ * when one is added, under RCU, so lookups take no lock. */
+struct device_table_t {
+    struct rcu_head_t rcu;
+    size_t count;
+    struct device_t *device[];
+};
+
+static struct device_table_t *devices = NULL;
+static lock_t devices_lock = new_lock;
 
 struct devfs_handle_t {
     struct device_t *device;
@@ -22,8 +36,70 @@ struct devfs_handle_t {
 
 dynarray_new(struct devfs_handle_t, devfs_handles);
 
+static void device_flush(struct work_t *);
+
 dev_t device_add(struct device_t *device) {
-    return dynarray_add(struct device_t, devices, device);
+    struct device_t *new_device = kalloc(sizeof(struct device_t));
+    if (!new_device)
+        return -1;
+    *new_device = *device;
+    new_device->sync_work = (struct work_t)new_work(device_flush);
+
+    spinlock_acquire(&devices_lock);
+
+    struct device_table_t *old = devices;
+    size_t count = old ? old->count : 0;
+
+    struct device_table_t *new =
+        kalloc(sizeof(struct device_table_t) + (count + 1) * sizeof(struct device_t *));
+    if (!new) {
+        spinlock_release(&devices_lock);
+        kfree(new_device);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+        new->device[i] = old->device[i];
+    new->device[count] = new_device;
+    new->count = count + 1;
+
+    rcu_assign_pointer(devices, new);
+
+    spinlock_release(&devices_lock);
+
+    if (old)
+        call_rcu(&old->rcu, rcu_kfree);
+
+    return count;
+}
+
+/* Returns NULL past the end of the table */
+static struct device_t *device_get(size_t i) {
+    struct device_t *device = NULL;
+
+    uint64_t flags = rcu_read_lock();
+    struct device_table_t *table = rcu_dereference(devices);
+    if (table && i < table->count)
+        device = table->device[i];
+    rcu_read_unlock(flags);
+
+    return device;
+}
+
+static struct device_t *device_find(const char *name) {
+    struct device_t *device = NULL;
+
+    uint64_t flags = rcu_read_lock();
+    struct device_table_t *table = rcu_dereference(devices);
+    for (size_t i = 0; table && i < table->count; i++) {
+        if (!strcmp(table->device[i]->name, name)) {
+            device = table->device[i];
+            break;
+        }
+    }
+    rcu_read_unlock(flags);
+
+    return device;
 }
 
 static int devfs_open(const char *path, int flags, int unused) {
@@ -46,7 +122,7 @@ static int devfs_open(const char *path, int flags, int unused) {
     if (*path == '/')
         path++;
 
-    struct device_t *device = dynarray_search(struct device_t, devices, !strcmp(elem->name, path));
+    struct device_t *device = device_find(path);
     if (!device) {
         if (flags & O_CREAT)
             errno = EROFS;
@@ -62,28 +138,29 @@ static int devfs_open(const char *path, int flags, int unused) {
     return dynarray_add(struct devfs_handle_t, devfs_handles, &new_handle);
 }
 
-void device_sync_worker(void *arg) {
-    (void)arg;
-
-    for (;;) {
-        for (size_t i = 0; i < locked_read(size_t, &devices_i); i++) {
-            struct device_t *device = dynarray_getelem(struct device_t, devices, i);
-            if (!device)
-                continue;
-            if (device->calls.flush) {
-                switch (device->calls.flush(device->intern_fd)) {
-                    case 1:
-                        /* flush is a no-op */
-                        break;
-                    default:
-                        relaxed_sleep(100);
-                        break;
-                }
-            }
-            dynarray_unref(devices, i);
-            relaxed_sleep(1000);
-        }
-    }
+static void device_flush(struct work_t *work) {
+    struct device_t *device =
+        (void *)work - offsetof(struct device_t, sync_work);
+
+    device->calls.flush(device->intern_fd);
+}
+
+/* Flushes every device, each as separate work spread over the CPUs, so
+ * that a slow disk does not hold up the others */
+static void device_sync(struct work_t *work) {
+    struct device_t *device;
+    for (size_t i = 0; (device = device_get(i)); i++)
+        if (device->calls.flush)
+            queue_work_on(i % smp_cpu_count, &device->sync_work);
+
+    queue_delayed_work(work, DEVICE_SYNC_INTERVAL_MS);
+}
+
+static struct work_t device_sync_work = new_work(device_sync);
+
+/* Flushes the device caches periodically from now on */
+void init_device_sync(void) {
+    queue_delayed_work(&device_sync_work, DEVICE_SYNC_INTERVAL_MS);
 }
 
 static int devfs_tcgetattr(int fd, struct termios *buf) {
@@ -151,8 +228,8 @@ static int devfs_read(int fd, void *ptr, size_t len) {
     spinlock_acquire(&devfs_handle->lock);
 
     if (devfs_handle->size)
-        if (devfs_handle->ptr + len >= devfs_handle->size)
-            len -= devfs_handle->size - devfs_handle->ptr;
+        if (devfs_handle->ptr + len > devfs_handle->size)
+            len = devfs_handle->size - devfs_handle->ptr;
 
     int ret = devfs_handle->device->calls.read(
                 devfs_handle->dev_fd,
@@ -192,8 +269,8 @@ static int devfs_write(int fd, const void *ptr, size_t len) {
             errno = ENOSPC;
             return -1;
         }
-        if (devfs_handle->ptr + len >= devfs_handle->size)
-            len -= devfs_handle->size - devfs_handle->ptr;
+        if (devfs_handle->ptr + len > devfs_handle->size)
+            len = devfs_handle->size - devfs_handle->ptr;
     }
 
     int ret = devfs_handle->device->calls.write(
@@ -375,28 +452,23 @@ static int devfs_readdir(int fd, struct dirent *dir) {
 
     spinlock_acquire(&devfs_handle->lock);
 
-    for (;;) {
-        // check if past directory table
-        if (devfs_handle->ptr >= locked_read(size_t, &devices_i)) {
-            errno = 0;
-            spinlock_release(&devfs_handle->lock);
-            dynarray_unref(devfs_handles, fd);
-            return -1;
-        }
-        struct device_t *dev = dynarray_getelem(struct device_t, devices, devfs_handle->ptr);
-        devfs_handle->ptr++;
-        if (dev) {
-            // valid entry
-            dir->d_ino = (ino_t)((size_t)dev & 0xfffffff);
-            strcpy(dir->d_name, dev->name);
-            dir->d_reclen = sizeof(struct dirent);
-            if (!dev->size) {
-                dir->d_type = DT_CHR;
-            } else {
-                dir->d_type = DT_BLK;
-            }
-            break;
-        }
+    struct device_t *dev = device_get(devfs_handle->ptr);
+    // check if past directory table
+    if (!dev) {
+        errno = 0;
+        spinlock_release(&devfs_handle->lock);
+        dynarray_unref(devfs_handles, fd);
+        return -1;
+    }
+    devfs_handle->ptr++;
+
+    dir->d_ino = (ino_t)((size_t)dev & 0xfffffff);
+    strcpy(dir->d_name, dev->name);
+    dir->d_reclen = sizeof(struct dirent);
+    if (!dev->size) {
+        dir->d_type = DT_CHR;
+    } else {
+        dir->d_type = DT_BLK;
     }
 
     spinlock_release(&devfs_handle->lock);
@@ -7,6 +7,7 @@
 #include <lib/dynarray.h>
 #include <lib/types.h>
 #include <lib/errno.h>
+#include <lib/workqueue.h>
 
 #define MAX_DEVICES 128
 
@@ -35,10 +36,12 @@ struct device_t {
     int intern_fd;
     size_t size;
     struct device_calls_t calls;
+    /* Runs calls.flush, set up by device_add() */
+    struct work_t sync_work;
 };
 
 dev_t device_add(struct device_t *);
 
-void device_sync_worker(void *);
+void init_device_sync(void);
 
 #endif
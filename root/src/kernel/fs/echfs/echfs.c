@@ -166,19 +166,16 @@ static inline void wr_entry(struct mount_t *mnt, uint64_t entry, struct entry_t
     return;
 }
 
+/* Called with mnt->lock held */
 static void synchronise_cached_file(struct cached_file_t *cached_file) {
     struct mount_t *mnt = cached_file->mnt;
 
-    spinlock_acquire(&mnt->lock);
-
     if (!cached_file->unlinked && cached_file->changed_entry) {
         wr_entry(mnt, cached_file->path_res.target_entry, &cached_file->path_res.target);
         cached_file->changed_entry = 0;
     }
-    if (cached_file->path_res.type != FILE_TYPE || cached_file->path_res.not_found) {
-        spinlock_release(&mnt->lock);
+    if (cached_file->path_res.type != FILE_TYPE || cached_file->path_res.not_found)
         return;
-    }
     if (cached_file->changed_cache) {
         struct cached_block_t *cached_blocks = cached_file->cached_blocks;
         for (size_t i = 0; i < MAX_CACHED_BLOCKS; i++) {
@@ -195,7 +192,6 @@ static void synchronise_cached_file(struct cached_file_t *cached_file) {
         cached_file->changed_cache = 0;
     }
 
-    spinlock_release(&mnt->lock);
     return;
 }
 
@@ -205,19 +201,14 @@ static void echfs_sync(void) {
         if (!mnt)
             continue;
 
-        spinlock_acquire(&mnt->cached_files_lock);
-        size_t total_cached_files;
-        struct cached_file_t **cached_files = ht_dump(struct cached_file_t, mnt->cached_files, &total_cached_files);
-        if (!cached_files) {
-            spinlock_release(&mnt->cached_files_lock);
-            return;
-        }
-
-        for (size_t i = 0; i < total_cached_files; i++)
-            synchronise_cached_file(cached_files[i]);
-
-        kfree(cached_files);
-        spinlock_release(&mnt->cached_files_lock);
+        /* The table is only changed with mnt->lock held, which also keeps
+         * unlink() from freeing files under us. Do not ht_lock() here:
+         * open() looks files up with mnt->lock held. */
+        spinlock_acquire(&mnt->lock);
+        struct cached_file_t *cached_file;
+        ht_foreach(struct cached_file_t, cached_file, mnt->cached_files)
+            synchronise_cached_file(cached_file);
+        spinlock_release(&mnt->lock);
 
         dynarray_unref(mounts, i);
     }
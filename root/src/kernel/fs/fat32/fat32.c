@@ -36,6 +36,8 @@ struct fs_ent {
     uint8_t attrib;
     uint32_t begin_cluster;
     uint32_t file_size;
+    /* Device offset of the directory entry, 0 for the root directory */
+    uint64_t ent_off;
 };
 
 struct mount_t {
@@ -78,6 +80,7 @@ static int read_ent(struct mount_t *mnt, uint32_t cluster,
     uint16_t cluster_hi = buf[0x14] | (buf[0x15] << 8);
     dest->begin_cluster = cluster_low | (cluster_hi << 16);
     memcpy(&dest->file_size, buf + 0x1C, 4);
+    dest->ent_off = off;
 
     return 1;
 }
@@ -370,7 +373,9 @@ static int fat32_fstat(int handle, struct stat *st) {
     int is_dir = handles[handle].ent.attrib & ATTRIB_DIR;
 
     st->st_dev = mounts[handles[handle].mount].device;
-    st->st_ino = 1;
+    /* Where the directory entry lives identifies a file, mappings rely on
+     * that. Empty files all have a first cluster of 0. */
+    st->st_ino = handles[handle].ent.ent_off;
     st->st_nlink = 1;
     st->st_uid = 1;
     st->st_gid = 1;
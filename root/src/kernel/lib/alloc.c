@@ -1,39 +1,240 @@
 #include <stddef.h>
+#include <stdint.h>
 #include <lib/alloc.h>
 #include <lib/klib.h>
+#include <lib/lock.h>
 #include <mm/mm.h>
+#include <sys/panic.h>
 
-typedef struct {
+/* Small allocations (up to SLAB_MAX_SIZE bytes) are served from one page
+ * slabs split into equally sized objects of a power of two size class.
+ * Every object is naturally aligned to its class size, so e.g. a 256 byte
+ * AHCI FIS buffer is 256 byte aligned and never crosses a page boundary.
+ * Larger allocations get their own run of pages straight from the PMM.
+ * In both cases a header sits at the start of the first page, so kfree()
+ * finds it by rounding the pointer down to a page boundary.
+ * All memory returned by kalloc() is zeroed. */
+
+#define SLAB_MAGIC  0x51ab51ab
+#define LARGE_MAGIC 0x1a26e000
+
+#define SLAB_MIN_SHIFT 4
+#define SLAB_MAX_SHIFT 11
+#define SLAB_MAX_SIZE ((size_t)1 << SLAB_MAX_SHIFT)
+#define SLAB_CLASS_COUNT (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+
+/* Fully free slabs kept around per class before pages go back to the PMM */
+#define SLAB_MAX_EMPTY 1
+
+struct slab_class_t;
+
+struct slab_t {
+    uint32_t magic;
+    uint32_t free_count;
+    struct slab_class_t *class;
+    void *free_list;
+    struct slab_t *next;
+    struct slab_t *prev;
+};
+
+struct slab_class_t {
+    lock_t lock;
+    size_t size;
+    size_t objs_per_slab;
+    size_t empty_slabs;
+    /* slabs with at least one free object */
+    struct slab_t *partial;
+};
+
+struct large_alloc_t {
+    uint32_t magic;
+    uint32_t unused;
     size_t pages;
     size_t size;
-} alloc_metadata_t;
+    size_t unused2;
+};
 
-void *kalloc(size_t size) {
-    size_t page_count = size / PAGE_SIZE;
+static struct slab_class_t slab_classes[SLAB_CLASS_COUNT];
 
-    if (size % PAGE_SIZE) page_count++;
+static inline size_t slab_first_obj(size_t size) {
+    return ((sizeof(struct slab_t) + size - 1) / size) * size;
+}
 
-    char *ptr = pmm_allocz(page_count + 1);
+void init_alloc(void) {
+    for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+        struct slab_class_t *class = &slab_classes[i];
+        class->lock = new_lock;
+        class->size = (size_t)1 << (i + SLAB_MIN_SHIFT);
+        class->objs_per_slab =
+            (PAGE_SIZE - slab_first_obj(class->size)) / class->size;
+        class->empty_slabs = 0;
+        class->partial = 0;
+    }
+}
+
+static inline size_t slab_class_index(size_t size) {
+    size_t i = 0;
+    while (((size_t)1 << (i + SLAB_MIN_SHIFT)) < size)
+        i++;
+    return i;
+}
 
-    if (!ptr) {
+static inline void slab_unlink(struct slab_class_t *class, struct slab_t *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        class->partial = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = 0;
+    slab->prev = 0;
+}
+
+static inline void slab_push(struct slab_class_t *class, struct slab_t *slab) {
+    slab->prev = 0;
+    slab->next = class->partial;
+    if (class->partial)
+        class->partial->prev = slab;
+    class->partial = slab;
+}
+
+/* Called with the class lock held */
+static struct slab_t *slab_grow(struct slab_class_t *class) {
+    char *page = pmm_alloc(1);
+    if (!page)
         return (void *)0;
+    page += MEM_PHYS_OFFSET;
+
+    struct slab_t *slab = (struct slab_t *)page;
+    slab->magic = SLAB_MAGIC;
+    slab->free_count = class->objs_per_slab;
+    slab->class = class;
+    slab->free_list = 0;
+
+    /* Thread the free list through the objects, lowest address first */
+    char *obj = page + slab_first_obj(class->size)
+                     + (class->objs_per_slab - 1) * class->size;
+    for (size_t i = 0; i < class->objs_per_slab; i++) {
+        *(void **)obj = slab->free_list;
+        slab->free_list = obj;
+        obj -= class->size;
     }
 
+    slab_push(class, slab);
+    class->empty_slabs++;
+
+    return slab;
+}
+
+static void *slab_alloc(size_t size) {
+    struct slab_class_t *class = &slab_classes[slab_class_index(size)];
+
+    spinlock_acquire(&class->lock);
+
+    struct slab_t *slab = class->partial;
+    if (!slab) {
+        slab = slab_grow(class);
+        if (!slab) {
+            spinlock_release(&class->lock);
+            return (void *)0;
+        }
+    }
+
+    if (slab->free_count == class->objs_per_slab)
+        class->empty_slabs--;
+
+    void *obj = slab->free_list;
+    slab->free_list = *(void **)obj;
+    if (!--slab->free_count)
+        slab_unlink(class, slab);
+
+    spinlock_release(&class->lock);
+
+    memset(obj, 0, class->size);
+    return obj;
+}
+
+static void slab_free(struct slab_t *slab, void *ptr) {
+    struct slab_class_t *class = slab->class;
+
+    spinlock_acquire(&class->lock);
+
+    *(void **)ptr = slab->free_list;
+    slab->free_list = ptr;
+
+    if (!slab->free_count++)
+        slab_push(class, slab);
+
+    if (slab->free_count == class->objs_per_slab) {
+        if (class->empty_slabs >= SLAB_MAX_EMPTY) {
+            slab_unlink(class, slab);
+            slab->magic = 0;
+            spinlock_release(&class->lock);
+            pmm_free((void *)((size_t)slab - MEM_PHYS_OFFSET), 1);
+            return;
+        }
+        class->empty_slabs++;
+    }
+
+    spinlock_release(&class->lock);
+}
+
+static void *large_alloc(size_t size) {
+    size_t page_count = (size + sizeof(struct large_alloc_t) + PAGE_SIZE - 1)
+                        / PAGE_SIZE;
+
+    char *ptr = pmm_allocz(page_count);
+    if (!ptr)
+        return (void *)0;
     ptr += MEM_PHYS_OFFSET;
 
-    alloc_metadata_t *metadata = (alloc_metadata_t *)ptr;
-    ptr += PAGE_SIZE;
+    struct large_alloc_t *header = (struct large_alloc_t *)ptr;
+    header->magic = LARGE_MAGIC;
+    header->pages = page_count;
+    header->size = size;
+
+    return ptr + sizeof(struct large_alloc_t);
+}
+
+void *kalloc(size_t size) {
+    if (!size)
+        size = 1;
 
-    metadata->pages = page_count;
-    metadata->size = size;
+    if (size <= SLAB_MAX_SIZE)
+        return slab_alloc(size);
 
-    return (void *)ptr;
+    return large_alloc(size);
 }
 
 void kfree(void *ptr) {
-    alloc_metadata_t *metadata = (alloc_metadata_t *)((size_t)ptr - PAGE_SIZE);
+    if (!ptr)
+        return;
+
+    void *page = (void *)((size_t)ptr & ~(PAGE_SIZE - 1));
+
+    switch (*(uint32_t *)page) {
+        case SLAB_MAGIC:
+            slab_free(page, ptr);
+            return;
+        case LARGE_MAGIC: {
+            struct large_alloc_t *header = page;
+            header->magic = 0;
+            pmm_free((void *)((size_t)header - MEM_PHYS_OFFSET), header->pages);
+            return;
+        }
+        default:
+            panic("kfree: bad pointer", (size_t)ptr, 0, NULL);
+    }
+}
+
+/* Usable size of an allocation, as far as krealloc() is concerned */
+static size_t alloc_size(void *ptr) {
+    void *page = (void *)((size_t)ptr & ~(PAGE_SIZE - 1));
+
+    if (*(uint32_t *)page == SLAB_MAGIC)
+        return ((struct slab_t *)page)->class->size;
 
-    pmm_free((void *)((size_t)metadata - MEM_PHYS_OFFSET), metadata->pages + 1);
+    return ((struct large_alloc_t *)page)->size;
 }
 
 void *krealloc(void *ptr, size_t new) {
@@ -44,13 +245,21 @@ void *krealloc(void *ptr, size_t new) {
         return (void *)0;
     }
 
-    /* Reference metadata page */
-    alloc_metadata_t *metadata = (alloc_metadata_t *)((size_t)ptr - PAGE_SIZE);
+    void *page = (void *)((size_t)ptr & ~(PAGE_SIZE - 1));
+    size_t old = alloc_size(ptr);
 
-    if ((metadata->size + PAGE_SIZE - 1) / PAGE_SIZE
-         == (new + PAGE_SIZE - 1) / PAGE_SIZE) {
-        metadata->size = new;
-        return ptr;
+    /* Stay in place if the new size lands in the same class or page run */
+    if (*(uint32_t *)page == SLAB_MAGIC) {
+        if (new <= SLAB_MAX_SIZE
+         && &slab_classes[slab_class_index(new)] == ((struct slab_t *)page)->class)
+            return ptr;
+    } else {
+        struct large_alloc_t *header = page;
+        if (header->pages == (new + sizeof(struct large_alloc_t) + PAGE_SIZE - 1)
+                             / PAGE_SIZE) {
+            header->size = new;
+            return ptr;
+        }
     }
 
     char *new_ptr;
@@ -58,12 +267,12 @@ void *krealloc(void *ptr, size_t new) {
         return (void *)0;
     }
 
-    if (metadata->size > new)
+    if (old > new)
         /* Copy all the data from the old pointer to the new pointer,
          * within the range specified by `size`. */
         memcpy(new_ptr, (char *)ptr, new);
     else
-        memcpy(new_ptr, (char *)ptr, metadata->size);
+        memcpy(new_ptr, (char *)ptr, old);
 
     kfree(ptr);
 
@@ -56,4 +56,15 @@
 #define disable_interrupts() ({ asm volatile ("cli"); })
 #define enable_interrupts() ({ asm volatile ("sti"); })
 
+/* Disable interrupts, returning the previous RFLAGS for restore_interrupts() */
+#define save_and_disable_interrupts() ({ \
+    uint64_t __flags; \
+    asm volatile ("pushfq; pop %0; cli" : "=r" (__flags) : : "memory"); \
+    __flags; \
+})
+
+#define restore_interrupts(flags) ({ \
+    asm volatile ("push %0; popfq" : : "r" ((uint64_t)(flags)) : "memory", "cc"); \
+})
+
 #endif
@@ -5,95 +5,149 @@
 #include <lib/lock.h>
 #include <lib/alloc.h>
 
+/* Arrays of refcounted elements addressed by index. Elements are stored
+ * in chunks of DYNARRAY_CHUNK_SIZE, allocated as the array grows and never
+ * moved or freed, so a slot stays valid memory forever and lookups take
+ * no lock: dynarray_getelem() only takes a reference, and only if the
+ * element is live. Freed slots go on a free list, which dynarray_add()
+ * takes from first. The lock only serialises adds and frees.
+ *
+ * A slot holds one reference while present, and one per getelem() that
+ * has not been unref'd yet; it is freed when the count drops to 0. name_i
+ * is the number of slots ever handed out, an upper bound for walks. */
+
+#define DYNARRAY_CHUNK_SIZE 64
+#define DYNARRAY_MAX_CHUNKS 1024
+#define DYNARRAY_MAX_ELEMENTS (DYNARRAY_CHUNK_SIZE * DYNARRAY_MAX_CHUNKS)
+
+/* End of a free list */
+#define DYNARRAY_NONE ((size_t)-1)
+
 #define dynarray_new(type, name) \
     static struct { \
         int refcount; \
         int present; \
+        size_t next_free; \
         type data; \
-    } **name; \
+    } *name[DYNARRAY_MAX_CHUNKS]; \
     static size_t name##_i = 0; \
+    static size_t name##_free = DYNARRAY_NONE; \
     static lock_t name##_lock = new_lock;
 
 #define public_dynarray_new(type, name) \
-    struct __##name##_struct **name; \
+    struct __##name##_struct *name[DYNARRAY_MAX_CHUNKS]; \
     size_t name##_i = 0; \
+    size_t name##_free = DYNARRAY_NONE; \
     lock_t name##_lock = new_lock;
 
 #define public_dynarray_prototype(type, name) \
     struct __##name##_struct { \
         int refcount; \
         int present; \
+        size_t next_free; \
         type data; \
     }; \
-    extern struct __##name##_struct **name; \
+    extern struct __##name##_struct *name[DYNARRAY_MAX_CHUNKS]; \
     extern size_t name##_i; \
+    extern size_t name##_free; \
     extern lock_t name##_lock;
 
-#define dynarray_remove(dynarray, element) ({ \
-    __label__ out; \
-    int ret; \
-    spinlock_acquire(&dynarray##_lock); \
-    if (!dynarray[element]) { \
-        ret = -1; \
-        goto out; \
-    } \
-    ret = 0; \
-    dynarray[element]->present = 0; \
-    if (!locked_dec(&dynarray[element]->refcount)) { \
-        kfree(dynarray[element]); \
-        dynarray[element] = 0; \
+#define dynarray_slot(dynarray, element) \
+    (&dynarray[(element) / DYNARRAY_CHUNK_SIZE][(element) % DYNARRAY_CHUNK_SIZE])
+
+/* Take a reference unless the count already dropped to 0 */
+__attribute__((always_inline)) __attribute__((unused)) static inline int dynarray_ref(int *refcount) {
+    int old = *(volatile int *)refcount;
+    for (;;) {
+        if (!old)
+            return 0;
+        int done;
+        asm volatile (
+            "lock cmpxchg %1, %3;"
+            : "+a" (old), "+m" (*refcount), "=@ccz" (done)
+            : "r" (old + 1)
+            : "memory"
+        );
+        if (done)
+            return 1;
+    }
+}
+
+#define dynarray_unref(dynarray, element) ({ \
+    size_t __i = (size_t)(element); \
+    if (__i < *(volatile size_t *)&dynarray##_i) { \
+        __typeof__(**dynarray) *__slot = dynarray_slot(dynarray, __i); \
+        if (!locked_dec(&__slot->refcount)) { \
+            spinlock_acquire(&dynarray##_lock); \
+            __slot->next_free = dynarray##_free; \
+            dynarray##_free = __i; \
+            spinlock_release(&dynarray##_lock); \
+        } \
     } \
-out: \
-    spinlock_release(&dynarray##_lock); \
-    ret; \
 })
 
-#define dynarray_unref(dynarray, element) ({ \
-    spinlock_acquire(&dynarray##_lock); \
-    if (dynarray[element] && !locked_dec(&dynarray[element]->refcount)) { \
-        kfree(dynarray[element]); \
-        dynarray[element] = 0; \
+#define dynarray_remove(dynarray, element) ({ \
+    int ret = -1; \
+    size_t __j = (size_t)(element); \
+    if (__j < *(volatile size_t *)&dynarray##_i) { \
+        __typeof__(**dynarray) *__rslot = dynarray_slot(dynarray, __j); \
+        spinlock_acquire(&dynarray##_lock); \
+        if (__rslot->present && __rslot->refcount) { \
+            __rslot->present = 0; \
+            ret = 0; \
+        } \
+        spinlock_release(&dynarray##_lock); \
+        if (!ret) \
+            dynarray_unref(dynarray, __j); \
     } \
-    spinlock_release(&dynarray##_lock); \
+    ret; \
 })
 
 #define dynarray_getelem(type, dynarray, element) ({ \
-    spinlock_acquire(&dynarray##_lock); \
     type *ptr = NULL; \
-    if (dynarray[element] && dynarray[element]->present) { \
-        ptr = &dynarray[element]->data; \
-        locked_inc(&dynarray[element]->refcount); \
+    size_t __k = (size_t)(element); \
+    if (__k < *(volatile size_t *)&dynarray##_i) { \
+        __typeof__(**dynarray) *__gslot = dynarray_slot(dynarray, __k); \
+        if (dynarray_ref(&__gslot->refcount)) { \
+            if (*(volatile int *)&__gslot->present) \
+                ptr = &__gslot->data; \
+            else \
+                dynarray_unref(dynarray, __k); \
+        } \
     } \
-    spinlock_release(&dynarray##_lock); \
     ptr; \
 })
 
 #define dynarray_add(type, dynarray, element) ({ \
-    __label__ fnd; \
     __label__ out; \
     int ret = -1; \
         \
     spinlock_acquire(&dynarray##_lock); \
         \
-    size_t i; \
-    for (i = 0; i < dynarray##_i; i++) { \
-        if (!dynarray[i]) \
-            goto fnd; \
+    size_t i = dynarray##_free; \
+    if (i != DYNARRAY_NONE) { \
+        dynarray##_free = dynarray_slot(dynarray, i)->next_free; \
+    } else { \
+        i = dynarray##_i; \
+        if (i == DYNARRAY_MAX_ELEMENTS) \
+            goto out; \
+        if (!(i % DYNARRAY_CHUNK_SIZE)) { \
+            void *chunk = kalloc(DYNARRAY_CHUNK_SIZE * sizeof(**dynarray)); \
+            if (!chunk) \
+                goto out; \
+            dynarray[i / DYNARRAY_CHUNK_SIZE] = chunk; \
+        } \
+        /* The chunk before the index that makes it reachable */ \
+        asm volatile ("" ::: "memory"); \
+        dynarray##_i = i + 1; \
     } \
         \
-    dynarray##_i += 256; \
-    void *tmp = krealloc(dynarray, dynarray##_i * sizeof(void *)); \
-    if (!tmp) \
-        goto out; \
-    dynarray = tmp; \
-        \
-fnd: \
-    dynarray[i] = kalloc(sizeof(**dynarray)); \
-    if (!dynarray[i]) \
-        goto out; \
-    dynarray[i]->refcount = 1; \
-    dynarray[i]->present = 1; \
-    dynarray[i]->data = *element; \
+    __typeof__(**dynarray) *slot = dynarray_slot(dynarray, i); \
+    slot->data = *element; \
+    slot->present = 1; \
+    /* Lookups only look at the slot once it holds a reference */ \
+    asm volatile ("" ::: "memory"); \
+    *(volatile int *)&slot->refcount = 1; \
         \
     ret = i; \
         \
@@ -102,29 +156,21 @@ out: \
     ret; \
 })
 
+/* Returns a reference to the first element for which cond, an expression
+ * of elem, holds; NULL if none */
 #define dynarray_search(type, dynarray, cond) ({ \
-    __label__ fnd; \
-    __label__ out; \
     type *ret = NULL; \
-        \
-    spinlock_acquire(&dynarray##_lock); \
-        \
-    size_t i; \
-    for (i = 0; i < dynarray##_i; i++) { \
-        if (!dynarray[i] || !dynarray[i]->present) \
+    size_t __n = *(volatile size_t *)&dynarray##_i; \
+    for (size_t __s = 0; __s < __n; __s++) { \
+        type *elem = dynarray_getelem(type, dynarray, __s); \
+        if (!elem) \
             continue; \
-        type *elem = &dynarray[i]->data; \
-        if (cond) \
-            goto fnd; \
+        if (cond) { \
+            ret = elem; \
+            break; \
+        } \
+        dynarray_unref(dynarray, __s); \
     } \
-    goto out; \
-        \
-fnd: \
-    ret = &dynarray[i]->data; \
-    locked_inc(&dynarray[i]->refcount); \
-        \
-out: \
-    spinlock_release(&dynarray##_lock); \
     ret; \
 })
 
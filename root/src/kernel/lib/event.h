@@ -5,6 +5,7 @@
 #include <sys/cpu.h>
 #include <proc/task.h>
 #include <lib/types.h>
+#include <lib/time.h>
 
 __attribute__((always_inline)) __attribute__((unused)) static inline int event_await(event_t *event) {
     if (locked_read(event_t, event)) {
@@ -20,6 +21,23 @@ __attribute__((always_inline)) __attribute__((unused)) static inline int event_a
     }
 }
 
+/* Like event_await(), but returns after ms at the latest */
+__attribute__((always_inline)) __attribute__((unused)) static inline int event_await_timeout(event_t *event, uint64_t ms) {
+    if (locked_read(event_t, event)) {
+        locked_dec(event);
+        return 0;
+    } else {
+        struct thread_t *current_thread = task_table[cpu_locals[current_cpu].current_task];
+        current_thread->event_deadline = uptime_raw + ms;
+        locked_write(event_t *, &current_thread->event_ptr, event);
+        yield();
+        current_thread->event_deadline = 0;
+        if (locked_read(int, &current_thread->event_abrt))
+            return -1;
+        return 0;
+    }
+}
+
 __attribute__((always_inline)) __attribute__((unused)) static inline void event_trigger(event_t *event) {
     locked_inc(event);
     return;
@@ -0,0 +1,255 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <lib/ht.h>
+#include <lib/klib.h>
+#include <lib/alloc.h>
+#include <lib/rand.h>
+#include <lib/seqlock.h>
+#include <lib/rcu.h>
+
+/* Open addressing with Robin Hood linear probing: an element is stored at
+ * the first free slot from its hash, but displaces any element it finds
+ * that sits closer to its own hash slot. Probe sequences thus stay short
+ * even at high load, and a lookup can stop at the first element closer to
+ * home than it is. Removals shift the following elements back instead of
+ * leaving tombstones. The slot count is a power of two, starting small
+ * and doubling at 3/4 load, so small tables cost a few hundred bytes.
+ *
+ * Lookups and walks take no lock. Writers are serialised by the seqlock,
+ * and a lookup retries if a writer came along meanwhile. Readers look at
+ * the slots inside an RCU read section, and slot arrays replaced by a
+ * bigger one are freed after a grace period. Readers may still find an
+ * element that was just removed and freed, whose memory stays mapped.
+ * Names are therefore compared bounded to the key size, and the lookup
+ * result only trusted if the sequence did not change. */
+
+#define HT_MIN_SLOTS 8
+
+struct ht_slot_t {
+    uint64_t hash;
+    /* NULL if free */
+    void *elem;
+};
+
+struct ht_slots_t {
+    struct rcu_head_t rcu;
+    /* Slot count minus one */
+    size_t mask;
+    struct ht_slot_t slot[];
+};
+
+/* SipHash-1-3 of a string, keyed by the table seed */
+
+#define SIPROUND ({ \
+    v0 += v1; v1 = (v1 << 13) | (v1 >> 51); v1 ^= v0; v0 = (v0 << 32) | (v0 >> 32); \
+    v2 += v3; v3 = (v3 << 16) | (v3 >> 48); v3 ^= v2; \
+    v0 += v3; v3 = (v3 << 21) | (v3 >> 43); v3 ^= v0; \
+    v2 += v1; v1 = (v1 << 17) | (v1 >> 47); v1 ^= v2; v2 = (v2 << 32) | (v2 >> 32); \
+})
+
+static uint64_t ht_hash(struct ht_t *ht, const char *str, size_t key_size) {
+    size_t len = 0;
+    while (len < key_size && str[len])
+        len++;
+
+    uint64_t v0 = ht->seed[0] ^ 0x736f6d6570736575;
+    uint64_t v1 = ht->seed[1] ^ 0x646f72616e646f6d;
+    uint64_t v2 = ht->seed[0] ^ 0x6c7967656e657261;
+    uint64_t v3 = ht->seed[1] ^ 0x7465646279746573;
+
+    const uint8_t *p = (const uint8_t *)str;
+    size_t left = len;
+    for (; left >= 8; p += 8, left -= 8) {
+        uint64_t m;
+        memcpy(&m, p, 8);
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    uint64_t b = (uint64_t)len << 56;
+    for (size_t i = 0; i < left; i++)
+        b |= (uint64_t)p[i] << (i * 8);
+
+    v3 ^= b;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static struct ht_slots_t *ht_alloc_slots(size_t count) {
+    struct ht_slots_t *slots =
+        kalloc(sizeof(struct ht_slots_t) + count * sizeof(struct ht_slot_t));
+    if (!slots)
+        return NULL;
+    slots->mask = count - 1;
+    return slots;
+}
+
+/* Probe distance of the element in slot i from its hash slot */
+static inline size_t ht_dist(struct ht_slots_t *slots, size_t i) {
+    return (i - slots->slot[i].hash) & slots->mask;
+}
+
+static void ht_insert(struct ht_slots_t *slots, uint64_t hash, void *elem) {
+    size_t i = hash & slots->mask;
+    for (size_t dist = 0; ; dist++, i = (i + 1) & slots->mask) {
+        struct ht_slot_t *slot = &slots->slot[i];
+        if (!slot->elem) {
+            slot->hash = hash;
+            slot->elem = elem;
+            return;
+        }
+        size_t slot_dist = ht_dist(slots, i);
+        if (slot_dist < dist) {
+            uint64_t tmp_hash = slot->hash;
+            void *tmp_elem = slot->elem;
+            slot->hash = hash;
+            slot->elem = elem;
+            hash = tmp_hash;
+            elem = tmp_elem;
+            dist = slot_dist;
+        }
+    }
+}
+
+/* Returns the slot index, -1 if not found. Called with the seqlock either
+ * held or being read under. */
+static ssize_t ht_find(struct ht_slots_t *slots, uint64_t hash, const char *name,
+                       size_t key_offset, size_t key_size) {
+    size_t i = hash & slots->mask;
+    for (size_t dist = 0; dist <= slots->mask; dist++, i = (i + 1) & slots->mask) {
+        struct ht_slot_t *slot = &slots->slot[i];
+        void *elem = *(void *volatile *)&slot->elem;
+        if (!elem || ht_dist(slots, i) < dist)
+            return -1;
+        if (slot->hash == hash
+         && !strncmp((const char *)elem + key_offset, name, key_size))
+            return i;
+    }
+    return -1;
+}
+
+int __ht_init(struct ht_t *ht) {
+    ht->slots = ht_alloc_slots(HT_MIN_SLOTS);
+    if (!ht->slots)
+        return -1;
+    ht->count = 0;
+    rand_fill(ht->seed, sizeof(ht->seed));
+    ht->lock = new_seqlock;
+    return 0;
+}
+
+void *__ht_get(struct ht_t *ht, const char *name, size_t key_offset, size_t key_size) {
+    uint64_t hash = ht_hash(ht, name, key_size);
+    void *ret;
+    uint32_t seq;
+
+    do {
+        seq = seqlock_read_begin(&ht->lock);
+        uint64_t flags = rcu_read_lock();
+        struct ht_slots_t *slots = rcu_dereference(ht->slots);
+        ssize_t i = ht_find(slots, hash, name, key_offset, key_size);
+        ret = i == -1 ? NULL : slots->slot[i].elem;
+        rcu_read_unlock(flags);
+    } while (seqlock_read_retry(&ht->lock, seq));
+
+    return ret;
+}
+
+int __ht_add(struct ht_t *ht, void *elem, size_t key_offset, size_t key_size) {
+    const char *name = (const char *)elem + key_offset;
+    uint64_t hash = ht_hash(ht, name, key_size);
+    int ret = 0;
+    struct ht_slots_t *retired = NULL;
+
+    seqlock_write_acquire(&ht->lock);
+
+    struct ht_slots_t *slots = ht->slots;
+
+    if (ht_find(slots, hash, name, key_offset, key_size) != -1) {
+        ret = -1;
+        goto out;
+    }
+
+    if ((ht->count + 1) * 4 > (slots->mask + 1) * 3) {
+        struct ht_slots_t *new_slots = ht_alloc_slots((slots->mask + 1) * 2);
+        if (!new_slots) {
+            ret = -1;
+            goto out;
+        }
+        for (size_t i = 0; i <= slots->mask; i++)
+            if (slots->slot[i].elem)
+                ht_insert(new_slots, slots->slot[i].hash, slots->slot[i].elem);
+        retired = slots;
+        rcu_assign_pointer(ht->slots, new_slots);
+        slots = new_slots;
+    }
+
+    ht_insert(slots, hash, elem);
+    ht->count++;
+
+out:
+    seqlock_write_release(&ht->lock);
+    if (retired)
+        call_rcu(&retired->rcu, rcu_kfree);
+    return ret;
+}
+
+void *__ht_remove(struct ht_t *ht, const char *name, size_t key_offset, size_t key_size) {
+    uint64_t hash = ht_hash(ht, name, key_size);
+    void *ret = NULL;
+
+    seqlock_write_acquire(&ht->lock);
+
+    struct ht_slots_t *slots = ht->slots;
+
+    ssize_t found = ht_find(slots, hash, name, key_offset, key_size);
+    if (found == -1)
+        goto out;
+
+    ret = slots->slot[found].elem;
+
+    /* Shift back the elements after it, up to one already in its place */
+    size_t i = found;
+    for (;;) {
+        size_t next = (i + 1) & slots->mask;
+        if (!slots->slot[next].elem || !ht_dist(slots, next))
+            break;
+        slots->slot[i] = slots->slot[next];
+        i = next;
+    }
+    slots->slot[i].elem = NULL;
+    slots->slot[i].hash = 0;
+
+    ht->count--;
+
+out:
+    seqlock_write_release(&ht->lock);
+    return ret;
+}
+
+/* Returns the element at or after slot *i and moves *i past it, NULL at the end */
+void *__ht_next(struct ht_t *ht, size_t *i) {
+    void *elem = NULL;
+
+    uint64_t flags = rcu_read_lock();
+    struct ht_slots_t *slots = rcu_dereference(ht->slots);
+
+    for (; *i <= slots->mask; (*i)++) {
+        elem = *(void *volatile *)&slots->slot[*i].elem;
+        if (elem) {
+            (*i)++;
+            break;
+        }
+    }
+
+    rcu_read_unlock(flags);
+    return elem;
+}
@@ -2,172 +2,64 @@
 #define __HT_H__
 
 #include <stddef.h>
-#include <lib/alloc.h>
-#include <mm/mm.h>
-#include <lib/lock.h>
-#include <lib/rand.h>
+#include <stdint.h>
+#include <lib/seqlock.h>
 
-#define ENTRIES_PER_HASHING_LEVEL 4096
+/* Hash tables of pointers to structures, keyed by the structure's "name"
+ * member, a char array. See lib/ht.c. */
 
-static inline uint64_t ht_hash_str(const char *str, uint64_t seed) {
-    /* djb2
-     * http://www.cse.yorku.ca/~oz/hash.html
-     */
-    int c;
-    while ((c = *str++))
-        seed = ((seed << 5) + seed) + c;
-    return ((seed % (ENTRIES_PER_HASHING_LEVEL - 1)) + 1);
-}
+struct ht_slots_t;
+
+struct ht_t {
+    struct ht_slots_t *slots;
+    size_t count;
+    /* SipHash key, random per table */
+    uint64_t seed[2];
+    seqlock_t lock;
+};
 
 #define ht_new(type, name) \
-    type **name; \
-    lock_t name##_lock;
+    struct ht_t name
+
+/* Offset and size of the key in the elements */
+#define ht_key(type) offsetof(type, name), sizeof(((type *)0)->name)
 
-#define ht_dump(type, hashtable, size) ({ \
-    void **buf = NULL; \
-    *size = 0; \
-    type **ret = (type **)__ht_dump((void **)hashtable, buf, size); \
-    ret; \
-})
+int __ht_init(struct ht_t *);
+void *__ht_get(struct ht_t *, const char *, size_t, size_t);
+int __ht_add(struct ht_t *, void *, size_t, size_t);
+void *__ht_remove(struct ht_t *, const char *, size_t, size_t);
+void *__ht_next(struct ht_t *, size_t *);
 
-__attribute__((unused)) static void **__ht_dump(void **ht, void **buf, size_t *size) {
-    for (size_t i = 1; i < ENTRIES_PER_HASHING_LEVEL; i++) {
-        if (!ht[i]) {
-            continue;
-        } else if ((size_t)ht[i] & 1) {
-            void **tmp = __ht_dump((void *)((size_t)ht[i] - 1), buf, size);
-            if (!tmp)
-                return NULL;
-            buf = tmp;
-        } else {
-            void **tmp = krealloc(buf, sizeof(void *) * (*size + 1));
-            if (!tmp) {
-                kfree(buf);
-                return NULL;
-            }
-            buf = tmp;
-            buf[(*size)++] = ht[i];
-        }
-    }
+/* Returns -1 on failure */
+#define ht_init(hashtable) __ht_init(&(hashtable))
 
-    return buf;
-}
+/* Returns NULL if not found. Takes no lock. */
+#define ht_get(type, hashtable, nname) \
+    ((type *)__ht_get(&(hashtable), (nname), ht_key(type)))
 
-#define ht_init(hashtable) ({ \
-    __label__ out; \
-    int ret = 0; \
-    hashtable = pmm_allocz((ENTRIES_PER_HASHING_LEVEL * sizeof(void *)) / PAGE_SIZE); \
-    if (!hashtable) { \
-        ret = -1; \
-        goto out; \
-    } \
-    hashtable = (void *)hashtable + MEM_PHYS_OFFSET; \
-    hashtable##_lock = new_lock; \
-    while (!(hashtable[0] = (void *)rand64())); \
-out: \
-    ret; \
-})
+/* Adds an element, a pointer to a type structure. Returns -1 if an element
+ * of the same name is present or on allocation failure. */
+#define ht_add(type, hashtable, element) \
+    __ht_add(&(hashtable), (element), ht_key(type))
 
-#define ht_get(type, hashtable, nname) ({ \
-    __label__ out; \
-    type *ret; \
-        \
-    spinlock_acquire(&hashtable##_lock); \
-    type **ht = hashtable; \
-    for (;;) { \
-        uint64_t hash = ht_hash_str(nname, (uint64_t)ht[0]); \
-        if (!ht[hash]) { \
-            ret = NULL; \
-            goto out; \
-        } else if ((size_t)ht[hash] & 1) { \
-            ht = (void *)((size_t)ht[hash] - 1); \
-            continue; \
-        } else { \
-            if (strcmp(nname, ((type **)ht)[hash]->name)) { \
-                ret = NULL; \
-                goto out; \
-            } \
-            ret = ht[hash]; \
-            goto out; \
-        } \
-    } \
-out: \
-    spinlock_release(&hashtable##_lock); \
-    ret; \
-})
+/* Returns the element removed, NULL if not found */
+#define ht_remove(type, hashtable, nname) \
+    ((type *)__ht_remove(&(hashtable), (nname), ht_key(type)))
 
-#define ht_remove(type, hashtable, nname) ({ \
-    __label__ out; \
-    type *ret; \
-        \
-    spinlock_acquire(&hashtable##_lock); \
-    type **ht = hashtable; \
-    for (;;) { \
-        uint64_t hash = ht_hash_str(nname, (uint64_t)ht[0]); \
-        if (!ht[hash]) { \
-            ret = NULL; \
-            goto out; \
-        } else if ((size_t)ht[hash] & 1) { \
-            ht = (void *)((size_t)ht[hash] - 1); \
-            continue; \
-        } else { \
-            if (strcmp(nname, ((type **)ht)[hash]->name)) { \
-                ret = NULL; \
-                goto out; \
-            } \
-            ret = ht[hash]; \
-            ht[hash] = 0; \
-            goto out; \
-        } \
-    } \
-out: \
-    spinlock_release(&hashtable##_lock); \
-    ret; \
-})
+/* Excludes adds and removes, and lookups, for a stable ht_foreach() */
+#define ht_lock(hashtable) seqlock_write_acquire(&(hashtable).lock)
+#define ht_unlock(hashtable) seqlock_write_release(&(hashtable).lock)
 
-// Adds an element to a hash table with these prerequisites:
-// the element shall be a pointer to a structure containing a "name"
-// element which is of type "char *". This "name" element shall be used
-// for hashing purposes.
-#define ht_add(type, hashtable, element) ({ \
-    __label__ out; \
-    int ret = 0; \
-        \
-    spinlock_acquire(&hashtable##_lock); \
-    type **ht = hashtable; \
-        \
-    for (;;) { \
-        uint64_t hash = ht_hash_str(element->name, (uint64_t)ht[0]); \
-        if (!ht[hash]) { \
-            ht[hash] = element; \
-            goto out; \
-        } else if ((size_t)ht[hash] & 1) { \
-            ht = (void *)((size_t)ht[hash] - 1); \
-            continue; \
-        } else { \
-            if (!strcmp(element->name, ht[hash]->name)) { \
-                ret = -1; \
-                goto out; \
-            } \
-            type **new_ht = pmm_allocz((ENTRIES_PER_HASHING_LEVEL * sizeof(void *)) / PAGE_SIZE); \
-            if (!new_ht) { \
-                ret = -1; \
-                goto out; \
-            } \
-            new_ht = (void *)new_ht + MEM_PHYS_OFFSET; \
-            type *old_elem = ht[hash]; \
-            ht[hash] = (void *)((size_t)new_ht + 1); \
-            ht = new_ht; \
-            while (!(ht[0] = (void *)rand64())); \
-            uint64_t old_elem_hash = ht_hash_str(old_elem->name, (uint64_t)ht[0]); \
-            ht[old_elem_hash] = old_elem; \
-            continue; \
-        } \
-    } \
-    \
-out: \
-    spinlock_release(&hashtable##_lock); \
-    ret; \
-})
+/* Visits every element, without allocating:
+ *
+ *     struct fs_t *fs;
+ *     ht_foreach(struct fs_t, fs, filesystems)
+ *         fs->sync();
+ *
+ * Takes no lock. Without ht_lock() held, elements added or removed during
+ * the walk may or may not be visited, and others may be visited twice. */
+#define ht_foreach(type, elem, hashtable) \
+    for (size_t __ht_i = 0; \
+         ((elem) = (type *)__ht_next(&(hashtable), &__ht_i)); )
 
 #endif
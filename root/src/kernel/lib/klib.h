@@ -34,6 +34,16 @@ __attribute__((always_inline)) inline void atomic_fetch_add_int(int *p, int *v,
     *v = h;
 }
 
+__attribute__((always_inline)) inline uint64_t atomic_fetch_add_uint64(uint64_t *p, uint64_t x) {
+    asm volatile (
+        "lock xadd qword ptr [%1], %0;"
+        : "+r" (x)
+        : "r" (p)
+        : "memory"
+    );
+    return x;
+}
+
 __attribute__((always_inline)) inline void atomic_add_uint64_relaxed(uint64_t *p, uint64_t x) {
     asm volatile (
         "lock xadd qword ptr [%1], %0;"
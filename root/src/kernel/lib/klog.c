@@ -0,0 +1,531 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <lib/klib.h>
+#include <lib/klog.h>
+#include <lib/lock.h>
+#include <lib/qemu.h>
+#include <lib/event.h>
+#include <lib/rand.h>
+#include <lib/time.h>
+#include <lib/alloc.h>
+#include <lib/cmdline.h>
+#include <devices/term/tty/tty.h>
+#include <misc/pit.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+
+/* Kernel log. kprint() only formats the message into the next record of
+ * a ring belonging to the CPU it runs on; the flusher thread later drains
+ * all rings in timestamp order, writes the messages out to the debug
+ * outputs and keeps a backlog of them for /dev/kmsg. Records are claimed
+ * with an atomic ticket, so kprint() takes no locks, can be used from
+ * interrupt handlers, and never waits for an output. Until init_klog()
+ * and for panics messages are written out synchronously instead. */
+
+#define KPRINT_BUF_MAX 256
+
+struct klog_record_t {
+    /* Ticket of the message plus one once complete, 0 while written */
+    uint64_t seq;
+    uint64_t tsc;
+    uint64_t uptime;
+    int type;
+    char text[KPRINT_BUF_MAX];
+};
+
+struct klog_ring_t {
+    /* Next ticket to hand out */
+    uint64_t head;
+    /* Next ticket to flush, only touched by the flusher */
+    uint64_t tail;
+    struct klog_record_t records[KLOG_RING_SIZE];
+};
+
+int klog_level = KPRN_DBG;
+
+static int klog_ready = 0;
+static struct klog_ring_t *klog_rings[MAX_CPUS];
+static event_t klog_event = 0;
+
+/* Next record of each ring, taken out but not written yet */
+static struct klog_record_t *klog_pending;
+static int klog_pending_valid[MAX_CPUS];
+/* Messages overwritten before they were flushed */
+static uint64_t klog_dropped = 0;
+static uint64_t klog_dropped_reported = 0;
+
+static char klog_backlog[KLOG_BACKLOG_SIZE];
+/* Bytes ever appended to the backlog */
+static size_t klog_backlog_end = 0;
+static lock_t klog_backlog_lock = new_lock;
+
+/* Rank of each message type, from least to most severe */
+static const int klog_severity[] = {
+    [KPRN_DBG] = 0,
+    [KPRN_INFO] = 1,
+    [KPRN_WARN] = 2,
+    [KPRN_ERR] = 3,
+    [KPRN_PANIC] = 4
+};
+
+static const char *klog_level_names[] = {
+    [KPRN_DBG] = "debug",
+    [KPRN_INFO] = "info",
+    [KPRN_WARN] = "warn",
+    [KPRN_ERR] = "err",
+    [KPRN_PANIC] = "panic"
+};
+
+/* Returns the KPRN_ type called name, -1 if there is none */
+int klog_parse_level(const char *name) {
+    for (int i = 0; i <= KPRN_PANIC; i++)
+        if (!strcmp(klog_level_names[i], name))
+            return i;
+    return -1;
+}
+
+const char *klog_level_name(int type) {
+    return klog_level_names[type];
+}
+
+static void kputs(char *kprint_buf, size_t *kprint_buf_i, const char *string) {
+    size_t i;
+
+    for (i = 0; string[i]; i++) {
+        if (*kprint_buf_i == (KPRINT_BUF_MAX - 1))
+            break;
+        kprint_buf[(*kprint_buf_i)++] = string[i];
+    }
+
+    kprint_buf[*kprint_buf_i] = 0;
+
+    return;
+}
+
+static void knputs(char *kprint_buf, size_t *kprint_buf_i, const char *string, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (*kprint_buf_i == (KPRINT_BUF_MAX - 1))
+            break;
+        kprint_buf[(*kprint_buf_i)++] = string[i];
+    }
+
+    kprint_buf[*kprint_buf_i] = 0;
+
+    return;
+}
+
+static void kputchar(char *kprint_buf, size_t *kprint_buf_i, char c) {
+    if (*kprint_buf_i < (KPRINT_BUF_MAX - 1)) {
+        kprint_buf[(*kprint_buf_i)++] = c;
+    }
+
+    kprint_buf[*kprint_buf_i] = 0;
+
+    return;
+}
+
+static void kprn_i(char *kprint_buf, size_t *kprint_buf_i, int64_t x) {
+    int i;
+    char buf[21] = {0};
+
+    if (!x) {
+        kputchar(kprint_buf, kprint_buf_i, '0');
+        return;
+    }
+
+    int sign = x < 0;
+    if (sign) x = -x;
+
+    for (i = 19; x; i--) {
+        buf[i] = (x % 10) + 0x30;
+        x = x / 10;
+    }
+    if (sign)
+        buf[i] = '-';
+    else
+        i++;
+
+    kputs(kprint_buf, kprint_buf_i, buf + i);
+
+    return;
+}
+
+static void kprn_ui(char *kprint_buf, size_t *kprint_buf_i, uint64_t x) {
+    int i;
+    char buf[21] = {0};
+
+    if (!x) {
+        kputchar(kprint_buf, kprint_buf_i, '0');
+        return;
+    }
+
+    for (i = 19; x; i--) {
+        buf[i] = (x % 10) + 0x30;
+        x = x / 10;
+    }
+
+    i++;
+    kputs(kprint_buf, kprint_buf_i, buf + i);
+
+    return;
+}
+
+static const char hex_to_ascii_tab[] = {
+    '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+};
+
+static void kprn_x(char *kprint_buf, size_t *kprint_buf_i, uint64_t x) {
+    int i;
+    char buf[17] = {0};
+
+    if (!x) {
+        kputs(kprint_buf, kprint_buf_i, "0x0");
+        return;
+    }
+
+    for (i = 15; x; i--) {
+        buf[i] = hex_to_ascii_tab[(x % 16)];
+        x = x / 16;
+    }
+
+    i++;
+    kputs(kprint_buf, kprint_buf_i, "0x");
+    kputs(kprint_buf, kprint_buf_i, buf + i);
+
+    return;
+}
+
+static void print_timestamp(char *kprint_buf, size_t *kprint_buf_i, int type,
+                            uint64_t uptime, int colour) {
+    kputs(kprint_buf, kprint_buf_i, colour ? "\e[37m[" : "[");
+    kprn_ui(kprint_buf, kprint_buf_i, uptime / PIT_FREQUENCY);
+    kputs(kprint_buf, kprint_buf_i, ".");
+    kprn_ui(kprint_buf, kprint_buf_i, uptime);
+    kputs(kprint_buf, kprint_buf_i, "] ");
+
+    switch (type) {
+        case KPRN_INFO:
+            kputs(kprint_buf, kprint_buf_i, colour ? "\e[36minfo\e[37m: " : "info: ");
+            break;
+        case KPRN_WARN:
+            kputs(kprint_buf, kprint_buf_i, colour ? "\e[33mwarning\e[37m: " : "warning: ");
+            break;
+        case KPRN_ERR:
+            kputs(kprint_buf, kprint_buf_i, colour ? "\e[31mERROR\e[37m: " : "ERROR: ");
+            break;
+        case KPRN_PANIC:
+            kputs(kprint_buf, kprint_buf_i, colour ? "\e[31mPANIC\e[37m: " : "PANIC: ");
+            break;
+        default:
+        case KPRN_DBG:
+            kputs(kprint_buf, kprint_buf_i, colour ? "\e[36mDEBUG\e[37m: " : "DEBUG: ");
+            break;
+    }
+}
+
+static void klog_output(const char *kprint_buf, size_t kprint_buf_i, int urgent) {
+    if (urgent) {
+        qemu_debug_puts_urgent(kprint_buf);
+        return;
+    }
+    #ifdef _DBGOUT_QEMU_
+        qemu_debug_puts(kprint_buf);
+    #endif
+    #ifdef _DBGOUT_TTY_
+        tty_write(0, kprint_buf, 0, kprint_buf_i);
+    #endif
+    (void)kprint_buf;
+    (void)kprint_buf_i;
+}
+
+/* Panics don't wait for the lock, whoever holds it is not coming back */
+static void klog_backlog_append(const char *buf, size_t len, int urgent) {
+    if (!urgent)
+        spinlock_acquire(&klog_backlog_lock);
+
+    for (size_t i = 0; i < len; i++)
+        klog_backlog[(klog_backlog_end + i) % KLOG_BACKLOG_SIZE] = buf[i];
+    klog_backlog_end += len;
+
+    if (!urgent)
+        spinlock_release(&klog_backlog_lock);
+}
+
+/* Copies up to count bytes of the backlog from offset loc on. The backlog
+ * starts with the oldest complete line still around. */
+size_t klog_read_backlog(void *buf, size_t loc, size_t count) {
+    spinlock_acquire(&klog_backlog_lock);
+
+    size_t start = 0;
+    if (klog_backlog_end > KLOG_BACKLOG_SIZE) {
+        start = klog_backlog_end - KLOG_BACKLOG_SIZE;
+        while (start < klog_backlog_end
+            && klog_backlog[start++ % KLOG_BACKLOG_SIZE] != '\n');
+    }
+
+    size_t avail = klog_backlog_end - start;
+    if (loc >= avail) {
+        spinlock_release(&klog_backlog_lock);
+        return 0;
+    }
+    if (count > avail - loc)
+        count = avail - loc;
+
+    char *dest = buf;
+    for (size_t i = 0; i < count; i++)
+        dest[i] = klog_backlog[(start + loc + i) % KLOG_BACKLOG_SIZE];
+
+    spinlock_release(&klog_backlog_lock);
+    return count;
+}
+
+/* Write a message out, one line at a time with a timestamp in front */
+static void klog_emit(struct klog_record_t *record, int urgent) {
+    char kprint_buf[KPRINT_BUF_MAX];
+    const char *line = record->text;
+
+    do {
+        size_t len = 0;
+        while (line[len] && line[len] != '\n')
+            len++;
+
+        for (int colour = 1; colour >= 0; colour--) {
+            size_t kprint_buf_i = 0;
+            print_timestamp(kprint_buf, &kprint_buf_i, record->type,
+                            record->uptime, colour);
+            knputs(kprint_buf, &kprint_buf_i, line, len);
+            if (kprint_buf_i == KPRINT_BUF_MAX - 1)
+                kprint_buf_i--;
+            kputchar(kprint_buf, &kprint_buf_i, '\n');
+
+            if (colour)
+                klog_output(kprint_buf, kprint_buf_i, urgent);
+            else
+                klog_backlog_append(kprint_buf, kprint_buf_i, urgent);
+        }
+
+        line += len;
+    } while (*line++);
+}
+
+/* Take the next message out of a ring. Returns 0 if there is none ready. */
+static int klog_ring_take(struct klog_ring_t *ring, struct klog_record_t *out) {
+    for (;;) {
+        uint64_t head = locked_read(uint64_t, &ring->head);
+        if (ring->tail == head)
+            return 0;
+
+        /* Writers went around the ring, what we did not get to is gone */
+        if (head - ring->tail > KLOG_RING_SIZE) {
+            klog_dropped += head - KLOG_RING_SIZE - ring->tail;
+            ring->tail = head - KLOG_RING_SIZE;
+        }
+
+        struct klog_record_t *record = &ring->records[ring->tail % KLOG_RING_SIZE];
+        uint64_t seq = locked_read(uint64_t, &record->seq);
+
+        /* Its writer did not finish yet */
+        if (seq <= ring->tail)
+            return 0;
+
+        if (seq == ring->tail + 1) {
+            memcpy(out, record, sizeof(struct klog_record_t));
+            /* Unless it got overwritten while being copied */
+            if (locked_read(uint64_t, &record->seq) == seq) {
+                ring->tail++;
+                return 1;
+            }
+        }
+
+        klog_dropped++;
+        ring->tail++;
+    }
+}
+
+/* Write out everything in the rings, oldest first. Only the flusher thread
+ * calls this, or a panic once every other CPU is halted. */
+static void klog_flush(int urgent) {
+    for (;;) {
+        int oldest = -1;
+        for (int cpu = 0; cpu < smp_cpu_count; cpu++) {
+            if (!klog_pending_valid[cpu])
+                klog_pending_valid[cpu] = klog_ring_take(klog_rings[cpu],
+                                                         &klog_pending[cpu]);
+            if (klog_pending_valid[cpu]
+             && (oldest == -1 || klog_pending[cpu].tsc < klog_pending[oldest].tsc))
+                oldest = cpu;
+        }
+
+        if (klog_dropped != klog_dropped_reported) {
+            struct klog_record_t record = {0};
+            record.type = KPRN_WARN;
+            record.uptime = uptime_raw;
+            size_t i = 0;
+            kputs(record.text, &i, "klog: ");
+            kprn_ui(record.text, &i, klog_dropped - klog_dropped_reported);
+            kputs(record.text, &i, " messages dropped");
+            klog_dropped_reported = klog_dropped;
+            klog_emit(&record, urgent);
+        }
+
+        if (oldest == -1)
+            return;
+
+        klog_emit(&klog_pending[oldest], urgent);
+        klog_pending_valid[oldest] = 0;
+    }
+}
+
+void klog_flusher(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        event_await(&klog_event);
+        klog_flush(0);
+    }
+}
+
+/* Called once the scheduler runs and all CPUs are up */
+void init_klog(void) {
+    char *level = cmdline_get_value("loglevel");
+    if (level) {
+        int type = klog_parse_level(level);
+        if (type == -1)
+            kprint(KPRN_WARN, "klog: Unknown log level %s", level);
+        else
+            klog_level = type;
+    }
+
+    klog_pending = kalloc(smp_cpu_count * sizeof(struct klog_record_t));
+    if (!klog_pending) {
+        kprint(KPRN_WARN, "klog: Out of memory, logging synchronously");
+        return;
+    }
+    for (int cpu = 0; cpu < smp_cpu_count; cpu++) {
+        klog_rings[cpu] = kalloc(sizeof(struct klog_ring_t));
+        if (!klog_rings[cpu]) {
+            for (int i = 0; i < cpu; i++)
+                kfree(klog_rings[i]);
+            kfree(klog_pending);
+            kprint(KPRN_WARN, "klog: Out of memory, logging synchronously");
+            return;
+        }
+    }
+
+    task_tcreate(0, tcreate_fn_call, tcreate_fn_call_data(0, klog_flusher, 0));
+
+    locked_write(int, &klog_ready, 1);
+}
+
+static void klog_write(int type, const char *text, size_t len) {
+    if (type == KPRN_PANIC || !locked_read(int, &klog_ready)) {
+        struct klog_record_t record;
+        record.tsc = rdtsc(uint64_t);
+        record.uptime = uptime_raw;
+        record.type = type;
+        memcpy(record.text, text, len + 1);
+
+        if (type == KPRN_PANIC) {
+            /* Whatever is still in the rings happened first */
+            if (locked_read(int, &klog_ready))
+                klog_flush(1);
+            klog_emit(&record, 1);
+        } else {
+            klog_emit(&record, 0);
+        }
+        return;
+    }
+
+    struct klog_ring_t *ring = klog_rings[current_cpu];
+    uint64_t ticket = atomic_fetch_add_uint64(&ring->head, 1);
+    struct klog_record_t *record = &ring->records[ticket % KLOG_RING_SIZE];
+
+    locked_write(uint64_t, &record->seq, 0);
+    record->tsc = rdtsc(uint64_t);
+    record->uptime = uptime_raw;
+    record->type = type;
+    memcpy(record->text, text, len + 1);
+    locked_write(uint64_t, &record->seq, ticket + 1);
+
+    event_trigger(&klog_event);
+}
+
+void kprint(int type, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    kvprint(type, fmt, args);
+    va_end(args);
+
+    return;
+}
+
+void kvprint(int type, const char *fmt, va_list args) {
+    if (type != KPRN_PANIC
+     && klog_severity[type] < klog_severity[klog_level])
+        return;
+
+    char kprint_buf[KPRINT_BUF_MAX];
+    size_t kprint_buf_i = 0;
+
+    kprint_buf[0] = 0;
+
+    char *str;
+    size_t str_len;
+
+    for (;;) {
+        char c;
+
+        while (*fmt && *fmt != '%') {
+            kputchar(kprint_buf, &kprint_buf_i, *fmt);
+            fmt++;
+        }
+        if (!*fmt++)
+            goto out;
+        switch (*fmt++) {
+            case 's':
+                str = (char *)va_arg(args, const char *);
+                if (!str)
+                    kputs(kprint_buf, &kprint_buf_i, "(null)");
+                else
+                    kputs(kprint_buf, &kprint_buf_i, str);
+                break;
+            case 'S':
+                str_len = va_arg(args, size_t);
+                str = (char *)va_arg(args, const char *);
+                knputs(kprint_buf, &kprint_buf_i, str, str_len);
+                break;
+            case 'd':
+                kprn_i(kprint_buf, &kprint_buf_i, (int64_t)va_arg(args, int));
+                break;
+            case 'D':
+                kprn_i(kprint_buf, &kprint_buf_i, (int64_t)va_arg(args, int64_t));
+                break;
+            case 'u':
+                kprn_ui(kprint_buf, &kprint_buf_i, (uint64_t)va_arg(args, unsigned int));
+                break;
+            case 'U':
+                kprn_ui(kprint_buf, &kprint_buf_i, (uint64_t)va_arg(args, uint64_t));
+                break;
+            case 'x':
+                kprn_x(kprint_buf, &kprint_buf_i, (uint64_t)va_arg(args, unsigned int));
+                break;
+            case 'X':
+                kprn_x(kprint_buf, &kprint_buf_i, (uint64_t)va_arg(args, uint64_t));
+                break;
+            case 'c':
+                c = (char)va_arg(args, int);
+                kputchar(kprint_buf, &kprint_buf_i, c);
+                break;
+            default:
+                kputchar(kprint_buf, &kprint_buf_i, '?');
+                break;
+        }
+    }
+
+out:
+    klog_write(type, kprint_buf, kprint_buf_i);
+}
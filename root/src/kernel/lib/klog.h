@@ -0,0 +1,21 @@
+#ifndef __KLOG_H__
+#define __KLOG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Messages each CPU can have waiting for the flusher */
+#define KLOG_RING_SIZE 64
+/* Bytes of flushed messages kept around for /dev/kmsg */
+#define KLOG_BACKLOG_SIZE 65536
+
+/* Least severe message type printed, one of the KPRN_ types */
+extern int klog_level;
+
+void init_klog(void);
+void klog_flusher(void *);
+size_t klog_read_backlog(void *, size_t, size_t);
+int klog_parse_level(const char *);
+const char *klog_level_name(int);
+
+#endif
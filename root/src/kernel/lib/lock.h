@@ -4,6 +4,69 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <lib/qemu.h>
+#include <lib/rand.h>
+
+/* Ticket locks. The low 16 bits of lock are the ticket being served and the
+ * high 16 bits the next ticket to hand out. Acquiring takes a ticket and
+ * spins reading the lock until it is served, so waiters get the lock in
+ * the order they came and do not fight over the cache line. Releasing
+ * serves the next ticket; asm/task.asm does so directly, with a 16-bit
+ * increment, for scheduler_lock and resched_lock. */
+
+#define LOCK_TICKET_ONE ((uint32_t)0x10000)
+
+/* Debug builds, and lockstat builds (-D_LOCKSTAT_, see lib/lockstat.c),
+ * give every spinlock_acquire() in the source a lock_site_t of its own. */
+#if defined(_DEBUG_) || defined(_LOCKSTAT_)
+#define LOCK_SITES
+#endif
+
+#ifdef LOCK_SITES
+
+struct lock_site_t {
+    const char *file;
+    const char *func;
+    int line;
+    /* The expression the lock was passed as */
+    const char *lockname;
+#ifdef _LOCKSTAT_
+    /* Address of the lock taken here, LOCKSTAT_MANY_LOCKS once more than
+     * one was, 0 before the first acquisition */
+    uint64_t lock;
+    /* Updated atomically, different instances of a lock can be taken at
+     * the same site on several CPUs at once. Times are in TSC cycles. */
+    uint64_t acquisitions;
+    /* Acquisitions which found the lock held */
+    uint64_t contended;
+    uint64_t wait_total;
+    uint64_t wait_max;
+    uint64_t hold_total;
+    uint64_t hold_max;
+#endif
+}
+#ifdef _LOCKSTAT_
+/* Sites are laid out as an array, see linker.ld; the alignment pads them
+ * to a whole number of cache lines so that their counters do not share */
+__attribute__((aligned(64)))
+#endif
+;
+
+#ifdef _LOCKSTAT_
+#define LOCK_SITE_ATTRIBUTES __attribute__((section(".lockstat_sites"), used))
+#else
+#define LOCK_SITE_ATTRIBUTES
+#endif
+
+/* Declares the site of the spinlock_acquire() it is expanded in */
+#define LOCK_SITE(LOCKNAME) ({ \
+    static struct lock_site_t __lock_site LOCK_SITE_ATTRIBUTES = { \
+        .file = __FILE__, .func = __func__, .line = __LINE__, \
+        .lockname = LOCKNAME \
+    }; \
+    &__lock_site; \
+})
+
+#endif /* LOCK_SITES */
 
 #ifdef _DEBUG_
 
@@ -15,37 +78,45 @@ struct last_acquirer_t {
     int line;
 };
 
-typedef struct {
-    int lock;
-    struct last_acquirer_t last_acquirer;
-} lock_t;
-
-__attribute__((unused)) static const lock_t new_lock = {
-    1,
-    { "N/A", "N/A", 0 }
-};
-
-__attribute__((unused)) static const lock_t new_lock_acquired = {
-    0,
-    { "N/A", "N/A", 0 }
+/* Only ever updated by the lock holder */
+struct lock_stats_t {
+    uint64_t acquisitions;
+    /* Acquisitions which found the lock held */
+    uint64_t contended;
+    /* Longest wait, in TSC cycles */
+    uint64_t max_spin;
 };
 
-#else /* _DEBUG_ */
+#endif /* _DEBUG_ */
 
 typedef struct {
-    int lock;
+    uint32_t lock;
+#ifdef _DEBUG_
+    struct last_acquirer_t last_acquirer;
+    struct lock_stats_t stats;
+#endif
+#ifdef _LOCKSTAT_
+    /* Where and when the lock was taken, for the hold time. Releases done
+     * from assembly leave these behind and the hold goes unaccounted. */
+    struct lock_site_t *holder;
+    uint64_t held_since;
+#endif
 } lock_t;
 
 __attribute__((unused)) static const lock_t new_lock = {
-    1
+    .lock = 0,
+#ifdef _DEBUG_
+    .last_acquirer = { "N/A", "N/A", 0 },
+#endif
 };
 
 __attribute__((unused)) static const lock_t new_lock_acquired = {
-    0
+    .lock = LOCK_TICKET_ONE,
+#ifdef _DEBUG_
+    .last_acquirer = { "N/A", "N/A", 0 },
+#endif
 };
 
-#endif /* _DEBUG_ */
-
 #define locked_read(type, var) ({ \
     type ret = 0; \
     asm volatile ( \
@@ -94,7 +165,7 @@ __attribute__((unused)) static const lock_t new_lock_acquired = {
 #define __puts_uint(val) ({ \
     char buf[21] = {0}; \
     int i; \
-    int val_copy = (uint64_t)(val); \
+    uint64_t val_copy = (uint64_t)(val); \
     if (!val_copy) { \
         buf[0] = '0'; \
         buf[1] = 0; \
@@ -109,26 +180,108 @@ __attribute__((unused)) static const lock_t new_lock_acquired = {
     qemu_debug_puts_urgent(buf + i); \
 })
 
+/* The half of lock holding the ticket being served */
+typedef uint16_t __attribute__((may_alias)) lock_owner_t;
+
+#define spinlock_owner(LOCK) (*(volatile lock_owner_t *)&(LOCK)->lock)
+
+/* Take a ticket, returns the lock as it was before */
+__attribute__((always_inline)) __attribute__((unused)) static inline uint32_t spinlock_take_ticket(lock_t *lock) {
+    uint32_t old = LOCK_TICKET_ONE;
+    asm volatile (
+        "lock xadd %1, %0;"
+        : "+r" (old), "+m" (lock->lock)
+        :
+        : "memory", "cc"
+    );
+    return old;
+}
+
+/* Take a ticket only if it would be served right away */
+__attribute__((always_inline)) __attribute__((unused)) static inline int spinlock_try_ticket(lock_t *lock) {
+    uint32_t old = *(volatile uint32_t *)&lock->lock;
+    if ((uint16_t)old != (uint16_t)(old >> 16))
+        return 0;
+
+    int ret;
+    asm volatile (
+        "lock cmpxchg %1, %3;"
+        : "+a" (old), "+m" (lock->lock), "=@ccz" (ret)
+        : "r" (old + LOCK_TICKET_ONE)
+        : "memory"
+    );
+    return ret;
+}
+
+#ifdef _LOCKSTAT_
+
+__attribute__((always_inline)) __attribute__((unused)) static inline void lockstat_add(uint64_t *counter, uint64_t x) {
+    asm volatile (
+        "lock add %0, %1;"
+        : "+m" (*counter)
+        : "r" (x)
+        : "memory", "cc"
+    );
+}
+
+#define LOCKSTAT_MANY_LOCKS ((uint64_t)-1)
+
+/* Remember the lock taken at a site. Costs a read and a compare once the
+ * site has seen its lock, or several. */
+__attribute__((always_inline)) __attribute__((unused)) static inline void lockstat_note_lock(uint64_t *site_lock, uint64_t addr) {
+    uint64_t old = *(volatile uint64_t *)site_lock;
+    if (old == addr || old == LOCKSTAT_MANY_LOCKS)
+        return;
+    if (!old) {
+        int done;
+        asm volatile (
+            "lock cmpxchg %1, %3;"
+            : "+a" (old), "+m" (*site_lock), "=@ccz" (done)
+            : "r" (addr)
+            : "memory"
+        );
+        if (done || old == addr)
+            return;
+    }
+    *(volatile uint64_t *)site_lock = LOCKSTAT_MANY_LOCKS;
+}
+
+__attribute__((always_inline)) __attribute__((unused)) static inline void lockstat_max(uint64_t *max, uint64_t x) {
+    uint64_t old = *(volatile uint64_t *)max;
+    while (x > old) {
+        int done;
+        asm volatile (
+            "lock cmpxchg %1, %3;"
+            : "+a" (old), "+m" (*max), "=@ccz" (done)
+            : "r" (x)
+            : "memory"
+        );
+        if (done)
+            break;
+    }
+}
+
+#endif /* _LOCKSTAT_ */
+
+#ifdef LOCK_SITES
+
 #ifdef _DEBUG_
 
 __attribute__((unused)) static int deadlock_detect_lock = 0;
 
-__attribute__((noinline)) __attribute__((unused)) static void deadlock_detect(const char *file,
-                       const char *function,
-                       int line,
-                       const char *lockname,
+__attribute__((noinline)) __attribute__((unused)) static void deadlock_detect(struct lock_site_t *site,
                        lock_t *lock,
                        size_t iter) {
     while (locked_write(int, &deadlock_detect_lock, 1));
     qemu_debug_puts_urgent("\n---\npossible deadlock at: spinlock_acquire(");
-    qemu_debug_puts_urgent(lockname);
+    qemu_debug_puts_urgent(site->lockname);
     qemu_debug_puts_urgent(");");
     qemu_debug_puts_urgent("\nfile: ");
-    qemu_debug_puts_urgent(file);
+    qemu_debug_puts_urgent(site->file);
     qemu_debug_puts_urgent("\nfunction: ");
-    qemu_debug_puts_urgent(function);
+    qemu_debug_puts_urgent(site->func);
     qemu_debug_puts_urgent("\nline: ");
-    __puts_uint(line);
+    __puts_uint(site->line);
     qemu_debug_puts_urgent("\n---\nlast acquirer:");
     qemu_debug_puts_urgent("\nfile: ");
     qemu_debug_puts_urgent(lock->last_acquirer.file);
@@ -136,62 +289,125 @@ __attribute__((noinline)) __attribute__((unused)) static void deadlock_detect(co
     qemu_debug_puts_urgent(lock->last_acquirer.func);
     qemu_debug_puts_urgent("\nline: ");
     __puts_uint(lock->last_acquirer.line);
+    qemu_debug_puts_urgent("\n---\nacquisitions: ");
+    __puts_uint(lock->stats.acquisitions);
+    qemu_debug_puts_urgent("\ncontended: ");
+    __puts_uint(lock->stats.contended);
+    qemu_debug_puts_urgent("\nmax spin cycles: ");
+    __puts_uint(lock->stats.max_spin);
     qemu_debug_puts_urgent("\n---\nassumed locked after it spun for ");
     __puts_uint(iter);
     qemu_debug_puts_urgent(" iterations\n---\n");
     locked_write(int, &deadlock_detect_lock, 0);
 }
 
-#define spinlock_acquire(lock) ({ \
-    __label__ retry; \
-    __label__ out; \
-retry:; \
-    for (size_t i = 0; i < DEADLOCK_MAX_ITER; i++) \
-        if (spinlock_test_and_acquire(lock)) \
-            goto out; \
-    deadlock_detect(__FILE__, __func__, __LINE__, #lock, lock, DEADLOCK_MAX_ITER); \
-    goto retry; \
-out:; \
-})
+#endif /* _DEBUG_ */
 
-#define spinlock_test_and_acquire(LOCK) ({ \
-    int ret; \
-    asm volatile ( \
-        "lock btr %0, 0;" \
-        : "+m" ((LOCK)->lock), "=@ccc" (ret) \
-        : \
-        : "memory" \
-    ); \
-    if (ret) { \
-        (LOCK)->last_acquirer.file = __FILE__; \
-        (LOCK)->last_acquirer.func = __func__; \
-        (LOCK)->last_acquirer.line = __LINE__; \
-    } \
-    ret; \
-})
+__attribute__((always_inline)) __attribute__((unused)) static inline void spinlock_acquired(lock_t *lock,
+                       struct lock_site_t *site) {
+#ifdef _DEBUG_
+    lock->last_acquirer.file = site->file;
+    lock->last_acquirer.func = site->func;
+    lock->last_acquirer.line = site->line;
+    lock->stats.acquisitions++;
+#endif
+#ifdef _LOCKSTAT_
+    lockstat_add(&site->acquisitions, 1);
+    lockstat_note_lock(&site->lock, (uint64_t)lock);
+    lock->holder = site;
+    lock->held_since = rdtsc(uint64_t);
+#endif
+}
+
+/* Called once the lock is held, after spinning for spin TSC cycles */
+__attribute__((always_inline)) __attribute__((unused)) static inline void spinlock_contended(lock_t *lock,
+                       struct lock_site_t *site, uint64_t spin) {
+#ifdef _DEBUG_
+    lock->stats.contended++;
+    if (spin > lock->stats.max_spin)
+        lock->stats.max_spin = spin;
+#endif
+#ifdef _LOCKSTAT_
+    lockstat_add(&site->contended, 1);
+    lockstat_add(&site->wait_total, spin);
+    lockstat_max(&site->wait_max, spin);
+#endif
+    (void)lock;
+    (void)site;
+}
 
-#else /* _DEBUG_ */
+__attribute__((always_inline)) __attribute__((unused)) static inline void __spinlock_acquire(lock_t *lock,
+                       struct lock_site_t *site) {
+    uint32_t old = spinlock_take_ticket(lock);
+    uint16_t ticket = old >> 16;
+
+    if ((uint16_t)old == ticket) {
+        spinlock_acquired(lock, site);
+        return;
+    }
+
+    uint64_t start = rdtsc(uint64_t);
+#ifdef _DEBUG_
+    for (size_t i = 0; spinlock_owner(lock) != ticket; ) {
+        asm volatile ("pause;" ::: "memory");
+        if (++i == DEADLOCK_MAX_ITER) {
+            deadlock_detect(site, lock, i);
+            i = 0;
+        }
+    }
+#else
+    while (spinlock_owner(lock) != ticket)
+        asm volatile ("pause;" ::: "memory");
+#endif
+    asm volatile ("" ::: "memory");
+    uint64_t spin = rdtsc(uint64_t) - start;
+
+    spinlock_acquired(lock, site);
+    spinlock_contended(lock, site, spin);
+}
 
-#define spinlock_acquire(lock) \
-    while (!spinlock_test_and_acquire(lock));
+#define spinlock_acquire(LOCK) \
+    __spinlock_acquire((LOCK), LOCK_SITE(#LOCK))
 
 #define spinlock_test_and_acquire(LOCK) ({ \
-    int ret; \
-    asm volatile ( \
-        "lock btr %0, 0;" \
-        : "+m" ((LOCK)->lock), "=@ccc" (ret) \
-        : \
-        : "memory" \
-    ); \
+    lock_t *__lock = (LOCK); \
+    int ret = spinlock_try_ticket(__lock); \
+    if (ret) \
+        spinlock_acquired(__lock, LOCK_SITE(#LOCK)); \
     ret; \
 })
 
-#endif /* _DEBUG_ */
+#else /* LOCK_SITES */
+
+__attribute__((always_inline)) __attribute__((unused)) static inline void spinlock_acquire(lock_t *lock) {
+    uint32_t old = spinlock_take_ticket(lock);
+    uint16_t ticket = old >> 16;
+
+    if ((uint16_t)old == ticket)
+        return;
+
+    while (spinlock_owner(lock) != ticket)
+        asm volatile ("pause;" ::: "memory");
+    asm volatile ("" ::: "memory");
+}
+
+#define spinlock_test_and_acquire(LOCK) spinlock_try_ticket(LOCK)
+
+#endif /* LOCK_SITES */
 
 __attribute__((always_inline)) __attribute__((unused)) static inline void spinlock_release(lock_t *lock) {
+#ifdef _LOCKSTAT_
+    struct lock_site_t *site = lock->holder;
+    if (site) {
+        uint64_t hold = rdtsc(uint64_t) - lock->held_since;
+        lock->holder = NULL;
+        lockstat_add(&site->hold_total, hold);
+        lockstat_max(&site->hold_max, hold);
+    }
+#endif
     asm volatile (
-        "lock bts %0, 0;"
-        : "+m" (lock->lock)
+        "lock inc %0;"
+        : "+m" (*(lock_owner_t *)&lock->lock)
         :
         : "memory", "cc"
     );
@@ -0,0 +1,132 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <lib/lockstat.h>
+#include <lib/lock.h>
+#include <lib/klib.h>
+#include <lib/alloc.h>
+#include <lib/rand.h>
+#include <lib/time.h>
+
+/* Lock profiling. In lockstat builds every spinlock_acquire() in the
+ * source owns a lock_site_t, which lib/lock.h places in the
+ * .lockstat_sites section and updates on every acquisition and release.
+ * The linker script gathers that section into an array, which this file
+ * walks to export the counters through /dev/lockstat. Without
+ * -D_LOCKSTAT_ there are no counters and this file is empty. */
+
+#ifdef _LOCKSTAT_
+
+extern struct lock_site_t lockstat_sites[];
+extern struct lock_site_t lockstat_sites_end[];
+
+static lock_t lockstat_lock = new_lock;
+
+/* Taken on reads at offset 0, so that a reader sees one consistent set */
+static struct lockstat_header_t *lockstat_snapshot = NULL;
+static size_t lockstat_snapshot_len = 0;
+
+static uint64_t lockstat_reset_tsc = 0;
+static uint64_t lockstat_reset_uptime = 0;
+
+/* Truncates, and zero-fills the rest of dest */
+static void lockstat_strcpy(char *dest, const char *src) {
+    size_t i;
+    for (i = 0; i < LOCKSTAT_NAME_MAX - 1 && src[i]; i++)
+        dest[i] = src[i];
+    memset(dest + i, 0, LOCKSTAT_NAME_MAX - i);
+}
+
+/* The largest snapshot possible, every site having been taken */
+size_t lockstat_size(void) {
+    return sizeof(struct lockstat_header_t)
+         + (size_t)(lockstat_sites_end - lockstat_sites)
+           * sizeof(struct lockstat_record_t);
+}
+
+static void lockstat_take_snapshot(void) {
+    size_t count = 0;
+    for (struct lock_site_t *site = lockstat_sites; site < lockstat_sites_end; site++)
+        if (site->acquisitions)
+            count++;
+
+    size_t len = sizeof(struct lockstat_header_t)
+               + count * sizeof(struct lockstat_record_t);
+    struct lockstat_header_t *snapshot = kalloc(len);
+    if (!snapshot)
+        return;
+
+    uint64_t elapsed_tsc = rdtsc(uint64_t) - lockstat_reset_tsc;
+    uint64_t elapsed_ms = uptime_raw - lockstat_reset_uptime;
+
+    snapshot->magic = LOCKSTAT_MAGIC;
+    snapshot->record_size = sizeof(struct lockstat_record_t);
+    snapshot->elapsed_ms = elapsed_ms;
+    snapshot->tsc_per_ms = elapsed_ms ? elapsed_tsc / elapsed_ms : 0;
+
+    struct lockstat_record_t *records = (void *)(snapshot + 1);
+    size_t i = 0;
+    for (struct lock_site_t *site = lockstat_sites; site < lockstat_sites_end; site++) {
+        /* Sites taken after counting are left for the next snapshot */
+        if (!site->acquisitions || i == count)
+            continue;
+        lockstat_strcpy(records[i].lockname, site->lockname);
+        lockstat_strcpy(records[i].file, site->file);
+        lockstat_strcpy(records[i].func, site->func);
+        records[i].line = site->line;
+        records[i].acquisitions = site->acquisitions;
+        records[i].contended = site->contended;
+        records[i].wait_total = site->wait_total;
+        records[i].wait_max = site->wait_max;
+        records[i].hold_total = site->hold_total;
+        records[i].hold_max = site->hold_max;
+        records[i].lock = site->lock;
+        i++;
+    }
+    snapshot->record_count = i;
+
+    kfree(lockstat_snapshot);
+    lockstat_snapshot = snapshot;
+    lockstat_snapshot_len = sizeof(struct lockstat_header_t)
+                          + i * sizeof(struct lockstat_record_t);
+}
+
+size_t lockstat_read(void *buf, size_t loc, size_t count) {
+    spinlock_acquire(&lockstat_lock);
+
+    if (!loc || !lockstat_snapshot)
+        lockstat_take_snapshot();
+
+    if (loc >= lockstat_snapshot_len) {
+        count = 0;
+    } else {
+        if (count > lockstat_snapshot_len - loc)
+            count = lockstat_snapshot_len - loc;
+        memcpy(buf, (uint8_t *)lockstat_snapshot + loc, count);
+    }
+
+    spinlock_release(&lockstat_lock);
+
+    return count;
+}
+
+/* Counters updated meanwhile on other CPUs may survive the reset */
+void lockstat_reset(void) {
+    spinlock_acquire(&lockstat_lock);
+
+    for (struct lock_site_t *site = lockstat_sites; site < lockstat_sites_end; site++) {
+        site->acquisitions = 0;
+        site->contended = 0;
+        site->wait_total = 0;
+        site->wait_max = 0;
+        site->hold_total = 0;
+        site->hold_max = 0;
+        site->lock = 0;
+    }
+
+    lockstat_reset_tsc = rdtsc(uint64_t);
+    lockstat_reset_uptime = uptime_raw;
+
+    spinlock_release(&lockstat_lock);
+}
+
+#endif /* _LOCKSTAT_ */
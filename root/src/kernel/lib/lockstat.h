@@ -0,0 +1,45 @@
+#ifndef __LOCKSTAT_H__
+#define __LOCKSTAT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Layout of /dev/lockstat, read by the lockstat utility: a header, then a
+ * record for every spinlock_acquire() site taken since the last reset.
+ * Times are in TSC cycles. Only available in kernels built with
+ * -D_LOCKSTAT_ (make LOCKSTAT=yes). */
+
+/* "lockstat" */
+#define LOCKSTAT_MAGIC ((uint64_t)0x746174736b636f6c)
+#define LOCKSTAT_NAME_MAX 64
+
+struct lockstat_header_t {
+    uint64_t magic;
+    uint64_t record_size;
+    uint64_t record_count;
+    /* Since the last reset, or boot */
+    uint64_t elapsed_ms;
+    uint64_t tsc_per_ms;
+};
+
+struct lockstat_record_t {
+    /* The expression the lock was passed as */
+    char lockname[LOCKSTAT_NAME_MAX];
+    char file[LOCKSTAT_NAME_MAX];
+    char func[LOCKSTAT_NAME_MAX];
+    uint64_t line;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_total;
+    uint64_t wait_max;
+    uint64_t hold_total;
+    uint64_t hold_max;
+    /* Address of the lock taken at the site, all ones if it took several */
+    uint64_t lock;
+};
+
+size_t lockstat_size(void);
+size_t lockstat_read(void *, size_t, size_t);
+void lockstat_reset(void);
+
+#endif
@@ -0,0 +1,351 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <cpuid.h>
+#include <lib/klib.h>
+#include <lib/mem.h>
+#include <lib/alloc.h>
+#include <lib/rand.h>
+#include <lib/time.h>
+#include <misc/pit.h>
+
+/* memcpy() and friends, built on the string instructions. The kernel does
+ * not touch the SSE registers (they hold the state of whatever user thread
+ * got interrupted until the next reschedule), so the fastest thing left is
+ * to let the CPU move the data with rep movs/stos, which on anything with
+ * ERMS runs at cache line granularity. init_mem() picks the variants the
+ * CPU is good at; until then the plain quadword ones are used. */
+
+#define CPUID_ERMS (1 << 9)
+#define CPUID_FSRM (1 << 4)
+
+/* Below this rep movsb/stosb takes too long to start up without FSRM */
+#define ERMS_THRESHOLD 256
+
+static int mem_erms = 0;
+static int mem_fsrm = 0;
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) u64_unaligned_t;
+typedef uint32_t __attribute__((may_alias, aligned(1))) u32_unaligned_t;
+typedef uint16_t __attribute__((may_alias, aligned(1))) u16_unaligned_t;
+
+/* Copies of up to 16 bytes. Everything is loaded before anything is
+ * stored, so the buffers may overlap. */
+static inline void copy_small(uint8_t *dest, const uint8_t *src, size_t count) {
+    if (count >= 8) {
+        uint64_t a = *(u64_unaligned_t *)src;
+        uint64_t b = *(u64_unaligned_t *)(src + count - 8);
+        *(u64_unaligned_t *)dest = a;
+        *(u64_unaligned_t *)(dest + count - 8) = b;
+    } else if (count >= 4) {
+        uint32_t a = *(u32_unaligned_t *)src;
+        uint32_t b = *(u32_unaligned_t *)(src + count - 4);
+        *(u32_unaligned_t *)dest = a;
+        *(u32_unaligned_t *)(dest + count - 4) = b;
+    } else if (count >= 2) {
+        uint16_t a = *(u16_unaligned_t *)src;
+        uint16_t b = *(u16_unaligned_t *)(src + count - 2);
+        *(u16_unaligned_t *)dest = a;
+        *(u16_unaligned_t *)(dest + count - 2) = b;
+    } else if (count) {
+        *dest = *src;
+    }
+}
+
+static inline void set_small(uint8_t *dest, uint64_t pattern, size_t count) {
+    if (count >= 8) {
+        *(u64_unaligned_t *)dest = pattern;
+        *(u64_unaligned_t *)(dest + count - 8) = pattern;
+    } else if (count >= 4) {
+        *(u32_unaligned_t *)dest = (uint32_t)pattern;
+        *(u32_unaligned_t *)(dest + count - 4) = (uint32_t)pattern;
+    } else if (count >= 2) {
+        *(u16_unaligned_t *)dest = (uint16_t)pattern;
+        *(u16_unaligned_t *)(dest + count - 2) = (uint16_t)pattern;
+    } else if (count) {
+        *dest = (uint8_t)pattern;
+    }
+}
+
+static inline void copy_movsb(void *dest, const void *src, size_t count) {
+    asm volatile (
+        "rep movsb;"
+        : "+D" (dest), "+S" (src), "+c" (count)
+        :
+        : "memory"
+    );
+}
+
+/* Forward copy of more than 16 bytes, quadword at a time with the
+ * destination aligned */
+static void copy_movsq(void *dest, const void *src, size_t count) {
+    size_t head = -(size_t)dest & 7;
+    /* Covers the head, the quadword loop rewrites the overlap */
+    *(u64_unaligned_t *)dest = *(u64_unaligned_t *)src;
+    dest += head;
+    src += head;
+    count -= head;
+
+    size_t tail = count & 7;
+    count /= 8;
+    asm volatile (
+        "rep movsq;"
+        : "+D" (dest), "+S" (src), "+c" (count)
+        :
+        : "memory"
+    );
+    copy_small(dest, src, tail);
+}
+
+static inline void set_stosb(void *dest, uint8_t c, size_t count) {
+    asm volatile (
+        "rep stosb;"
+        : "+D" (dest), "+c" (count)
+        : "a" (c)
+        : "memory"
+    );
+}
+
+/* Fill of more than 16 bytes, quadword at a time with the destination
+ * aligned */
+static void set_stosq(void *dest, uint64_t pattern, size_t count) {
+    size_t head = -(size_t)dest & 7;
+    *(u64_unaligned_t *)dest = pattern;
+    dest += head;
+    count -= head;
+
+    size_t tail = count & 7;
+    count /= 8;
+    asm volatile (
+        "rep stosq;"
+        : "+D" (dest), "+c" (count)
+        : "a" (pattern)
+        : "memory"
+    );
+    set_small(dest, pattern, tail);
+}
+
+void *memcpy(void *dest, const void *src, size_t count) {
+    if (count <= 16)
+        copy_small(dest, src, count);
+    else if (mem_fsrm || (mem_erms && count >= ERMS_THRESHOLD))
+        copy_movsb(dest, src, count);
+    else
+        copy_movsq(dest, src, count);
+
+    return dest;
+}
+
+void *memcpy64(void *dest, const void *src, size_t count) {
+    void *d = dest;
+    count /= sizeof(uint64_t);
+
+    asm volatile (
+        "rep movsq;"
+        : "+D" (d), "+S" (src), "+c" (count)
+        :
+        : "memory"
+    );
+
+    return dest;
+}
+
+void *memset(void *s, int c, size_t count) {
+    uint64_t pattern = (uint8_t)c * (uint64_t)0x0101010101010101;
+
+    if (count <= 16)
+        set_small(s, pattern, count);
+    else if (mem_fsrm || (mem_erms && count >= ERMS_THRESHOLD))
+        set_stosb(s, (uint8_t)c, count);
+    else
+        set_stosq(s, pattern, count);
+
+    return s;
+}
+
+void *memset64(void *ptr, uint64_t c, size_t count) {
+    void *p = ptr;
+
+    asm volatile (
+        "rep stosq;"
+        : "+D" (p), "+c" (count)
+        : "a" (c)
+        : "memory"
+    );
+
+    return ptr;
+}
+
+void *memmove(void *dest, const void *src, size_t count) {
+    if (count <= 16) {
+        copy_small(dest, src, count);
+        return dest;
+    }
+
+    if ((size_t)(dest - src) >= count) {
+        if ((size_t)(src - dest) >= count)
+            return memcpy(dest, src, count);
+
+        /* dest starts below src. Going up a quadword at a time only ever
+         * overwrites what was read already, but memcpy()'s alignment
+         * trick would not. */
+        size_t tail = count & 7;
+        size_t qwords = count / 8;
+        void *d = dest;
+        const void *s = src;
+        asm volatile (
+            "rep movsq;"
+            : "+D" (d), "+S" (s), "+c" (qwords)
+            :
+            : "memory"
+        );
+        copy_small(d, s, tail);
+        return dest;
+    }
+
+    /* dest starts inside src. Quadwords from the top down, then whatever
+     * is left at the bottom, which has not been overwritten yet. Interrupt
+     * and exception entry clears DF, and iretq brings it back. */
+    size_t head = count & 7;
+    size_t qwords = count / 8;
+    void *d = dest + count - 8;
+    const void *s = src + count - 8;
+    asm volatile (
+        "std;"
+        "rep movsq;"
+        "cld;"
+        : "+D" (d), "+S" (s), "+c" (qwords)
+        :
+        : "memory"
+    );
+    copy_small(dest, src, head);
+
+    return dest;
+}
+
+int memcmp(const void *s1, const void *s2, size_t n) {
+    const uint8_t *a = s1;
+    const uint8_t *b = s2;
+    size_t i = 0;
+
+    /* Find the first differing quadword, then order by its first
+     * differing byte, which is the most significant one once swapped */
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x = *(u64_unaligned_t *)(a + i);
+        uint64_t y = *(u64_unaligned_t *)(b + i);
+        if (x != y)
+            return __builtin_bswap64(x) < __builtin_bswap64(y) ? -1 : 1;
+    }
+
+    for (; i < n; i++) {
+        if (a[i] < b[i]) {
+            return -1;
+        } else if (a[i] > b[i]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void init_mem(void) {
+    unsigned int eax, ebx = 0, ecx = 0, edx = 0;
+
+    __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+    mem_erms = !!(ebx & CPUID_ERMS);
+    mem_fsrm = !!(edx & CPUID_FSRM);
+
+    kprint(KPRN_INFO, "mem: ERMS %s, FSRM %s",
+           mem_erms ? "supported" : "unsupported",
+           mem_fsrm ? "supported" : "unsupported");
+}
+
+/* Benchmark */
+
+#define MEM_BENCH_MIN 64
+#define MEM_BENCH_MAX (1024 * 1024)
+/* Bytes copied per measurement */
+#define MEM_BENCH_BYTES (16 * 1024 * 1024)
+#define MEM_BENCH_CALIBRATE_MS 50
+
+static void bench_movsq(void *dest, const void *src, size_t count) {
+    if (count <= 16)
+        copy_small(dest, src, count);
+    else
+        copy_movsq(dest, src, count);
+}
+
+static void bench_movsb(void *dest, const void *src, size_t count) {
+    copy_movsb(dest, src, count);
+}
+
+static void bench_memcpy(void *dest, const void *src, size_t count) {
+    memcpy(dest, src, count);
+}
+
+static struct {
+    const char *name;
+    void (*copy)(void *, const void *, size_t);
+} bench_variants[] = {
+    { "movsq", bench_movsq },
+    { "movsb", bench_movsb },
+    { "memcpy", bench_memcpy },
+};
+
+/* TSC ticks per millisecond, measured against the PIT */
+static uint64_t tsc_per_ms(void) {
+    uint64_t tick = uptime_raw;
+    while (uptime_raw == tick);
+
+    uint64_t start = rdtsc(uint64_t);
+    tick = uptime_raw;
+    while (uptime_raw < tick + MEM_BENCH_CALIBRATE_MS * (PIT_FREQUENCY / 1000));
+
+    return (rdtsc(uint64_t) - start) / MEM_BENCH_CALIBRATE_MS;
+}
+
+/* Prints the copy throughput of every variant for sizes from 64 bytes to
+ * 1 MiB. Needs interrupts enabled. */
+void mem_bench(void) {
+    uint8_t *src = kalloc(MEM_BENCH_MAX);
+    uint8_t *dest = kalloc(MEM_BENCH_MAX);
+    if (!src || !dest) {
+        kprint(KPRN_WARN, "mem: Out of memory for the benchmark");
+        kfree(src);
+        kfree(dest);
+        return;
+    }
+
+    for (size_t i = 0; i < MEM_BENCH_MAX; i++)
+        src[i] = (uint8_t)i;
+
+    uint64_t tsc_ms = tsc_per_ms();
+    kprint(KPRN_INFO, "mem: Copy benchmark, %U TSC ticks per ms", tsc_ms);
+
+    for (size_t size = MEM_BENCH_MIN; size <= MEM_BENCH_MAX; size *= 4) {
+        for (size_t v = 0; v < sizeof(bench_variants) / sizeof(bench_variants[0]); v++) {
+            size_t rounds = MEM_BENCH_BYTES / size;
+
+            /* Warm up the caches and TLB */
+            bench_variants[v].copy(dest, src, size);
+
+            uint64_t start = rdtsc(uint64_t);
+            for (size_t i = 0; i < rounds; i++)
+                bench_variants[v].copy(dest, src, size);
+            uint64_t cycles = rdtsc(uint64_t) - start;
+
+            if (memcmp(dest, src, size))
+                kprint(KPRN_ERR, "mem: %s copied %U bytes wrong",
+                       bench_variants[v].name, size);
+
+            /* Hundredths of GB/s */
+            uint64_t rate = cycles ? (uint64_t)MEM_BENCH_BYTES * tsc_ms
+                                     / (cycles * 10000) : 0;
+            kprint(KPRN_INFO, "mem: %s %U bytes: %U.%U%U GB/s",
+                   bench_variants[v].name, size,
+                   rate / 100, (rate / 10) % 10, rate % 10);
+        }
+    }
+
+    kfree(src);
+    kfree(dest);
+}
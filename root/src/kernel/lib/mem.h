@@ -0,0 +1,7 @@
+#ifndef __MEM_H__
+#define __MEM_H__
+
+void init_mem(void);
+void mem_bench(void);
+
+#endif
@@ -0,0 +1,43 @@
+#include <stddef.h>
+#include <lib/objcache.h>
+#include <lib/alloc.h>
+#include <lib/klib.h>
+#include <lib/lock.h>
+
+void *objcache_alloc(struct objcache_t *cache) {
+    spinlock_acquire(&cache->lock);
+
+    void *obj = cache->free_list;
+    if (!obj) {
+        spinlock_release(&cache->lock);
+        return kalloc(cache->size);
+    }
+
+    cache->free_list = *(void **)obj;
+    cache->count--;
+
+    spinlock_release(&cache->lock);
+
+    memset(obj, 0, cache->size);
+    return obj;
+}
+
+void objcache_free(struct objcache_t *cache, void *obj) {
+    if (!obj)
+        return;
+
+    spinlock_acquire(&cache->lock);
+
+    if (cache->count == cache->max) {
+        spinlock_release(&cache->lock);
+        kfree(obj);
+        return;
+    }
+
+    /* The free list is threaded through the objects themselves */
+    *(void **)obj = cache->free_list;
+    cache->free_list = obj;
+    cache->count++;
+
+    spinlock_release(&cache->lock);
+}
@@ -0,0 +1,24 @@
+#ifndef __OBJCACHE_H__
+#define __OBJCACHE_H__
+
+#include <stddef.h>
+#include <lib/lock.h>
+
+/* Freed objects of one size kept around to be handed out again, so that
+ * frequently recycled objects skip kalloc() and kfree(). Objects come back
+ * zeroed either way, just like from kalloc(). Up to max objects are kept,
+ * the rest is given back to the allocator. */
+struct objcache_t {
+    lock_t lock;
+    size_t size;
+    size_t max;
+    size_t count;
+    void *free_list;
+};
+
+#define new_objcache(SIZE, MAX) { new_lock, (SIZE), (MAX), 0, NULL }
+
+void *objcache_alloc(struct objcache_t *);
+void objcache_free(struct objcache_t *, void *);
+
+#endif
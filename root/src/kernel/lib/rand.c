@@ -1,74 +1,237 @@
+#include <stddef.h>
+#include <stdint.h>
 #include <lib/rand.h>
 #include <lib/klib.h>
-#include <lib/lock.h>
-
-void init_rand(void) {
-    uint32_t seed = ((uint32_t)0xc597060c * rdtsc(uint32_t))
-                  * ((uint32_t)0xce86d624)
-                  ^ ((uint32_t)0xee0da130 * rdtsc(uint32_t));
-
-    if (!rdrand_supported) {
-        kprint(KPRN_INFO, "rand: rdrand instruction not supported");
-        srand(seed);
-    } else {
-        kprint(KPRN_INFO, "rand: rdrand instruction supported");
-        seed *= (seed ^ rdrand(uint32_t));
-        srand(seed);
+#include <lib/cio.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+
+/* ChaCha20 based generator, one per CPU. Each CPU keeps a key and a small
+ * buffer of output, used with interrupts off; refilling the buffer also
+ * replaces the key with the first 32 bytes of the new keystream ("fast key
+ * erasure"), and handed out bytes are wiped, so the state never reveals
+ * past output. Bulk requests take a fresh key from there and produce the
+ * rest with interrupts on.
+ *
+ * Keys are derived from a boot time seed of RDSEED (RDRAND when it runs
+ * dry) and TSC jitter, and fresh randomness from the same sources is mixed
+ * in again every RAND_RESEED_INTERVAL refills. */
+
+/* ChaCha20 blocks per refill, the first 32 bytes becoming the next key */
+#define RAND_BLOCKS 4
+#define RAND_BUF_SIZE (RAND_BLOCKS * 64 - 32)
+
+#define RAND_RESEED_INTERVAL 4096
+
+/* Requests above this get their own keystream */
+#define RAND_BULK_MIN 64
+
+struct rand_state_t {
+    union {
+        uint8_t bytes[RAND_BLOCKS * 64];
+        struct {
+            uint32_t key[8];
+            uint8_t buf[RAND_BUF_SIZE];
+        };
+    };
+    /* Unread bytes at the end of buf */
+    size_t avail;
+    uint64_t refills;
+    int seeded;
+} __attribute__((aligned(64)));
+
+static struct rand_state_t rand_states[MAX_CPUS];
+
+static uint32_t rand_seed[8];
+static int have_rdseed;
+static int have_rdrand;
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+#define QUARTERROUND(a, b, c, d) ({ \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7); \
+})
+
+static void chacha20_block(const uint32_t *key, uint64_t counter, uint64_t nonce,
+                           uint32_t *out) {
+    const uint32_t in[16] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+        key[0], key[1], key[2], key[3],
+        key[4], key[5], key[6], key[7],
+        (uint32_t)counter, (uint32_t)(counter >> 32),
+        (uint32_t)nonce, (uint32_t)(nonce >> 32)
+    };
+
+    uint32_t x0 = in[0], x1 = in[1], x2 = in[2], x3 = in[3];
+    uint32_t x4 = in[4], x5 = in[5], x6 = in[6], x7 = in[7];
+    uint32_t x8 = in[8], x9 = in[9], x10 = in[10], x11 = in[11];
+    uint32_t x12 = in[12], x13 = in[13], x14 = in[14], x15 = in[15];
+
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x0, x4, x8, x12);
+        QUARTERROUND(x1, x5, x9, x13);
+        QUARTERROUND(x2, x6, x10, x14);
+        QUARTERROUND(x3, x7, x11, x15);
+        QUARTERROUND(x0, x5, x10, x15);
+        QUARTERROUND(x1, x6, x11, x12);
+        QUARTERROUND(x2, x7, x8, x13);
+        QUARTERROUND(x3, x4, x9, x14);
     }
+
+    out[0] = x0 + in[0];    out[1] = x1 + in[1];
+    out[2] = x2 + in[2];    out[3] = x3 + in[3];
+    out[4] = x4 + in[4];    out[5] = x5 + in[5];
+    out[6] = x6 + in[6];    out[7] = x7 + in[7];
+    out[8] = x8 + in[8];    out[9] = x9 + in[9];
+    out[10] = x10 + in[10]; out[11] = x11 + in[11];
+    out[12] = x12 + in[12]; out[13] = x13 + in[13];
+    out[14] = x14 + in[14]; out[15] = x15 + in[15];
 }
 
-#define n ((int)624)
-#define m ((int)397)
-#define matrix_a ((uint32_t)0x9908b0df)
-#define msb ((uint32_t)0x80000000)
-#define lsbs ((uint32_t)0x7fffffff)
+/* Keystream of key and nonce, from block 0 on */
+static void chacha20_stream(const uint32_t *key, uint64_t nonce, void *out, size_t len) {
+    uint8_t *p = out;
+    uint32_t block[16];
+
+    for (uint64_t counter = 0; len; counter++) {
+        size_t chunk = len < 64 ? len : 64;
+        chacha20_block(key, counter, nonce, block);
+        memcpy(p, block, chunk);
+        p += chunk;
+        len -= chunk;
+    }
+
+    memset(block, 0, sizeof(block));
+}
 
-static uint32_t status[n];
-static int ctr;
+/* Timing noise of a short loop. Weak on its own, but it is only ever
+ * mixed in on top of the rest. */
+static uint64_t rand_tsc_jitter(void) {
+    uint64_t acc = 0;
 
-static lock_t rand_lock = new_lock;
+    for (int i = 0; i < 64; i++) {
+        uint64_t t = rdtsc(uint64_t);
+        acc = ROTL64(acc, 7) ^ t;
+        for (volatile uint64_t j = 0; j < (t & 15); j++);
+    }
 
-void srand(uint32_t s) {
-    spinlock_acquire(&rand_lock);
-    status[0] = s;
-    for (ctr = 1; ctr < n; ctr++)
-        status[ctr] = (1812433253 * (status[ctr - 1] ^ (status[ctr - 1] >> 30)) + ctr);
-    spinlock_release(&rand_lock);
+    return acc;
 }
 
-uint32_t rand32(void) {
-    spinlock_acquire(&rand_lock);
+static uint64_t rand_entropy(void) {
+    uint64_t ret = rdtsc(uint64_t) ^ rand_tsc_jitter();
+    uint64_t seed;
 
-    const uint32_t mag01[2] = {0, matrix_a};
+    if (have_rdseed && rdseed_try(&seed))
+        ret ^= seed;
+    else if (have_rdrand)
+        ret ^= rdrand(uint64_t);
 
-    if (ctr >= n) {
-        for (int kk = 0; kk < n - m; kk++) {
-            uint32_t y = (status[kk] & msb) | (status[kk + 1] & lsbs);
-            status[kk] = status[kk + m] ^ (y >> 1) ^ mag01[y & 1];
-        }
+    return ret;
+}
 
-        for (int kk = n - m; kk < n - 1; kk++) {
-            uint32_t y = (status[kk] & msb) | (status[kk + 1] & lsbs);
-            status[kk] = status[kk + (m - n)] ^ (y >> 1) ^ mag01[y & 1];
-        }
+/* Fold fresh randomness into a key */
+static void rand_mix(uint32_t *key) {
+    for (int i = 0; i < 8; i += 2) {
+        uint64_t e = rand_entropy();
+        key[i] ^= (uint32_t)e;
+        key[i + 1] ^= (uint32_t)(e >> 32);
+    }
+}
 
-        uint32_t y = (status[n - 1] & msb) | (status[0] & lsbs);
-        status[n - 1] = status[m - 1] ^ (y >> 1) ^ mag01[y & 1];
+/* Called with interrupts off */
+static void rand_refill(struct rand_state_t *state, int cpu) {
+    uint32_t key[8];
+
+    if (!state->seeded) {
+        /* Distinct per CPU even without any hardware randomness */
+        uint32_t block[16];
+        chacha20_block(rand_seed, 0, (uint64_t)cpu + 1, block);
+        memcpy(state->key, block, sizeof(state->key));
+        memset(block, 0, sizeof(block));
+        rand_mix(state->key);
+        state->seeded = 1;
+    } else if (!(state->refills % RAND_RESEED_INTERVAL)) {
+        rand_mix(state->key);
+    }
 
-        ctr = 0;
+    memcpy(key, state->key, sizeof(key));
+    chacha20_stream(key, 0, state->bytes, sizeof(state->bytes));
+    memset(key, 0, sizeof(key));
+
+    state->avail = RAND_BUF_SIZE;
+    state->refills++;
+}
+
+/* Up to RAND_BULK_MIN bytes from this CPU's buffer */
+static void rand_take(void *buf, size_t len) {
+    uint8_t *p = buf;
+
+    uint64_t flags = save_and_disable_interrupts();
+
+    /* GS is only set up by init_smp() */
+    int cpu = smp_ready ? current_cpu : 0;
+    struct rand_state_t *state = &rand_states[cpu];
+
+    while (len) {
+        if (!state->avail)
+            rand_refill(state, cpu);
+        size_t chunk = len < state->avail ? len : state->avail;
+        uint8_t *src = &state->buf[RAND_BUF_SIZE - state->avail];
+        memcpy(p, src, chunk);
+        memset(src, 0, chunk);
+        state->avail -= chunk;
+        p += chunk;
+        len -= chunk;
     }
 
-    uint32_t res = status[ctr++];
+    restore_interrupts(flags);
+}
 
-    res ^= (res >> 11);
-    res ^= (res << 7) & 0x9d2c5680;
-    res ^= (res << 15) & 0xefc60000;
-    res ^= (res >> 18);
+void rand_fill(void *buf, size_t len) {
+    if (len > RAND_BULK_MIN) {
+        uint32_t key[8];
+        rand_take(key, sizeof(key));
+        chacha20_stream(key, 0, buf, len);
+        memset(key, 0, sizeof(key));
+        return;
+    }
 
-    spinlock_release(&rand_lock);
-    return res;
+    /* buf may be user memory, which is not touched with interrupts off */
+    uint8_t tmp[RAND_BULK_MIN];
+    rand_take(tmp, len);
+    memcpy(buf, tmp, len);
+    memset(tmp, 0, len);
+}
+
+uint32_t rand32(void) {
+    uint32_t ret;
+    rand_take(&ret, sizeof(ret));
+    return ret;
 }
 
 uint64_t rand64(void) {
-    return (((uint64_t)rand32()) << 32) | (uint64_t)rand32();
+    uint64_t ret;
+    rand_take(&ret, sizeof(ret));
+    return ret;
+}
+
+void init_rand(void) {
+    have_rdseed = rdseed_supported;
+    have_rdrand = rdrand_supported;
+
+    if (have_rdseed)
+        kprint(KPRN_INFO, "rand: Seeding from rdseed");
+    else if (have_rdrand)
+        kprint(KPRN_INFO, "rand: Seeding from rdrand");
+    else
+        kprint(KPRN_WARN, "rand: rdseed and rdrand not supported, seeding from TSC jitter only");
+
+    rand_mix(rand_seed);
+    /* Another pass, for the jitter to accumulate a bit more */
+    rand_mix(rand_seed);
 }
@@ -2,11 +2,13 @@
 #define __RAND_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
 void init_rand(void);
 uint32_t rand32(void);
 uint64_t rand64(void);
-void srand(uint32_t);
+/* Fills buf with len random bytes, see lib/rand.c */
+void rand_fill(void *, size_t);
 
 #define rdrand_supported ({ \
     int ret; \
@@ -15,6 +17,19 @@ void srand(uint32_t);
         "bt ecx, 30;" \
         : "=@ccc" (ret) \
         : "a" (1), "c" (0) \
+        : "rbx", "rdx" \
+    ); \
+    ret; \
+})
+
+#define rdseed_supported ({ \
+    int ret; \
+    asm volatile ( \
+        "cpuid;" \
+        "bt ebx, 18;" \
+        : "=@ccc" (ret) \
+        : "a" (7), "c" (0) \
+        : "rbx", "rdx" \
     ); \
     ret; \
 })
@@ -32,6 +47,17 @@ void srand(uint32_t);
     ret; \
 })
 
+/* RDSEED can run dry for a while, so unlike rdrand() this does not retry:
+ * returns 0 if *ptr was not filled in */
+#define rdseed_try(ptr) ({ \
+    int ret; \
+    asm volatile ( \
+        "rdseed %1;" \
+        : "=@ccc" (ret), "=r" (*(ptr)) \
+    ); \
+    ret; \
+})
+
 #define rdtsc(type) ({ \
     type ret; \
     asm volatile ( \
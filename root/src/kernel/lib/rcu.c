@@ -0,0 +1,74 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <lib/rcu.h>
+#include <lib/lock.h>
+#include <lib/event.h>
+#include <lib/alloc.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+#include <proc/task.h>
+
+/* How often rcu_worker() checks whether a grace period is over. Every CPU
+ * reschedules at least once per timeslice, so this is about how long one
+ * takes. */
+#define RCU_POLL_MS 10
+
+uint64_t rcu_gp_seq = 0;
+
+/* Callbacks waiting for a grace period, most recent first */
+static struct rcu_head_t *rcu_queue = NULL;
+static lock_t rcu_lock = new_lock;
+static event_t rcu_event = 0;
+
+void call_rcu(struct rcu_head_t *head, void (*func)(struct rcu_head_t *)) {
+    head->func = func;
+
+    /* The locked operations make the unpublishing store visible before
+     * the new grace period number is. */
+    spinlock_acquire(&rcu_lock);
+    head->next = rcu_queue;
+    rcu_queue = head;
+    locked_write(uint64_t, &rcu_gp_seq, rcu_gp_seq + 1);
+    spinlock_release(&rcu_lock);
+
+    event_trigger(&rcu_event);
+}
+
+void rcu_kfree(struct rcu_head_t *head) {
+    kfree(head);
+}
+
+/* Whether every CPU went through a quiescent state since gp was started */
+static int rcu_gp_done(uint64_t gp) {
+    for (int i = 0; i < smp_cpu_count; i++)
+        if (*(volatile uint64_t *)&cpu_locals[i].rcu_gp < gp)
+            return 0;
+    return 1;
+}
+
+void rcu_worker(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        event_await(&rcu_event);
+
+        spinlock_acquire(&rcu_lock);
+        struct rcu_head_t *head = rcu_queue;
+        uint64_t gp = rcu_gp_seq;
+        rcu_queue = NULL;
+        spinlock_release(&rcu_lock);
+
+        if (!head)
+            continue;
+
+        /* One grace period for the whole batch */
+        while (!rcu_gp_done(gp))
+            relaxed_sleep(RCU_POLL_MS);
+
+        while (head) {
+            struct rcu_head_t *next = head->next;
+            head->func(head);
+            head = next;
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <lib/cio.h>
+#include <sys/cpu.h>
+
+/* Read-copy-update, for tables which are read all the time and rarely
+ * change. Readers take no lock and write nothing shared: they only keep
+ * interrupts off, so that they cannot be rescheduled while inside. A
+ * writer builds a new version of the table, publishes it with
+ * rcu_assign_pointer(), and hands the old one to call_rcu(), which frees
+ * it once every CPU went through task_resched() since: by then no reader
+ * can still be looking at it.
+ *
+ *     uint64_t flags = rcu_read_lock();
+ *     struct table_t *table = rcu_dereference(global_table);
+ *     ...
+ *     rcu_read_unlock(flags);
+ *
+ * Readers must not sleep, and pointers to the old version must not be used
+ * past rcu_read_unlock(). */
+
+struct rcu_head_t {
+    struct rcu_head_t *next;
+    void (*func)(struct rcu_head_t *);
+};
+
+/* Bumped for every call_rcu() */
+extern uint64_t rcu_gp_seq;
+
+#define rcu_read_lock() save_and_disable_interrupts()
+#define rcu_read_unlock(flags) restore_interrupts(flags)
+
+#define rcu_dereference(ptr) (*(__typeof__(ptr) volatile *)&(ptr))
+
+/* The new version is filled in before it is reachable */
+#define rcu_assign_pointer(ptr, val) ({ \
+    asm volatile ("" ::: "memory"); \
+    *(__typeof__(ptr) volatile *)&(ptr) = (val); \
+})
+
+/* Called by task_resched(): no reader is running on this CPU */
+#define rcu_quiescent_state(cpu) ({ \
+    cpu_locals[cpu].rcu_gp = *(volatile uint64_t *)&rcu_gp_seq; \
+})
+
+void call_rcu(struct rcu_head_t *, void (*)(struct rcu_head_t *));
+/* call_rcu() callback for structures starting with their rcu_head_t */
+void rcu_kfree(struct rcu_head_t *);
+void rcu_worker(void *);
+
+#endif
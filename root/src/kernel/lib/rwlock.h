@@ -0,0 +1,66 @@
+#ifndef __RWLOCK_H__
+#define __RWLOCK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <lib/lock.h>
+
+/* Reader-writer spinlocks, for tables which are looked up far more often
+ * than they change. Any number of readers can hold the lock at once, or a
+ * single writer. Writers queue on a ticket lock among themselves, then
+ * flag themselves in state so that no new readers get in, and wait for
+ * the readers inside to leave; a stream of readers cannot starve them. */
+
+/* Set in state while a writer holds, or waits for, the lock */
+#define RWLOCK_WRITER ((uint32_t)1 << 31)
+
+typedef struct {
+    /* Readers inside, plus RWLOCK_WRITER */
+    uint32_t state;
+    lock_t writer_lock;
+} rwlock_t;
+
+__attribute__((unused)) static const rwlock_t new_rwlock = {
+    0,
+    new_lock
+};
+
+__attribute__((always_inline)) __attribute__((unused)) static inline uint32_t rwlock_add(uint32_t *state, uint32_t x) {
+    asm volatile (
+        "lock xadd %1, %0;"
+        : "+r" (x), "+m" (*state)
+        :
+        : "memory", "cc"
+    );
+    return x;
+}
+
+__attribute__((always_inline)) __attribute__((unused)) static inline void rwlock_read_acquire(rwlock_t *rwlock) {
+    for (;;) {
+        while (*(volatile uint32_t *)&rwlock->state & RWLOCK_WRITER)
+            asm volatile ("pause;" ::: "memory");
+        if (!(rwlock_add(&rwlock->state, 1) & RWLOCK_WRITER))
+            return;
+        /* A writer got there first, let it through */
+        rwlock_add(&rwlock->state, -1);
+    }
+}
+
+__attribute__((always_inline)) __attribute__((unused)) static inline void rwlock_read_release(rwlock_t *rwlock) {
+    rwlock_add(&rwlock->state, -1);
+}
+
+__attribute__((always_inline)) __attribute__((unused)) static inline void rwlock_write_acquire(rwlock_t *rwlock) {
+    spinlock_acquire(&rwlock->writer_lock);
+    rwlock_add(&rwlock->state, RWLOCK_WRITER);
+    while (*(volatile uint32_t *)&rwlock->state != RWLOCK_WRITER)
+        asm volatile ("pause;" ::: "memory");
+    asm volatile ("" ::: "memory");
+}
+
+__attribute__((always_inline)) __attribute__((unused)) static inline void rwlock_write_release(rwlock_t *rwlock) {
+    rwlock_add(&rwlock->state, -RWLOCK_WRITER);
+    spinlock_release(&rwlock->writer_lock);
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef __SEQLOCK_H__
+#define __SEQLOCK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <lib/lock.h>
+
+/* Sequence locks, for data which readers only copy out of. Readers take
+ * no lock and write nothing, they instead check that no writer came along
+ * while they were reading and retry if one did:
+ *
+ *     uint32_t seq;
+ *     do {
+ *         seq = seqlock_read_begin(&lock);
+ *         ... copy the data ...
+ *     } while (seqlock_read_retry(&lock, seq));
+ *
+ * A reader can see the data half updated, so whatever it follows must stay
+ * valid memory, and it must not act on what it read before the retry check.
+ * Writers are serialised by a spinlock. */
+
+typedef struct {
+    /* Odd while a write is in progress */
+    uint32_t seq;
+    lock_t lock;
+} seqlock_t;
+
+__attribute__((unused)) static const seqlock_t new_seqlock = {
+    0,
+    new_lock
+};
+
+__attribute__((always_inline)) __attribute__((unused)) static inline uint32_t seqlock_read_begin(seqlock_t *seqlock) {
+    uint32_t seq;
+    while ((seq = *(volatile uint32_t *)&seqlock->seq) & 1)
+        asm volatile ("pause;" ::: "memory");
+    /* Loads are not reordered with older loads on x86 */
+    asm volatile ("" ::: "memory");
+    return seq;
+}
+
+__attribute__((always_inline)) __attribute__((unused)) static inline int seqlock_read_retry(seqlock_t *seqlock, uint32_t seq) {
+    asm volatile ("" ::: "memory");
+    return *(volatile uint32_t *)&seqlock->seq != seq;
+}
+
+__attribute__((always_inline)) __attribute__((unused)) static inline void seqlock_write_acquire(seqlock_t *seqlock) {
+    spinlock_acquire(&seqlock->lock);
+    /* Stores are not reordered with older stores on x86 */
+    *(volatile uint32_t *)&seqlock->seq = seqlock->seq + 1;
+    asm volatile ("" ::: "memory");
+}
+
+__attribute__((always_inline)) __attribute__((unused)) static inline void seqlock_write_release(seqlock_t *seqlock) {
+    asm volatile ("" ::: "memory");
+    *(volatile uint32_t *)&seqlock->seq = seqlock->seq + 1;
+    spinlock_release(&seqlock->lock);
+}
+
+#endif
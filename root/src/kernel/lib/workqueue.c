@@ -0,0 +1,150 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <lib/workqueue.h>
+#include <lib/klib.h>
+#include <lib/lock.h>
+#include <lib/event.h>
+#include <lib/time.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+#include <proc/task.h>
+
+/* How often flush_work() checks on the work it waits for */
+#define WORK_FLUSH_POLL_MS 1
+
+struct work_queue_t {
+    lock_t lock;
+    /* Work to run, in order */
+    struct work_t *head;
+    struct work_t *tail;
+    /* Delayed work, soonest due first */
+    struct work_t *delayed;
+    event_t event;
+    /* Work put on the run list so far, and work finished */
+    uint64_t queued_seq;
+    uint64_t done_seq;
+} __attribute__((aligned(64)));
+
+static struct work_queue_t work_queues[MAX_CPUS];
+
+/* Called with the queue locked */
+static void work_enqueue(struct work_queue_t *queue, struct work_t *work) {
+    work->next = NULL;
+    work->seq = ++queue->queued_seq;
+    if (queue->tail)
+        queue->tail->next = work;
+    else
+        queue->head = work;
+    queue->tail = work;
+}
+
+int queue_work_on(int cpu, struct work_t *work) {
+    if (locked_write(int, &work->pending, 1))
+        return 0;
+
+    struct work_queue_t *queue = &work_queues[cpu];
+
+    spinlock_acquire(&queue->lock);
+    work->cpu = cpu;
+    work_enqueue(queue, work);
+    spinlock_release(&queue->lock);
+
+    event_trigger(&queue->event);
+
+    return 1;
+}
+
+int queue_work(struct work_t *work) {
+    return queue_work_on(smp_ready ? current_cpu : 0, work);
+}
+
+/* Queue work after ms */
+int queue_delayed_work(struct work_t *work, uint64_t ms) {
+    if (!ms)
+        return queue_work(work);
+
+    if (locked_write(int, &work->pending, 1))
+        return 0;
+
+    int cpu = smp_ready ? current_cpu : 0;
+    struct work_queue_t *queue = &work_queues[cpu];
+
+    work->cpu = cpu;
+    work->due = uptime_raw + ms;
+
+    spinlock_acquire(&queue->lock);
+    struct work_t **prev = &queue->delayed;
+    while (*prev && (*prev)->due <= work->due)
+        prev = &(*prev)->next;
+    work->next = *prev;
+    *prev = work;
+    spinlock_release(&queue->lock);
+
+    /* The worker may have to wake up sooner than it planned to */
+    event_trigger(&queue->event);
+
+    return 1;
+}
+
+void flush_work(struct work_t *work) {
+    while (locked_read(int, &work->pending))
+        relaxed_sleep(WORK_FLUSH_POLL_MS);
+
+    /* Started, see whether it is done too */
+    struct work_queue_t *queue = &work_queues[work->cpu];
+    while (locked_read(uint64_t, &queue->done_seq) < work->seq)
+        relaxed_sleep(WORK_FLUSH_POLL_MS);
+}
+
+static void work_worker(void *arg) {
+    int cpu = (int)(size_t)arg;
+    struct work_queue_t *queue = &work_queues[cpu];
+
+    task_bind(cpu);
+
+    for (;;) {
+        spinlock_acquire(&queue->lock);
+
+        while (queue->delayed && queue->delayed->due <= uptime_raw) {
+            struct work_t *work = queue->delayed;
+            queue->delayed = work->next;
+            work_enqueue(queue, work);
+        }
+
+        struct work_t *work = queue->head;
+        if (work) {
+            queue->head = work->next;
+            if (!queue->head)
+                queue->tail = NULL;
+        }
+
+        uint64_t due = queue->delayed ? queue->delayed->due : 0;
+
+        spinlock_release(&queue->lock);
+
+        if (work) {
+            /* From here on it can be queued again */
+            locked_write(int, &work->pending, 0);
+            work->fn(work);
+            locked_inc(&queue->done_seq);
+            continue;
+        }
+
+        if (due) {
+            uint64_t now = uptime_raw;
+            event_await_timeout(&queue->event, due > now ? due - now : 0);
+        } else {
+            event_await(&queue->event);
+        }
+    }
+}
+
+void init_workqueue(void) {
+    for (int i = 0; i < smp_cpu_count; i++) {
+        work_queues[i].lock = new_lock;
+        task_tcreate(0, tcreate_fn_call,
+                     tcreate_fn_call_data(0, work_worker, (void *)(size_t)i));
+    }
+
+    kprint(KPRN_INFO, "workqueue: %d workers launched", smp_cpu_count);
+}
@@ -0,0 +1,45 @@
+#ifndef __WORKQUEUE_H__
+#define __WORKQUEUE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Deferred work, run by one kernel worker thread per CPU. Work is queued
+ * on the CPU it is queued from, and that CPU's worker runs it in order,
+ * so it runs close to whatever produced it, and work queued from different
+ * CPUs runs in parallel. Work may sleep, but holds up the work queued
+ * behind it on the same CPU meanwhile.
+ *
+ * A work_t is usually embedded in whatever it works on:
+ *
+ *     static void sync_fn(struct work_t *);
+ *     static struct work_t sync_work = new_work(sync_fn);
+ *     ...
+ *     queue_delayed_work(&sync_work, 1000);
+ *
+ * The function may free the work_t, or queue it again. */
+
+struct work_t {
+    struct work_t *next;
+    void (*fn)(struct work_t *);
+    /* Queued or delayed, and not started yet */
+    int pending;
+    /* Queue it was last put on, and its place there, for flush_work() */
+    int cpu;
+    uint64_t seq;
+    /* uptime_raw at which delayed work becomes due */
+    uint64_t due;
+};
+
+#define new_work(FN) { .fn = (FN) }
+
+void init_workqueue(void);
+/* Return 0 if the work was pending already, 1 otherwise */
+int queue_work(struct work_t *);
+int queue_work_on(int, struct work_t *);
+int queue_delayed_work(struct work_t *, uint64_t);
+/* Waits until the last queued run of the work is over. Must not be called
+ * for work which frees itself, nor from work on the same CPU's queue. */
+void flush_work(struct work_t *);
+
+#endif
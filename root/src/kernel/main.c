@@ -27,12 +27,34 @@
 #include <sys/vga_font.h>
 #include <lib/rand.h>
 #include <sys/urm.h>
+#include <lib/alloc.h>
+#include <lib/mem.h>
+#include <lib/klog.h>
+#include <lib/rcu.h>
+#include <lib/workqueue.h>
 
 void kmain_thread(void *arg) {
     (void)arg;
 
-    /* Launch the urm */
-    task_tcreate(0, tcreate_fn_call, tcreate_fn_call_data(0, userspace_request_monitor, 0));
+    /* Hand log messages to the flusher from now on */
+    init_klog();
+
+    /* Launch the work queue workers, which also run the urm requests */
+    init_workqueue();
+
+    /* Launch the address space reaper */
+    task_tcreate(0, tcreate_fn_call, tcreate_fn_call_data(0, vmm_reaper, 0));
+
+    /* Launch the RCU reclaimer */
+    task_tcreate(0, tcreate_fn_call, tcreate_fn_call_data(0, rcu_worker, 0));
+
+    char *cmdline_val = cmdline_get_value("membench");
+    if (cmdline_val && !strcmp(cmdline_val, "enabled"))
+        mem_bench();
+
+    cmdline_val = cmdline_get_value("vmmbench");
+    if (cmdline_val && !strcmp(cmdline_val, "enabled"))
+        vmm_bench();
 
     /* Initialise PCI */
     init_pci();
@@ -131,13 +153,16 @@ void kmain(void) {
     kprint(KPRN_INFO, "Build time: %s", BUILD_TIME);
     kprint(KPRN_INFO, "Command line: %s", cmdline);
 
+    init_mem();
     init_idt();
 
     /* Memory-related stuff */
     init_e820();
     init_pmm();
+    init_alloc();
     init_rand();
     init_vmm();
+    init_pmm_late();
 
     dump_vga_font(vga_font);
     init_vbe();
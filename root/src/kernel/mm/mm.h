@@ -4,16 +4,30 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <lib/ht.h>
+#include <lib/types.h>
+#include <sys/cpu.h>
 
 #define PAGE_SIZE ((size_t)4096)
+#define LARGE_PAGE_SIZE ((size_t)0x200000)
+#define HUGE_PAGE_SIZE ((size_t)0x40000000)
 
 #define PAGE_TABLE_ENTRIES 512
 #define KERNEL_PHYS_OFFSET ((size_t)0xffffffffc0000000)
 #define MEM_PHYS_OFFSET ((size_t)0xffff800000000000)
+/* Kernel thread stacks, the PDPT is set up by init_vmm() so that every
+ * address space shares it */
+#define KSTACK_AREA ((size_t)0xffffff0000000000)
 
 #define VMM_ATTR_REG 1
 #define VMM_ATTR_SHARED 2
 
+/* Software-defined page table entry bit marking read-only copy-on-write pages */
+#define VMM_FLAG_COW ((size_t)1 << 9)
+/* Software-defined bit for pages shared with other address spaces, which
+ * stay shared across fork() instead of becoming copy-on-write. Mapping a
+ * page with the VMM_ATTR_SHARED attribute sets it. */
+#define VMM_FLAG_SHARED ((size_t)1 << 10)
+
 typedef uint64_t pt_entry_t;
 
 struct page_attributes_t {
@@ -25,27 +39,126 @@ struct page_attributes_t {
     size_t flags;
 };
 
+/* An open file backing one or more memory regions. Regular files are
+ * looked up by device and inode so that all their mappings share one
+ * object, along with a cache of the file pages read in so far. The file
+ * is opened anew for the object, writable once a shared writable mapping
+ * of it was made. */
+struct vm_file_t {
+    struct vm_file_t *next;
+    int fd;
+    int writable;
+    int refcount;
+    /* Held across seeking and I/O on fd. The I/O may block, so waiters
+     * sleep on io_event instead of spinning. */
+    int io_busy;
+    event_t io_event;
+    int cached;
+    dev_t dev;
+    ino_t ino;
+    /* Physical address of each page of the file, 0 if not read in yet */
+    lock_t cache_lock;
+    size_t *cache;
+    size_t cache_len;
+};
+
+/* A region of an address space whose pages are populated on first touch,
+ * either zero-filled or read from a file. file_size is the number of bytes
+ * from base onwards that come from the file, the rest reads as zero. */
+struct vma_t {
+    struct vma_t *next;
+    size_t base;
+    size_t length;
+    size_t flags;
+    struct vm_file_t *file;
+    size_t file_offset;
+    size_t file_size;
+};
+
 struct pagemap_t {
     ht_new(struct page_attributes_t, page_attributes);
     pt_entry_t *pml4;
     lock_t lock;
+    /* Sorted by base address, protected by lock */
+    struct vma_t *vmas;
+    /* Pages promised to regions, populated or not */
+    size_t committed_pages;
+    /* User pages actually mapped */
+    size_t resident_pages;
+    /* Bitmap of the CPUs which have this pagemap loaded */
+    uint64_t active_cpus[MAX_CPUS / 64];
+    /* Process-context identifier, 0 if none */
+    size_t pcid;
+    /* Next address space waiting for the reaper */
+    struct pagemap_t *reap_next;
 };
 
+/* A range of pages of one pagemap whose translations changed, to be
+ * invalidated all at once by tlb_batch_flush() */
+struct tlb_batch_t {
+    struct pagemap_t *pagemap;
+    size_t base;
+    size_t top;
+};
+
+#define new_tlb_batch(PAGEMAP) ((struct tlb_batch_t){ (PAGEMAP), 0, 0 })
+
 extern struct pagemap_t *kernel_pagemap;
 
 void *pmm_alloc(size_t);
 void *pmm_allocz(size_t);
 void pmm_free(void *, size_t);
+void pmm_free_batch(void **, size_t);
 void init_pmm(void);
+void init_pmm_late(void);
+void pmm_page_ref(void *);
+int pmm_page_unref(void *);
+int pmm_page_shared(void *);
+
+extern size_t pmm_free_pages;
+
+int zero_pool_idle(void);
+
+extern size_t zero_pool_depth;
+extern uint64_t zero_pool_hits;
+extern uint64_t zero_pool_misses;
+extern uint64_t zero_pool_zeroed;
 
 int map_page(struct pagemap_t *, size_t, size_t, size_t, int);
 int unmap_page(struct pagemap_t *, size_t);
 int remap_page(struct pagemap_t *, size_t, size_t);
+int map_large_page(struct pagemap_t *, size_t, size_t, size_t, size_t);
+int unmap_large_page(struct pagemap_t *, size_t, size_t);
+int map_range(struct pagemap_t *, size_t, size_t, size_t, size_t);
+int unmap_range(struct pagemap_t *, size_t, size_t);
+int protect_range(struct pagemap_t *, size_t, size_t, size_t);
 void init_vmm(void);
 
 struct pagemap_t *new_address_space(void);
 struct pagemap_t *fork_address_space(struct pagemap_t *);
 void free_address_space(struct pagemap_t *);
+void reap_address_space(struct pagemap_t *);
+void vmm_reaper(void *);
+int vmm_handle_fault(struct pagemap_t *, size_t, size_t);
+
+struct vm_file_t *vm_file_new(int, int);
+void vm_file_unref(struct vm_file_t *);
+int vmm_add_vma(struct pagemap_t *, size_t, size_t, size_t,
+                struct vm_file_t *, size_t, size_t);
+void vmm_bench(void);
+size_t vmm_first_absent(struct pagemap_t *, size_t, size_t);
+int vmm_populate(struct pagemap_t *, size_t, size_t);
+int vmm_unmap(struct pagemap_t *, size_t, size_t);
+int vmm_sync(struct pagemap_t *, size_t, size_t);
+
+void tlb_shootdown(struct pagemap_t *, size_t, size_t);
+void tlb_batch_add(struct tlb_batch_t *, size_t);
+void tlb_batch_flush(struct tlb_batch_t *);
+size_t tlb_pagemap_switch(struct pagemap_t *);
+void init_pcid(void);
+void pcid_enable(void);
+size_t pcid_alloc(void);
+void pcid_free(size_t);
 
 #define invlpg(addr) ({ \
     asm volatile ( \
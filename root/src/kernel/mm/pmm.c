@@ -4,160 +4,478 @@
 #include <lib/klib.h>
 #include <lib/lock.h>
 #include <lib/bit.h>
+#include <lib/cio.h>
 #include <sys/e820.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+#include <proc/task.h>
+
+/* Buddy allocator. Free memory is kept in blocks of 2^order pages, each
+ * block naturally aligned to its size, on one free list per order.
+ * For each order a bitmap marks which blocks are on the free list, so that
+ * pmm_free() can find out in O(1) whether a block's buddy is free and the
+ * two can be merged into a block of the next order.
+ *
+ * Single pages are served from a per-CPU magazine (see struct cpu_local_t)
+ * which is refilled from and drained to the free lists PAGE_CACHE_BATCH
+ * pages at a time, so that the common case never touches pmm_lock. */
 
 #define MEMORY_BASE 0x1000000
-#define BITMAP_BASE (MEMORY_BASE / PAGE_SIZE)
 
-#define BMREALLOC_STEP 1
+/* Only this much of the physical memory is mapped before init_vmm() is done */
+#define BOOT_MAPPED_LIMIT 0x2000000
 
-static volatile uint32_t *mem_bitmap;
-static volatile uint32_t initial_bitmap[] = { 0xffffff7f };
-static volatile uint32_t *tmp_bitmap;
+#define PMM_MAX_ORDER 10
 
-/* 32 entries because initial_bitmap is a single dword */
-static size_t bitmap_entries = 32;
+struct free_block_t {
+    struct free_block_t *next;
+    struct free_block_t *prev;
+};
 
-static size_t cur_ptr = BITMAP_BASE;
+/* Circular lists, the list heads themselves are sentinels */
+static struct free_block_t free_lists[PMM_MAX_ORDER + 1];
+static uint32_t *free_bitmaps[PMM_MAX_ORDER + 1];
 
-/* A core wishing to modify the PMM bitmap must first acquire this lock,
- * to ensure other cores cannot simultaneously modify the bitmap */
+static size_t base_pfn = MEMORY_BASE / PAGE_SIZE;
+static size_t top_pfn;
+
+size_t pmm_free_pages = 0;
+
+/* Usable memory above BOOT_MAPPED_LIMIT cannot be written to (and so cannot
+ * be linked into the free lists) before the direct map exists. */
+struct deferred_range_t {
+    size_t base;
+    size_t top;
+};
+
+static struct deferred_range_t deferred_ranges[512];
+static size_t deferred_count = 0;
+
+/* Extra references to each page, beyond the first one. Only pages shared
+ * between address spaces (copy-on-write after fork) ever have a nonzero
+ * count, so plain pmm_alloc()/pmm_free() users never touch this. */
+static int32_t *page_refcounts;
+
+/* Single zeroed pages for pmm_allocz(). Idle CPUs top the pool up, see
+ * zero_pool_idle(), as long as there is plenty of free memory left. */
+#define ZERO_POOL_SIZE 512
+#define ZERO_POOL_MIN_FREE (ZERO_POOL_SIZE * 4)
+
+static lock_t zero_pool_lock = new_lock;
+static void *zero_pool[ZERO_POOL_SIZE];
+
+/* Shown in /dev/memstat */
+size_t zero_pool_depth = 0;
+uint64_t zero_pool_hits = 0;
+uint64_t zero_pool_misses = 0;
+uint64_t zero_pool_zeroed = 0;
+
+/* A core wishing to modify the free lists must first acquire this lock,
+ * to ensure other cores cannot simultaneously modify them */
 static lock_t pmm_lock = new_lock;
 
-__attribute__((always_inline)) static inline int read_bitmap(size_t i) {
-    i -= BITMAP_BASE;
+static inline struct free_block_t *pfn_to_block(size_t pfn) {
+    return (struct free_block_t *)(pfn * PAGE_SIZE + MEM_PHYS_OFFSET);
+}
 
-    return test_bit(mem_bitmap, i);
+static inline size_t block_to_pfn(struct free_block_t *block) {
+    return ((size_t)block - MEM_PHYS_OFFSET) / PAGE_SIZE;
 }
 
-__attribute__((always_inline)) static inline void set_bitmap(size_t i, size_t count) {
-    i -= BITMAP_BASE;
+static inline size_t bitmap_index(size_t pfn, int order) {
+    return (pfn - base_pfn) >> order;
+}
+
+static inline void list_remove(struct free_block_t *block) {
+    block->prev->next = block->next;
+    block->next->prev = block->prev;
+}
 
-    size_t f = i + count;
-    for (size_t j = i; j < f; j++)
-        set_bit(mem_bitmap, j);
+static void block_insert(size_t pfn, int order, int tail) {
+    struct free_block_t *head = &free_lists[order];
+    struct free_block_t *block = pfn_to_block(pfn);
 
-    return;
+    if (tail) {
+        block->next = head;
+        block->prev = head->prev;
+    } else {
+        block->next = head->next;
+        block->prev = head;
+    }
+    block->next->prev = block;
+    block->prev->next = block;
+
+    set_bit(free_bitmaps[order], bitmap_index(pfn, order));
+}
+
+static void block_remove(size_t pfn, int order) {
+    list_remove(pfn_to_block(pfn));
+    reset_bit(free_bitmaps[order], bitmap_index(pfn, order));
 }
 
-__attribute__((always_inline)) static inline void unset_bitmap(size_t i, size_t count) {
-    i -= BITMAP_BASE;
+/* Free a single naturally aligned block, merging it with its buddies */
+static void block_free(size_t pfn, int order, int tail) {
+    pmm_free_pages += (size_t)1 << order;
+
+    while (order < PMM_MAX_ORDER) {
+        size_t buddy = pfn ^ ((size_t)1 << order);
+        if (buddy < base_pfn || buddy + ((size_t)1 << order) > top_pfn)
+            break;
+        if (!test_bit(free_bitmaps[order], bitmap_index(buddy, order)))
+            break;
+        block_remove(buddy, order);
+        pfn &= ~((size_t)1 << order);
+        order++;
+    }
 
-    size_t f = i + count;
-    for (size_t j = i; j < f; j++)
-        reset_bit(mem_bitmap, j);
+    block_insert(pfn, order, tail);
+}
 
-    return;
+/* Free an arbitrary run of pages by splitting it into the largest
+ * naturally aligned blocks that fit */
+static void range_free(size_t pfn, size_t top, int tail) {
+    while (pfn < top) {
+        int order = PMM_MAX_ORDER;
+        while (order && ((pfn & (((size_t)1 << order) - 1))
+                         || pfn + ((size_t)1 << order) > top))
+            order--;
+        block_free(pfn, order, tail);
+        pfn += (size_t)1 << order;
+    }
 }
 
-/* Populate bitmap using e820 data. */
-void init_pmm(void) {
-    mem_bitmap = initial_bitmap;
-    if (!(tmp_bitmap = pmm_allocz(BMREALLOC_STEP))) {
-        kprint(KPRN_ERR, "pmm_alloc failure in init_pmm(). Halted.");
-        for (;;);
+static void *block_alloc(int order) {
+    int i;
+    for (i = order; i <= PMM_MAX_ORDER; i++)
+        if (free_lists[i].next != &free_lists[i])
+            break;
+    if (i > PMM_MAX_ORDER)
+        return NULL;
+
+    size_t pfn = block_to_pfn(free_lists[i].next);
+    block_remove(pfn, i);
+
+    /* Split the block, handing the upper halves back */
+    while (i > order) {
+        i--;
+        block_insert(pfn + ((size_t)1 << i), i, 0);
     }
 
-    tmp_bitmap = (uint32_t *)((size_t)tmp_bitmap + MEM_PHYS_OFFSET);
+    pmm_free_pages -= (size_t)1 << order;
 
-    for (size_t i = 0; i < (BMREALLOC_STEP * PAGE_SIZE) / sizeof(uint32_t); i++)
-        tmp_bitmap[i] = 0xffffffff;
+    return (void *)(pfn * PAGE_SIZE);
+}
+
+/* Runs larger than the biggest order are put together from consecutive
+ * free blocks of the maximum order. This is only used for big, rare
+ * allocations such as framebuffers. */
+static void *huge_alloc(size_t pg_count) {
+    size_t blocks = (pg_count + ((size_t)1 << PMM_MAX_ORDER) - 1) >> PMM_MAX_ORDER;
+    size_t max = (top_pfn - base_pfn) >> PMM_MAX_ORDER;
+    size_t run = 0;
+
+    for (size_t i = 0; i < max; i++) {
+        if (!test_bit(free_bitmaps[PMM_MAX_ORDER], i)) {
+            run = 0;
+            continue;
+        }
+        if (++run < blocks)
+            continue;
+
+        size_t first = i + 1 - blocks;
+        for (size_t j = first; j <= i; j++)
+            block_remove(base_pfn + (j << PMM_MAX_ORDER), PMM_MAX_ORDER);
+        pmm_free_pages -= blocks << PMM_MAX_ORDER;
 
-    mem_bitmap = tmp_bitmap;
+        size_t pfn = base_pfn + (first << PMM_MAX_ORDER);
+        range_free(pfn + pg_count, pfn + (blocks << PMM_MAX_ORDER), 0);
 
-    bitmap_entries = ((PAGE_SIZE / sizeof(uint32_t)) * 32) * BMREALLOC_STEP;
+        return (void *)(pfn * PAGE_SIZE);
+    }
+
+    return NULL;
+}
 
+/* Set up the free lists in a single pass over the e820. */
+void init_pmm(void) {
     kprint(KPRN_INFO, "pmm: Mapping memory as specified by the e820...");
 
-    /* For each region specified by the e820, iterate over each page which
-       fits in that region and if the region type indicates the area itself
-       is usable, write that page as free in the bitmap. Otherwise, mark the page as used. */
+    for (int i = 0; i <= PMM_MAX_ORDER; i++) {
+        free_lists[i].next = &free_lists[i];
+        free_lists[i].prev = &free_lists[i];
+    }
+
+    top_pfn = base_pfn;
     for (size_t i = 0; e820_map[i].type; i++) {
-        size_t aligned_base;
-        if (e820_map[i].base % PAGE_SIZE)
-            aligned_base = e820_map[i].base + (PAGE_SIZE - (e820_map[i].base % PAGE_SIZE));
-        else
-            aligned_base = e820_map[i].base;
-        size_t aligned_length = (e820_map[i].length / PAGE_SIZE) * PAGE_SIZE;
-        if ((e820_map[i].base % PAGE_SIZE) && aligned_length) aligned_length -= PAGE_SIZE;
-
-        for (size_t j = 0; j * PAGE_SIZE < aligned_length; j++) {
-            size_t addr = aligned_base + j * PAGE_SIZE;
-
-            size_t page = addr / PAGE_SIZE;
-
-            if (addr < (MEMORY_BASE + PAGE_SIZE /* bitmap */))
-                continue;
-
-            if (addr >= (MEMORY_BASE + bitmap_entries * PAGE_SIZE)) {
-                /* Reallocate bitmap */
-                size_t cur_bitmap_size_in_pages = ((bitmap_entries / 32) * sizeof(uint32_t)) / PAGE_SIZE;
-                size_t new_bitmap_size_in_pages = cur_bitmap_size_in_pages + BMREALLOC_STEP;
-                if (!(tmp_bitmap = pmm_allocz(new_bitmap_size_in_pages))) {
-                    kprint(KPRN_ERR, "pmm_alloc failure in init_pmm(). Halted.");
-                    for (;;);
-                }
-                tmp_bitmap = (uint32_t *)((size_t)tmp_bitmap + MEM_PHYS_OFFSET);
-                /* Copy over previous bitmap */
-                for (size_t i = 0;
-                     i < (cur_bitmap_size_in_pages * PAGE_SIZE) / sizeof(uint32_t);
-                     i++)
-                    tmp_bitmap[i] = mem_bitmap[i];
-                /* Fill in the rest */
-                for (size_t i = (cur_bitmap_size_in_pages * PAGE_SIZE) / sizeof(uint32_t);
-                     i < (new_bitmap_size_in_pages * PAGE_SIZE) / sizeof(uint32_t);
-                     i++)
-                    tmp_bitmap[i] = 0xffffffff;
-                bitmap_entries += ((PAGE_SIZE / sizeof(uint32_t)) * 32) * BMREALLOC_STEP;
-                uint32_t *old_bitmap = (uint32_t *)((size_t)mem_bitmap - MEM_PHYS_OFFSET);
-                mem_bitmap = tmp_bitmap;
-                pmm_free(old_bitmap, cur_bitmap_size_in_pages);
-            }
+        if (e820_map[i].type != 1)
+            continue;
+        size_t top = (e820_map[i].base + e820_map[i].length) / PAGE_SIZE;
+        if (top > top_pfn)
+            top_pfn = top;
+    }
 
-            if (e820_map[i].type == 1)
-                unset_bitmap(page, 1);
-            else
-                set_bitmap(page, 1);
+    /* Round up so every order bitmap covers whole blocks */
+    top_pfn = (top_pfn + ((size_t)1 << PMM_MAX_ORDER) - 1)
+              & ~(((size_t)1 << PMM_MAX_ORDER) - 1);
+
+    size_t bitmaps_size = 0;
+    for (int i = 0; i <= PMM_MAX_ORDER; i++)
+        bitmaps_size += (((top_pfn - base_pfn) >> i) + 31) / 32 * sizeof(uint32_t);
+    size_t bitmaps_pages = (bitmaps_size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    /* The bitmaps go at the start of the first usable region past
+     * MEMORY_BASE that is large enough and already mapped */
+    size_t bitmaps_phys = 0;
+    for (size_t i = 0; e820_map[i].type; i++) {
+        if (e820_map[i].type != 1)
+            continue;
+        size_t base = (e820_map[i].base + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        size_t top = (e820_map[i].base + e820_map[i].length) & ~(PAGE_SIZE - 1);
+        if (base < MEMORY_BASE)
+            base = MEMORY_BASE;
+        if (top > BOOT_MAPPED_LIMIT)
+            top = BOOT_MAPPED_LIMIT;
+        if (base < top && top - base >= bitmaps_pages * PAGE_SIZE) {
+            bitmaps_phys = base;
+            break;
+        }
+    }
+    if (!bitmaps_phys) {
+        kprint(KPRN_ERR, "pmm: No room for the allocator bitmaps. Halted.");
+        for (;;);
+    }
+
+    uint32_t *bitmaps = (uint32_t *)(bitmaps_phys + MEM_PHYS_OFFSET);
+    memset(bitmaps, 0, bitmaps_pages * PAGE_SIZE);
+    for (int i = 0; i <= PMM_MAX_ORDER; i++) {
+        free_bitmaps[i] = bitmaps;
+        bitmaps += (((top_pfn - base_pfn) >> i) + 31) / 32;
+    }
+
+    size_t reserved_base = bitmaps_phys / PAGE_SIZE;
+    size_t reserved_top = reserved_base + bitmaps_pages;
+
+    for (size_t i = 0; e820_map[i].type; i++) {
+        if (e820_map[i].type != 1)
+            continue;
+
+        size_t base = (e820_map[i].base + PAGE_SIZE - 1) / PAGE_SIZE;
+        size_t top = (e820_map[i].base + e820_map[i].length) / PAGE_SIZE;
+        if (base < base_pfn)
+            base = base_pfn;
+        if (base >= top)
+            continue;
+
+        /* Split around the bitmaps */
+        size_t parts[2][2] = { { base, top }, { 0, 0 } };
+        if (base <= reserved_base && reserved_top <= top) {
+            parts[0][1] = reserved_base;
+            parts[1][0] = reserved_top;
+            parts[1][1] = top;
+        }
+
+        for (int j = 0; j < 2; j++) {
+            size_t pbase = parts[j][0];
+            size_t ptop = parts[j][1];
+            size_t limit = BOOT_MAPPED_LIMIT / PAGE_SIZE;
+
+            if (pbase < limit) {
+                range_free(pbase, ptop < limit ? ptop : limit, 1);
+                pbase = limit;
+            }
+            if (pbase < ptop) {
+                deferred_ranges[deferred_count].base = pbase;
+                deferred_ranges[deferred_count].top = ptop;
+                deferred_count++;
+            }
         }
     }
 
     return;
 }
 
-/* Allocate physical memory. */
-void *pmm_alloc(size_t pg_count) {
+/* Hand out the rest of the usable memory, once init_vmm() has mapped it. */
+void init_pmm_late(void) {
     spinlock_acquire(&pmm_lock);
 
-    size_t pg_cnt = pg_count;
+    for (size_t i = 0; i < deferred_count; i++)
+        range_free(deferred_ranges[i].base, deferred_ranges[i].top, 1);
+    deferred_count = 0;
 
-    for (size_t i = 0; i < bitmap_entries; i++) {
-        if (cur_ptr == BITMAP_BASE + bitmap_entries) {
-            cur_ptr = BITMAP_BASE;
-            cur_ptr = pg_count;
-        }
-        if (!read_bitmap(cur_ptr++)) {
-            if (!--pg_cnt)
-                goto found;
-        } else {
-            pg_cnt = pg_count;
-        }
+    spinlock_release(&pmm_lock);
+
+    size_t refcounts_size = (top_pfn - base_pfn) * sizeof(int32_t);
+    page_refcounts = pmm_allocz((refcounts_size + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!page_refcounts) {
+        kprint(KPRN_ERR, "pmm: Failed to allocate page refcounts. Halted.");
+        for (;;);
     }
+    page_refcounts = (int32_t *)((size_t)page_refcounts + MEM_PHYS_OFFSET);
 
+    kprint(KPRN_INFO, "pmm: %U MiB free", pmm_free_pages * PAGE_SIZE / 1024 / 1024);
+}
+
+/* Interrupts must be disabled so the thread is neither preempted nor
+ * migrated while it works on its CPU's magazine */
+static void *page_cache_alloc(void) {
+    struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
+
+    if (cpu_local->page_cache_count) {
+        cpu_local->page_cache_hits++;
+        return cpu_local->page_cache[--cpu_local->page_cache_count];
+    }
+
+    cpu_local->page_cache_misses++;
+
+    spinlock_acquire(&pmm_lock);
+    for (size_t i = 0; i < PAGE_CACHE_BATCH; i++) {
+        void *page = block_alloc(0);
+        if (!page)
+            break;
+        cpu_local->page_cache[cpu_local->page_cache_count++] = page;
+    }
     spinlock_release(&pmm_lock);
-    return NULL;
 
-found:;
-    size_t start = cur_ptr - pg_count;
-    set_bitmap(start, pg_count);
+    if (!cpu_local->page_cache_count)
+        return NULL;
+
+    cpu_local->page_cache_refills++;
+    return cpu_local->page_cache[--cpu_local->page_cache_count];
+}
+
+static void page_cache_free(void *ptr) {
+    struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
+
+    if (cpu_local->page_cache_count == PAGE_CACHE_SIZE) {
+        cpu_local->page_cache_drains++;
+        spinlock_acquire(&pmm_lock);
+        for (size_t i = 0; i < PAGE_CACHE_BATCH; i++) {
+            size_t pfn = (size_t)cpu_local->page_cache[--cpu_local->page_cache_count]
+                         / PAGE_SIZE;
+            block_free(pfn, 0, 0);
+        }
+        spinlock_release(&pmm_lock);
+    }
+
+    cpu_local->page_cache[cpu_local->page_cache_count++] = ptr;
+}
+
+/* Take a page off the zero pool, NULL if it is empty. count is zero for
+ * the out of memory fallback, which is neither a hit nor a miss. */
+static void *zero_pool_get(int count) {
+    void *ptr = NULL;
+
+    spinlock_acquire(&zero_pool_lock);
+
+    if (zero_pool_depth) {
+        ptr = zero_pool[--zero_pool_depth];
+        if (count)
+            zero_pool_hits++;
+    } else if (count) {
+        zero_pool_misses++;
+    }
+
+    spinlock_release(&zero_pool_lock);
+
+    return ptr;
+}
+
+/* Zero a page with non-temporal stores, so that the pool does not push
+ * useful data out of the cache */
+static void zero_page_nt(void *page) {
+    size_t count = PAGE_SIZE / 32;
+
+    asm volatile (
+        "1: "
+        "movnti qword ptr [rdi], rax;"
+        "movnti qword ptr [rdi+8], rax;"
+        "movnti qword ptr [rdi+16], rax;"
+        "movnti qword ptr [rdi+24], rax;"
+        "add rdi, 32;"
+        "dec rcx;"
+        "jnz 1b;"
+        "sfence;"
+        : "+D" (page), "+c" (count)
+        : "a" ((size_t)0)
+        : "memory", "cc"
+    );
+}
+
+/* Zero one page into the pool. Called by the idle loop with interrupts
+ * disabled, so that an interrupt never finds a page halfway through.
+ * Returns 0 once the pool is full or no more pages can be spared. */
+int zero_pool_idle(void) {
+    if (locked_read(size_t, &zero_pool_depth) >= ZERO_POOL_SIZE
+     || locked_read(size_t, &pmm_free_pages) <= ZERO_POOL_MIN_FREE)
+        return 0;
+
+    void *page = pmm_alloc(1);
+    if (!page)
+        return 0;
+
+    zero_page_nt((void *)((size_t)page + MEM_PHYS_OFFSET));
+
+    spinlock_acquire(&zero_pool_lock);
+    if (zero_pool_depth == ZERO_POOL_SIZE) {
+        spinlock_release(&zero_pool_lock);
+        pmm_free(page, 1);
+        return 0;
+    }
+    zero_pool[zero_pool_depth++] = page;
+    zero_pool_zeroed++;
+    spinlock_release(&zero_pool_lock);
+
+    return 1;
+}
+
+/* Allocate physical memory. */
+void *pmm_alloc(size_t pg_count) {
+    if (!pg_count)
+        return NULL;
+
+    if (pg_count == 1 && smp_ready) {
+        uint64_t flags = save_and_disable_interrupts();
+        void *ptr = page_cache_alloc();
+        restore_interrupts(flags);
+        if (ptr)
+            return ptr;
+    }
+
+    int order = 0;
+    while (order <= PMM_MAX_ORDER && ((size_t)1 << order) < pg_count)
+        order++;
+
+    spinlock_acquire(&pmm_lock);
+
+    void *ptr;
+    if (order > PMM_MAX_ORDER) {
+        ptr = huge_alloc(pg_count);
+    } else {
+        ptr = block_alloc(order);
+        /* Give back what was rounded up to the power of two */
+        if (ptr && pg_count != ((size_t)1 << order))
+            range_free((size_t)ptr / PAGE_SIZE + pg_count,
+                       (size_t)ptr / PAGE_SIZE + ((size_t)1 << order), 0);
+    }
 
     spinlock_release(&pmm_lock);
 
+    /* Out of memory, fall back to the pages zeroed in advance */
+    if (!ptr && pg_count == 1)
+        ptr = zero_pool_get(0);
+
     // Return the physical address that represents the start of this physical page(s).
-    return (void *)(start * PAGE_SIZE);
+    return ptr;
 }
 
 /* Allocate physical memory and zero it out. */
 void *pmm_allocz(size_t pg_count) {
+    if (pg_count == 1) {
+        void *ptr = zero_pool_get(1);
+        if (ptr)
+            return ptr;
+    }
+
     void *ptr = pmm_alloc(pg_count);
     if (!ptr)
         return NULL;
@@ -172,13 +490,82 @@ void *pmm_allocz(size_t pg_count) {
 
 /* Release physical memory. */
 void pmm_free(void *ptr, size_t pg_count) {
+    if (pg_count == 1 && smp_ready) {
+        uint64_t flags = save_and_disable_interrupts();
+        page_cache_free(ptr);
+        restore_interrupts(flags);
+        return;
+    }
+
     spinlock_acquire(&pmm_lock);
 
     size_t start = (size_t)ptr / PAGE_SIZE;
 
-    unset_bitmap(start, pg_count);
+    range_free(start, start + pg_count, 0);
 
     spinlock_release(&pmm_lock);
 
     return;
 }
+
+/* Free a number of single pages at once, bypassing the per-CPU caches
+ * which a bulk release would only churn through. */
+void pmm_free_batch(void **pages, size_t count) {
+    spinlock_acquire(&pmm_lock);
+
+    for (size_t i = 0; i < count; i++)
+        block_free((size_t)pages[i] / PAGE_SIZE, 0, 0);
+
+    spinlock_release(&pmm_lock);
+}
+
+static inline int32_t *page_refcount(void *ptr) {
+    size_t pfn = (size_t)ptr / PAGE_SIZE;
+
+    if (pfn < base_pfn || pfn >= top_pfn)
+        return NULL;
+
+    return &page_refcounts[pfn - base_pfn];
+}
+
+/* Take another reference to an allocated page. */
+void pmm_page_ref(void *ptr) {
+    int32_t *refcount = page_refcount(ptr);
+    if (!refcount)
+        return;
+
+    locked_inc(refcount);
+}
+
+/* Drop a reference to a page. Returns 0 if the caller held the last
+ * reference and is now responsible for freeing the page. */
+int pmm_page_unref(void *ptr) {
+    int32_t *refcount = page_refcount(ptr);
+    if (!refcount)
+        return 0;
+
+    int32_t old = -1;
+    asm volatile (
+        "lock xadd %1, %0;"
+        : "+r" (old), "+m" (*refcount)
+        :
+        : "memory", "cc"
+    );
+
+    if (!old) {
+        /* We were the only owner, nobody else can race us here */
+        *refcount = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Returns nonzero if more than one reference to the page exists. */
+int pmm_page_shared(void *ptr) {
+    int32_t *refcount = page_refcount(ptr);
+    if (!refcount)
+        return 0;
+
+    return locked_read(int32_t, refcount) != 0;
+}
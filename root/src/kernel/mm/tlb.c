@@ -0,0 +1,380 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <cpuid.h>
+#include <mm/mm.h>
+#include <lib/klib.h>
+#include <lib/lock.h>
+#include <lib/cio.h>
+#include <sys/cpu.h>
+#include <sys/smp.h>
+#include <sys/apic.h>
+#include <sys/ipi.h>
+
+/* Above this many pages flushing the whole TLB beats invlpg'ing each one */
+#define TLB_FLUSH_THRESHOLD 32
+
+#define CPUID_PCID (1 << 17)
+#define CPUID_INVPCID (1 << 10)
+
+#define CR4_PGE ((size_t)1 << 7)
+#define CR4_PCIDE ((size_t)1 << 17)
+/* Keep the translations tagged with the PCID being loaded */
+#define CR3_NOFLUSH ((size_t)1 << 63)
+
+#define INVPCID_ADDRESS 0
+#define INVPCID_CONTEXT 1
+#define INVPCID_ALL 2
+
+/* With PCIDs, every pagemap gets its own PCID if one is free, and switching
+ * address spaces no longer flushes the TLB. PCID 0 belongs to the kernel
+ * pagemap, and to the pagemaps which did not get one, which are flushed
+ * whenever they are loaded.
+ * Translations of a pagemap outlive its stay in CR3, so a shootdown marks
+ * its PCID stale on the CPUs which do not have it loaded, and those flush
+ * it the next time they load it. Freed PCIDs are marked stale everywhere. */
+static int pcid_enabled = 0;
+static int invpcid_supported = 0;
+
+static lock_t pcid_lock = new_lock;
+static uint64_t pcid_bitmap[PCID_COUNT / 64] = { 1 };
+static size_t pcid_hint = 1;
+
+/* One shootdown is carried out at a time. shootdown_pages == 0 asks the
+ * targets for a full flush. */
+static lock_t shootdown_lock = new_lock;
+static struct pagemap_t *shootdown_pagemap;
+static size_t shootdown_base;
+static size_t shootdown_pages;
+
+#define read_cr4() ({ \
+    size_t cr4; \
+    asm volatile ("mov rax, cr4;" : "=a" (cr4)); \
+    cr4; \
+})
+
+#define write_cr4(NEW_CR4) ({ \
+    asm volatile ("mov cr4, rax;" : : "a" (NEW_CR4) : "memory"); \
+})
+
+static inline void invpcid(uint64_t type, uint64_t pcid, size_t addr) {
+    struct {
+        uint64_t pcid;
+        uint64_t addr;
+    } descriptor = { pcid, addr };
+
+    asm volatile (
+        "invpcid %0, [%1];"
+        :
+        : "r" (type), "r" (&descriptor), "m" (descriptor)
+        : "memory"
+    );
+}
+
+static inline int bit_test(uint64_t *bitmap, size_t bit) {
+    return !!(bitmap[bit / 64] & ((uint64_t)1 << (bit % 64)));
+}
+
+static inline void locked_bit_set(uint64_t *bitmap, size_t bit) {
+    asm volatile (
+        "lock bts %0, %1;"
+        : "+m" (bitmap[bit / 64])
+        : "r" ((uint64_t)(bit % 64))
+        : "memory", "cc"
+    );
+}
+
+static inline int locked_bit_test_and_reset(uint64_t *bitmap, size_t bit) {
+    int ret;
+    asm volatile (
+        "lock btr %1, %2;"
+        : "=@ccc" (ret), "+m" (bitmap[bit / 64])
+        : "r" ((uint64_t)(bit % 64))
+        : "memory"
+    );
+    return ret;
+}
+
+/* Enable PCIDs on the calling CPU, if init_pcid() found them usable */
+void pcid_enable(void) {
+    if (pcid_enabled)
+        write_cr4(read_cr4() | CR4_PCIDE);
+}
+
+/* Called on the BSP with the kernel pagemap loaded (PCID 0) */
+void init_pcid(void) {
+    unsigned int eax, ebx, ecx = 0, edx;
+
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & CPUID_PCID)) {
+        kprint(KPRN_INFO, "tlb: PCID unsupported, flushing on address space switches");
+        return;
+    }
+
+    ebx = 0;
+    __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+    invpcid_supported = !!(ebx & CPUID_INVPCID);
+
+    pcid_enabled = 1;
+    pcid_enable();
+
+    kprint(KPRN_INFO, "tlb: PCID enabled, INVPCID %s",
+           invpcid_supported ? "supported" : "unsupported");
+}
+
+/* Returns a free PCID, or 0 if there is none left */
+size_t pcid_alloc(void) {
+    if (!pcid_enabled)
+        return 0;
+
+    spinlock_acquire(&pcid_lock);
+
+    for (size_t i = 0; i < PCID_COUNT; i++) {
+        size_t pcid = (pcid_hint + i) % PCID_COUNT;
+        if (!bit_test(pcid_bitmap, pcid)) {
+            pcid_bitmap[pcid / 64] |= (uint64_t)1 << (pcid % 64);
+            pcid_hint = pcid + 1;
+            spinlock_release(&pcid_lock);
+            return pcid;
+        }
+    }
+
+    spinlock_release(&pcid_lock);
+    return 0;
+}
+
+/* The translations left behind by the pagemap are dropped by every CPU
+ * before the PCID is used again */
+void pcid_free(size_t pcid) {
+    if (!pcid)
+        return;
+
+    for (int i = 0; i < smp_cpu_count; i++)
+        locked_bit_set(cpu_locals[i].pcid_stale, pcid);
+
+    spinlock_acquire(&pcid_lock);
+    pcid_bitmap[pcid / 64] &= ~((uint64_t)1 << (pcid % 64));
+    spinlock_release(&pcid_lock);
+}
+
+/* Flush translations tagged with any PCID, global ones included */
+static void tlb_flush_all_contexts(void) {
+    if (invpcid_supported) {
+        invpcid(INVPCID_ALL, 0, 0);
+        return;
+    }
+
+    /* Toggling CR4.PGE flushes everything */
+    size_t cr4 = read_cr4();
+    write_cr4(cr4 ^ CR4_PGE);
+    write_cr4(cr4);
+}
+
+/* Flush from the pagemap loaded in CR3 */
+static void tlb_flush_current(size_t base, size_t pages) {
+    if (!pages) {
+        /* Without the no-flush bit this drops the current PCID only */
+        load_cr3(read_cr3());
+        return;
+    }
+
+    for (size_t i = 0; i < pages; i++)
+        invlpg(base + i * PAGE_SIZE);
+}
+
+static void tlb_flush_local(struct pagemap_t *pagemap, size_t base, size_t pages) {
+    struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
+
+    if (pagemap == kernel_pagemap && pcid_enabled) {
+        /* The higher half is cached under every PCID */
+        tlb_flush_all_contexts();
+        return;
+    }
+
+    if (pagemap != kernel_pagemap && pagemap != cpu_local->active_pagemap) {
+        /* Only a PCID can carry translations of a pagemap not loaded here */
+        if (!pcid_enabled || !pagemap->pcid)
+            return;
+        if (!invpcid_supported) {
+            locked_bit_set(cpu_local->pcid_stale, pagemap->pcid);
+            return;
+        }
+        if (!pages) {
+            invpcid(INVPCID_CONTEXT, pagemap->pcid, 0);
+            return;
+        }
+        for (size_t i = 0; i < pages; i++)
+            invpcid(INVPCID_ADDRESS, pagemap->pcid, base + i * PAGE_SIZE);
+        return;
+    }
+
+    tlb_flush_current(base, pages);
+}
+
+/* Carry out the shootdown pending on this CPU, if any. Besides the IPI,
+ * this is polled while waiting for shootdown_lock, so that two CPUs
+ * shooting each other down with interrupts disabled do not deadlock. */
+void tlb_shootdown_handler(void) {
+    struct cpu_local_t *cpu_local = &cpu_locals[current_cpu];
+
+    if (!locked_read(int, &cpu_local->tlb_shootdown_pending))
+        return;
+
+    tlb_flush_local(shootdown_pagemap, shootdown_base, shootdown_pages);
+
+    locked_write(int, &cpu_local->tlb_shootdown_pending, 0);
+}
+
+static inline int pagemap_active_on(struct pagemap_t *pagemap, int cpu) {
+    return pagemap == kernel_pagemap || bit_test(pagemap->active_cpus, cpu);
+}
+
+/* Invalidate pages [base, base + pages * PAGE_SIZE) of pagemap on every CPU
+ * which has it loaded. Call after the page tables were updated. Changes to
+ * the kernel pagemap concern all CPUs. */
+void tlb_shootdown(struct pagemap_t *pagemap, size_t base, size_t pages) {
+    if (pages > TLB_FLUSH_THRESHOLD)
+        pages = 0;
+
+    if (!smp_ready) {
+        if (pagemap == kernel_pagemap && pcid_enabled)
+            tlb_flush_all_contexts();
+        else if (pagemap == kernel_pagemap
+              || (size_t)pagemap->pml4 - MEM_PHYS_OFFSET == (read_cr3() & ~(PAGE_SIZE - 1)))
+            tlb_flush_current(base, pages);
+        return;
+    }
+
+    uint64_t flags = save_and_disable_interrupts();
+
+    int _current_cpu = current_cpu;
+    struct cpu_local_t *cpu_local = &cpu_locals[_current_cpu];
+    int tagged = pcid_enabled && pagemap != kernel_pagemap && pagemap->pcid;
+
+    /* The updated entries must be visible before we look at which CPUs
+     * have the pagemap loaded, see tlb_pagemap_switch() */
+    asm volatile ("mfence" ::: "memory");
+
+    uint64_t targets[MAX_CPUS / 64] = {0};
+    int target_count = 0;
+    for (int i = 0; i < smp_cpu_count; i++) {
+        if (i == _current_cpu)
+            continue;
+        if (pagemap_active_on(pagemap, i)) {
+            targets[i / 64] |= (uint64_t)1 << (i % 64);
+            target_count++;
+        } else if (tagged) {
+            locked_bit_set(cpu_locals[i].pcid_stale, pagemap->pcid);
+        }
+    }
+
+    if (tagged) {
+        /* A CPU which loaded the pagemap after we looked, but before its
+         * PCID got marked stale, keeps old translations: shoot it down too */
+        asm volatile ("mfence" ::: "memory");
+        for (int i = 0; i < smp_cpu_count; i++) {
+            if (i == _current_cpu || bit_test(targets, i))
+                continue;
+            if (pagemap_active_on(pagemap, i)) {
+                locked_bit_set(targets, i);
+                target_count++;
+            }
+        }
+    }
+
+    tlb_flush_local(pagemap, base, pages);
+
+    if (target_count) {
+        while (!spinlock_test_and_acquire(&shootdown_lock))
+            tlb_shootdown_handler();
+
+        shootdown_pagemap = pagemap;
+        shootdown_base = base;
+        shootdown_pages = pages;
+
+        for (int i = 0; i < smp_cpu_count; i++) {
+            if (!bit_test(targets, i))
+                continue;
+            locked_write(int, &cpu_locals[i].tlb_shootdown_pending, 1);
+            lapic_send_ipi(i, IPI_TLB);
+            cpu_local->tlb_ipis_sent++;
+        }
+
+        for (int i = 0; i < smp_cpu_count; i++) {
+            if (!bit_test(targets, i))
+                continue;
+            while (locked_read(int, &cpu_locals[i].tlb_shootdown_pending))
+                asm volatile ("pause");
+        }
+
+        spinlock_release(&shootdown_lock);
+    }
+
+    if (pages)
+        cpu_local->tlb_pages_invalidated += pages;
+    else
+        cpu_local->tlb_full_flushes++;
+
+    restore_interrupts(flags);
+}
+
+void tlb_batch_add(struct tlb_batch_t *batch, size_t virt_addr) {
+    virt_addr &= ~(PAGE_SIZE - 1);
+
+    if (batch->base == batch->top) {
+        batch->base = virt_addr;
+        batch->top = virt_addr + PAGE_SIZE;
+        return;
+    }
+
+    if (virt_addr < batch->base)
+        batch->base = virt_addr;
+    if (virt_addr + PAGE_SIZE > batch->top)
+        batch->top = virt_addr + PAGE_SIZE;
+}
+
+/* Shoot down everything added to the batch with a single round of IPIs */
+void tlb_batch_flush(struct tlb_batch_t *batch) {
+    if (batch->base == batch->top)
+        return;
+
+    tlb_shootdown(batch->pagemap, batch->base, (batch->top - batch->base) / PAGE_SIZE);
+
+    batch->base = batch->top = 0;
+}
+
+/* Record that this CPU is about to load pagemap, and return the value to
+ * load into CR3. Called with interrupts disabled. The CPU stops receiving
+ * shootdowns for the previous pagemap: without PCIDs the CR3 load drops
+ * its translations, with PCIDs shootdowns mark its PCID stale instead. */
+size_t tlb_pagemap_switch(struct pagemap_t *pagemap) {
+    int _current_cpu = current_cpu;
+    struct cpu_local_t *cpu_local = &cpu_locals[_current_cpu];
+    struct pagemap_t *old = cpu_local->active_pagemap;
+    size_t cr3 = (size_t)pagemap->pml4 - MEM_PHYS_OFFSET;
+
+    if (old != pagemap) {
+        if (old && old != kernel_pagemap)
+            locked_bit_test_and_reset(old->active_cpus, _current_cpu);
+        if (pagemap != kernel_pagemap)
+            locked_bit_set(pagemap->active_cpus, _current_cpu);
+        cpu_local->active_pagemap = pagemap;
+    }
+
+    if (!pcid_enabled)
+        return cr3;
+
+    if (pagemap->pcid) {
+        cr3 |= pagemap->pcid;
+        if (!locked_bit_test_and_reset(cpu_local->pcid_stale, pagemap->pcid))
+            cr3 |= CR3_NOFLUSH;
+    } else if (pagemap == kernel_pagemap) {
+        /* The kernel shares PCID 0 with pagemaps which got no PCID */
+        if (cpu_local->pcid0_kernel)
+            cr3 |= CR3_NOFLUSH;
+        cpu_local->pcid0_kernel = 1;
+    } else {
+        cpu_local->pcid0_kernel = 0;
+    }
+
+    return cr3;
+}
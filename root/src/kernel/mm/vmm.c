@@ -6,6 +6,16 @@
 #include <sys/e820.h>
 #include <lib/lock.h>
 #include <sys/panic.h>
+#include <fd/fd.h>
+#include <lib/event.h>
+#include <lib/rand.h>
+#include <cpuid.h>
+
+/* Pages read from a file on a fault, around the faulting one */
+#define VMM_READAROUND_PAGES 16
+
+/* CPUID 0x80000001 EDX bit for 1 GiB pages */
+#define CPUID_PDPE1GB (1 << 26)
 
 static struct pagemap_t __kp;
 struct pagemap_t *kernel_pagemap = &__kp;
@@ -24,6 +34,90 @@ static inline size_t entries_to_virt_addr(size_t pml4_entry,
     return virt_addr;
 }
 
+/* Page size bit of PDPT and PD entries */
+#define PT_FLAG_LARGE ((pt_entry_t)1 << 7)
+/* PAT bit of large page entries, bit 7 in a 4 KiB page table entry */
+#define PT_FLAG_LARGE_PAT ((pt_entry_t)1 << 12)
+#define PT_FLAG_NX ((pt_entry_t)1 << 63)
+/* Set by the CPU on the first write through an entry */
+#define PT_FLAG_DIRTY ((pt_entry_t)1 << 6)
+
+static inline size_t table_index(size_t virt_addr, int level) {
+    return (virt_addr >> (12 + 9 * (level - 1))) & 0x1ff;
+}
+
+/* Page table pages allocated up front by the range operations, handed out
+ * by table_alloc() before falling back to the PMM */
+struct table_pool_t {
+    size_t next;
+    size_t count;
+};
+
+/* Returns the physical address of a zeroed page for a page table */
+static void *table_alloc(struct table_pool_t *pool) {
+    if (pool && pool->count) {
+        void *page = (void *)pool->next;
+        pool->next += PAGE_SIZE;
+        pool->count--;
+        return page;
+    }
+    return pmm_allocz(1);
+}
+
+/* Replace a large page entry at the given level (3: 1 GiB, 2: 2 MiB) with a
+ * table of pages one size down mapping the same memory with the same flags.
+ * Returns the new table, or NULL on allocation failure. */
+static pt_entry_t *split_large_page(pt_entry_t *entry, int level,
+                                    struct table_pool_t *pool) {
+    pt_entry_t *table = table_alloc(pool);
+    if (!table)
+        return NULL;
+    table = (pt_entry_t *)((size_t)table + MEM_PHYS_OFFSET);
+
+    pt_entry_t e = *entry;
+
+    if (level == 3) {
+        size_t base = e & 0x000fffffc0000000;
+        pt_entry_t flags = (e & 0x1fff) | (e & PT_FLAG_NX);
+        for (size_t i = 0; i < PAGE_TABLE_ENTRIES; i++)
+            table[i] = (base + i * LARGE_PAGE_SIZE) | flags;
+    } else {
+        size_t base = e & 0x000fffffffe00000;
+        pt_entry_t flags = (e & 0xfff & ~PT_FLAG_LARGE) | (e & PT_FLAG_NX);
+        if (e & PT_FLAG_LARGE_PAT)
+            flags |= PT_FLAG_LARGE;
+        for (size_t i = 0; i < PAGE_TABLE_ENTRIES; i++)
+            table[i] = (base + i * PAGE_SIZE) | flags;
+    }
+
+    /* Present + writable + user (0b111) */
+    *entry = (pt_entry_t)((size_t)table - MEM_PHYS_OFFSET) | 0b111;
+
+    return table;
+}
+
+/* Get the table an entry at the given level points to. Missing tables are
+ * allocated if create is set, large pages are split. NULL on failure. */
+static pt_entry_t *next_table(pt_entry_t *entry, int level, int create,
+                              struct table_pool_t *pool) {
+    if (!(*entry & 0x1)) {
+        if (!create)
+            return NULL;
+        /* Allocate a page for the table */
+        pt_entry_t *table = table_alloc(pool);
+        if (!table)
+            return NULL;
+        /* Present + writable + user (0b111) */
+        *entry = (pt_entry_t)table | 0b111;
+        return (pt_entry_t *)((size_t)table + MEM_PHYS_OFFSET);
+    }
+
+    if (level < 4 && (*entry & PT_FLAG_LARGE))
+        return split_large_page(entry, level, pool);
+
+    return (pt_entry_t *)((*entry & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+}
+
 struct pagemap_t *new_address_space(void) {
     struct pagemap_t *new_pagemap = kalloc(sizeof(struct pagemap_t));
     if (!new_pagemap)
@@ -35,13 +129,50 @@ struct pagemap_t *new_address_space(void) {
     }
     new_pagemap->pml4 = (void *)((size_t)new_pagemap->pml4 + MEM_PHYS_OFFSET);
     new_pagemap->lock = new_lock;
+    new_pagemap->vmas = NULL;
+    new_pagemap->committed_pages = 0;
+    new_pagemap->resident_pages = 0;
+    new_pagemap->pcid = pcid_alloc();
     return new_pagemap;
 }
 
+/* Pages handed back to the PMM together by free_address_space() */
+#define PAGE_BATCH_SIZE 64
+
+struct page_batch_t {
+    size_t count;
+    void *pages[PAGE_BATCH_SIZE];
+};
+
+static inline void page_batch_add(struct page_batch_t *batch, void *page) {
+    batch->pages[batch->count++] = page;
+    if (batch->count == PAGE_BATCH_SIZE) {
+        pmm_free_batch(batch->pages, batch->count);
+        batch->count = 0;
+    }
+}
+
+static inline void page_batch_release(struct page_batch_t *batch, void *page) {
+    if (!pmm_page_unref(page))
+        page_batch_add(batch, page);
+}
+
 void free_address_space(struct pagemap_t *pagemap) {
     pt_entry_t *pdpt;
     pt_entry_t *pd;
     pt_entry_t *pt;
+    struct page_batch_t batch;
+
+    batch.count = 0;
+
+    /* Nobody else uses the address space anymore, the regions stay put.
+     * Nobody is left to report a failed writeback to either. */
+    for (struct vma_t *vma = pagemap->vmas; vma; vma = vma->next) {
+        if (vma->file && (vma->flags & VMM_FLAG_SHARED)
+         && vmm_sync(pagemap, vma->base, vma->length))
+            kprint(KPRN_WARN, "vmm: Writeback of %X-%X failed, changes are lost",
+                   vma->base, vma->base + vma->length);
+    }
 
     spinlock_acquire(&pagemap->lock);
 
@@ -52,43 +183,97 @@ void free_address_space(struct pagemap_t *pagemap) {
                 if (pdpt[j] & 1) {
                     pd = (pt_entry_t *)((pdpt[j] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
                     for (size_t k = 0; k < PAGE_TABLE_ENTRIES; k++) {
-                        if (pd[k] & 1) {
+                        if ((pd[k] & 1) && (pd[k] & PT_FLAG_LARGE)) {
+                            size_t base = pd[k] & 0x000fffffffe00000;
+                            for (size_t l = 0; l < PAGE_TABLE_ENTRIES; l++)
+                                page_batch_release(&batch, (void *)(base + l * PAGE_SIZE));
+                        } else if (pd[k] & 1) {
                             pt = (pt_entry_t *)((pd[k] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
                             for (size_t l = 0; l < PAGE_TABLE_ENTRIES; l++) {
                                 if (pt[l] & 1)
-                                    pmm_free((void *)(pt[l] & 0xfffffffffffff000), 1);
+                                    page_batch_release(&batch,
+                                        (void *)(pt[l] & 0xfffffffffffff000));
                             }
-                            pmm_free((void *)(pd[k] & 0xfffffffffffff000), 1);
+                            page_batch_add(&batch, (void *)(pd[k] & 0xfffffffffffff000));
                         }
                     }
-                    pmm_free((void *)(pdpt[j] & 0xfffffffffffff000), 1);
+                    page_batch_add(&batch, (void *)(pdpt[j] & 0xfffffffffffff000));
                 }
             }
-            pmm_free((void *)(pagemap->pml4[i] & 0xfffffffffffff000), 1);
+            page_batch_add(&batch, (void *)(pagemap->pml4[i] & 0xfffffffffffff000));
         }
     }
 
-    pmm_free((void *)pagemap->pml4 - MEM_PHYS_OFFSET, 1);
+    page_batch_add(&batch, (void *)pagemap->pml4 - MEM_PHYS_OFFSET);
+    if (batch.count)
+        pmm_free_batch(batch.pages, batch.count);
+
+    pcid_free(pagemap->pcid);
+
+    for (struct vma_t *vma = pagemap->vmas; vma; ) {
+        struct vma_t *next = vma->next;
+        if (vma->file)
+            vm_file_unref(vma->file);
+        kfree(vma);
+        vma = next;
+    }
+
     kfree(pagemap);
 }
 
+/* Address spaces waiting to be freed, most recent first */
+static struct pagemap_t *reap_queue = NULL;
+static lock_t reap_lock = new_lock;
+static event_t reap_event = 0;
+
+/* Hand an address space which is no longer loaded anywhere over to
+ * vmm_reaper(), so that the caller does not wait for it to be freed. */
+void reap_address_space(struct pagemap_t *pagemap) {
+    spinlock_acquire(&reap_lock);
+    pagemap->reap_next = reap_queue;
+    reap_queue = pagemap;
+    spinlock_release(&reap_lock);
+
+    event_trigger(&reap_event);
+}
+
+void vmm_reaper(void *arg) {
+    (void)arg;
+
+    for (;;) {
+        event_await(&reap_event);
+
+        spinlock_acquire(&reap_lock);
+        struct pagemap_t *pagemap = reap_queue;
+        reap_queue = NULL;
+        spinlock_release(&reap_lock);
+
+        while (pagemap) {
+            struct pagemap_t *next = pagemap->reap_next;
+            free_address_space(pagemap);
+            pagemap = next;
+        }
+    }
+}
+
+/* The pages themselves are not copied: writable pages are write protected
+ * in both address spaces and marked copy-on-write, to be duplicated by
+ * vmm_handle_fault() on the first write. Shared pages stay writable. */
 struct pagemap_t *fork_address_space(struct pagemap_t *old_pagemap) {
     /* Allocate the new pagemap */
     struct pagemap_t *new_pagemap = new_address_space();
+    if (!new_pagemap)
+        return NULL;
 
     pt_entry_t *pdpt;
     pt_entry_t *pd;
     pt_entry_t *pt;
 
-    struct {
-        uint8_t data[PAGE_SIZE];
-    } *pool;
+    struct tlb_batch_t batch = new_tlb_batch(old_pagemap);
 
-    size_t pool_size = 4096;
-    pool = pmm_alloc(pool_size);
-    size_t pool_ptr = 0;
+    spinlock_acquire(&old_pagemap->lock);
 
-    /* Map and copy all used pages */
+    /* Share all used pages */
     for (size_t i = 0; i < PAGE_TABLE_ENTRIES / 2; i++) {
         if (old_pagemap->pml4[i] & 1) {
             pdpt = (pt_entry_t *)((old_pagemap->pml4[i] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
@@ -97,20 +282,26 @@ struct pagemap_t *fork_address_space(struct pagemap_t *old_pagemap) {
                     pd = (pt_entry_t *)((pdpt[j] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
                     for (size_t k = 0; k < PAGE_TABLE_ENTRIES; k++) {
                         if (pd[k] & 1) {
-                            pt = (pt_entry_t *)((pd[k] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+                            /* Large pages are shared one 4 KiB page at a time */
+                            pt = next_table(&pd[k], 2, 0, NULL);
+                            if (!pt)
+                                goto fail;
                             for (size_t l = 0; l < PAGE_TABLE_ENTRIES; l++) {
                                 if (pt[l] & 1) {
-                                    /* FIXME find a way to expand the pool instead of dying */
-                                    if (pool_ptr == pool_size)
-                                        panic("Fork memory pool exhausted", 0, 0, NULL);
-                                    size_t new_page = (size_t)&pool[pool_ptr++];
-                                    memcpy64((char *)(new_page + MEM_PHYS_OFFSET),
-                                            (char *)((pt[l] & 0xfffffffffffff000) + MEM_PHYS_OFFSET),
-                                            PAGE_SIZE);
-                                    map_page(new_pagemap,
-                                             new_page,
-                                             entries_to_virt_addr(i, j, k, l),
-                                             (pt[l] & 0xfff),0);
+                                    if ((pt[l] & 0x02) && !(pt[l] & VMM_FLAG_SHARED)) {
+                                        pt[l] = (pt[l] & ~(pt_entry_t)0x02) | VMM_FLAG_COW;
+                                        tlb_batch_add(&batch, entries_to_virt_addr(i, j, k, l));
+                                    }
+                                    pmm_page_ref((void *)(pt[l] & 0xfffffffffffff000));
+                                    if (map_page(new_pagemap,
+                                                 pt[l] & 0xfffffffffffff000,
+                                                 entries_to_virt_addr(i, j, k, l),
+                                                 (pt[l] & 0xfff), 0)) {
+                                        /* Not mapped in the child, the parent
+                                         * still holds a reference */
+                                        pmm_page_unref((void *)(pt[l] & 0xfffffffffffff000));
+                                        goto fail;
+                                    }
                                 }
                             }
                         }
@@ -120,7 +311,24 @@ struct pagemap_t *fork_address_space(struct pagemap_t *old_pagemap) {
         }
     }
 
-    pmm_free(pool + pool_ptr, pool_size - pool_ptr);
+    /* Regions not populated yet get populated separately in the child */
+    struct vma_t **new_vma = &new_pagemap->vmas;
+    for (struct vma_t *vma = old_pagemap->vmas; vma; vma = vma->next) {
+        *new_vma = kalloc(sizeof(struct vma_t));
+        if (!*new_vma)
+            goto fail;
+        **new_vma = *vma;
+        (*new_vma)->next = NULL;
+        if (vma->file)
+            locked_inc(&vma->file->refcount);
+        new_vma = &(*new_vma)->next;
+        new_pagemap->committed_pages += vma->length / PAGE_SIZE;
+    }
+
+    /* The parent's writable mappings just became read-only */
+    tlb_batch_flush(&batch);
+
+    spinlock_release(&old_pagemap->lock);
 
     /* Map kernel into higher half */
     for (size_t i = PAGE_TABLE_ENTRIES / 2; i < PAGE_TABLE_ENTRIES; i++) {
@@ -128,228 +336,1116 @@ struct pagemap_t *fork_address_space(struct pagemap_t *old_pagemap) {
     }
 
     return new_pagemap;
+
+fail:
+    tlb_batch_flush(&batch);
+    spinlock_release(&old_pagemap->lock);
+    free_address_space(new_pagemap);
+    return NULL;
+}
+
+/* Returns the entry mapping virt_addr at the given level (1: 4 KiB,
+ * 2: 2 MiB, 3: 1 GiB), splitting larger pages on the way.
+ * Call with the pagemap lock held. */
+static pt_entry_t *walk_to_entry(struct pagemap_t *pagemap, size_t virt_addr,
+                                 int level, int create, struct table_pool_t *pool) {
+    pt_entry_t *table = pagemap->pml4;
+
+    for (int i = 4; i > level; i--) {
+        table = next_table(&table[table_index(virt_addr, i)], i, create, pool);
+        if (!table)
+            return NULL;
+    }
+
+    return &table[table_index(virt_addr, level)];
+}
+
+/* Unlink the page tables around virt_addr which no longer map anything,
+ * storing them in freed[] (up to 3) to be released once the TLBs dropped
+ * them. The PDPTs of the higher half are shared by all address spaces and
+ * are never freed. Returns the number of tables unlinked.
+ * Call with the pagemap lock held. */
+static int unlink_empty_tables(struct pagemap_t *pagemap, size_t virt_addr, void **freed) {
+    pt_entry_t *entries[5];
+    pt_entry_t *table = pagemap->pml4;
+
+    for (int i = 4; i > 1; i--) {
+        entries[i] = &table[table_index(virt_addr, i)];
+        if (!(*entries[i] & 0x1) || (i < 4 && (*entries[i] & PT_FLAG_LARGE)))
+            return 0;
+        table = (pt_entry_t *)((*entries[i] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+    }
+
+    int count = 0;
+    int top = table_index(virt_addr, 4) < PAGE_TABLE_ENTRIES / 2 ? 4 : 3;
+
+    for (int i = 2; i <= top; i++) {
+        table = (pt_entry_t *)((*entries[i] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+        for (size_t j = 0; j < PAGE_TABLE_ENTRIES; j++) {
+            if (table[j] & 0x1) {
+                /* Table is not free */
+                return count;
+            }
+        }
+        *entries[i] = 0;
+        freed[count++] = (void *)table - MEM_PHYS_OFFSET;
+    }
+
+    return count;
+}
+
+/* map physaddr -> virtaddr using pml4 pointer, with the pagemap lock held */
+/* Returns 0 on success, -1 on failure */
+static int __map_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr, size_t flags) {
+    pt_entry_t *pte = walk_to_entry(pagemap, virt_addr, 1, 1, NULL);
+    if (!pte)
+        return -1;
+
+    int was_present = *pte & 0x1;
+
+    if (!was_present && pagemap != kernel_pagemap)
+        pagemap->resident_pages++;
+
+    /* Set the entry as present and point it to the passed physical address */
+    /* Also set the specified flags */
+    *pte = (pt_entry_t)(phys_addr | flags);
+
+    /* Not present entries are never cached */
+    if (was_present)
+        tlb_shootdown(pagemap, virt_addr, 1);
+
+    return 0;
 }
 
 /* map physaddr -> virtaddr using pml4 pointer */
 /* Returns 0 on success, -1 on failure */
 int map_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr, size_t flags, int a) {
-    spinlock_acquire(&pagemap->lock);
+    if (a & VMM_ATTR_SHARED)
+        flags |= VMM_FLAG_SHARED;
 
-    /* Calculate the indices in the various tables using the virtual address */
-    size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
-    size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
-    size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
-    size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
+    spinlock_acquire(&pagemap->lock);
+    int ret = __map_page(pagemap, phys_addr, virt_addr, flags);
+    spinlock_release(&pagemap->lock);
+    return ret;
+}
 
-    pt_entry_t *pdpt, *pd, *pt;
+int unmap_page(struct pagemap_t *pagemap, size_t virt_addr) {
+    spinlock_acquire(&pagemap->lock);
 
-    /* Check present flag */
-    if (pagemap->pml4[pml4_entry] & 0x1) {
-        /* Reference pdpt */
-        pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        /* Allocate a page for the pdpt. */
-        pdpt = (pt_entry_t *)((size_t)pmm_allocz(1) + MEM_PHYS_OFFSET);
-        /* Catch allocation failure */
-        if ((size_t)pdpt == MEM_PHYS_OFFSET)
-            goto fail1;
-        /* Present + writable + user (0b111) */
-        pagemap->pml4[pml4_entry] = (pt_entry_t)((size_t)pdpt - MEM_PHYS_OFFSET) | 0b111;
+    /* We cannot unmap a virtual address if we don't know what it's mapped
+     * to in the first place. A large page around it is split. */
+    pt_entry_t *pte = walk_to_entry(pagemap, virt_addr, 1, 0, NULL);
+    if (!pte) {
+        spinlock_release(&pagemap->lock);
+        return -1;
     }
 
-    /* Rinse and repeat */
-    if (pdpt[pdpt_entry] & 0x1) {
-        pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        /* Allocate a page for the pd. */
-        pd = (pt_entry_t *)((size_t)pmm_allocz(1) + MEM_PHYS_OFFSET);
-        /* Catch allocation failure */
-        if ((size_t)pdpt == MEM_PHYS_OFFSET)
-            goto fail2;
-        /* Present + writable + user (0b111) */
-        pdpt[pdpt_entry] = (pt_entry_t)((size_t)pd - MEM_PHYS_OFFSET) | 0b111;
-    }
+    int was_present = *pte & 0x1;
 
-    /* Once more */
-    if (pd[pd_entry] & 0x1) {
-        pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        /* Allocate a page for the pt. */
-        pt = (pt_entry_t *)((size_t)pmm_allocz(1) + MEM_PHYS_OFFSET);
-        /* Catch allocation failure */
-        if ((size_t)pdpt == MEM_PHYS_OFFSET)
-            goto fail3;
-        /* Present + writable + user (0b111) */
-        pd[pd_entry] = (pt_entry_t)((size_t)pt - MEM_PHYS_OFFSET) | 0b111;
+    if (was_present && pagemap != kernel_pagemap)
+        pagemap->resident_pages--;
+
+    /* Unmap entry */
+    *pte = 0;
+
+    /* Unlinked tables may still be cached as well */
+    void *freed[3];
+    int freed_count = unlink_empty_tables(pagemap, virt_addr, freed);
+    if (freed_count || was_present)
+        tlb_shootdown(pagemap, virt_addr, 1);
+    for (int i = 0; i < freed_count; i++)
+        pmm_free(freed[i], 1);
+
+    spinlock_release(&pagemap->lock);
+    return 0;
+}
+
+/* Update flags for a mapping */
+int remap_page(struct pagemap_t *pagemap, size_t virt_addr, size_t flags) {
+    spinlock_acquire(&pagemap->lock);
+
+    pt_entry_t *pte = walk_to_entry(pagemap, virt_addr, 1, 0, NULL);
+    if (!pte) {
+        spinlock_release(&pagemap->lock);
+        return -1;
     }
 
-    /* Set the entry as present and point it to the passed physical address */
-    /* Also set the specified flags */
-    pt[pt_entry] = (pt_entry_t)(phys_addr | flags);
+    /* Update flags */
+    *pte = (*pte & 0xfffffffffffff000) | flags;
+
+    tlb_shootdown(pagemap, virt_addr, 1);
+
+    spinlock_release(&pagemap->lock);
+    return 0;
+}
+
+/* Map a LARGE_PAGE_SIZE or HUGE_PAGE_SIZE page, with the pagemap lock held.
+ * Both addresses must be aligned to size. flags are the same as for a 4 KiB
+ * page, the PAT bit is moved where large pages keep it.
+ * Fails if smaller pages are mapped inside the range. */
+static int __map_large_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr,
+                            size_t flags, size_t size) {
+    int level = size == HUGE_PAGE_SIZE ? 3 : 2;
+
+    pt_entry_t *entry = walk_to_entry(pagemap, virt_addr, level, 1, NULL);
+    if (!entry)
+        return -1;
+
+    if ((*entry & 0x1) && !(*entry & PT_FLAG_LARGE))
+        return -1;
+
+    int was_present = *entry & 0x1;
+
+    if (!was_present && pagemap != kernel_pagemap)
+        pagemap->resident_pages += size / PAGE_SIZE;
+
+    if (flags & PT_FLAG_LARGE)
+        flags = (flags & ~PT_FLAG_LARGE) | PT_FLAG_LARGE_PAT;
+
+    *entry = (pt_entry_t)(phys_addr | flags | PT_FLAG_LARGE);
+
+    /* A single invlpg drops a large page whatever its size */
+    if (was_present)
+        tlb_shootdown(pagemap, virt_addr, 1);
 
-    if ((size_t)pagemap->pml4 == read_cr3()) {
-        // TODO: TLB shootdown
-        invlpg(virt_addr);
+    return 0;
+}
+
+int map_large_page(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr,
+                   size_t flags, size_t size) {
+    spinlock_acquire(&pagemap->lock);
+    int ret = __map_large_page(pagemap, phys_addr, virt_addr, flags, size);
+    spinlock_release(&pagemap->lock);
+    return ret;
+}
+
+/* Unmap a page mapped with map_large_page(). A 2 MiB page can be unmapped
+ * out of a 1 GiB one, which gets split. */
+int unmap_large_page(struct pagemap_t *pagemap, size_t virt_addr, size_t size) {
+    int level = size == HUGE_PAGE_SIZE ? 3 : 2;
+
+    spinlock_acquire(&pagemap->lock);
+
+    pt_entry_t *entry = walk_to_entry(pagemap, virt_addr, level, 0, NULL);
+    if (!entry || !(*entry & 0x1) || !(*entry & PT_FLAG_LARGE)) {
+        spinlock_release(&pagemap->lock);
+        return -1;
     }
 
+    if (pagemap != kernel_pagemap)
+        pagemap->resident_pages -= size / PAGE_SIZE;
+
+    *entry = 0;
+
+    void *freed[3];
+    int freed_count = unlink_empty_tables(pagemap, virt_addr, freed);
+    tlb_shootdown(pagemap, virt_addr, 1);
+    for (int i = 0; i < freed_count; i++)
+        pmm_free(freed[i], 1);
+
     spinlock_release(&pagemap->lock);
     return 0;
+}
 
-    /* Free previous levels if empty */
-fail3:
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pd - MEM_PHYS_OFFSET, 1);
-            break;
+/* Number of page tables map_range() is going to allocate for
+ * [virt_addr, top), large pages to split included */
+static size_t count_missing_tables(struct pagemap_t *pagemap, size_t virt_addr, size_t top) {
+    size_t count = 0;
+    size_t last_pdpt = (size_t)-1;
+    size_t last_pd = (size_t)-1;
+
+    for (size_t addr = virt_addr & ~(LARGE_PAGE_SIZE - 1); addr < top; addr += LARGE_PAGE_SIZE) {
+        pt_entry_t entry = pagemap->pml4[table_index(addr, 4)];
+        if (!(entry & 0x1)) {
+            if (addr >> 39 != last_pdpt) {
+                last_pdpt = addr >> 39;
+                count++;
+            }
+            goto no_pd;
         }
-        if (pd[i] & 0x1) {
-            /* Table is not free */
-            goto fail1;
+        pt_entry_t *pdpt = (pt_entry_t *)((entry & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+
+        entry = pdpt[table_index(addr, 3)];
+        if (!(entry & 0x1) || (entry & PT_FLAG_LARGE))
+            goto no_pd;
+        pt_entry_t *pd = (pt_entry_t *)((entry & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+
+        entry = pd[table_index(addr, 2)];
+        if (!(entry & 0x1) || (entry & PT_FLAG_LARGE))
+            count++;
+        continue;
+
+    no_pd:
+        if (addr >> 30 != last_pd) {
+            last_pd = addr >> 30;
+            count++;
         }
+        count++;
+    }
+
+    return count;
+}
+
+/* Map count pages from phys_addr onwards at virt_addr. The pagemap lock is
+ * taken once, each table is walked to once per 512 entries, and missing
+ * tables are allocated in one go. Returns 0 on success, -1 on failure. */
+int map_range(struct pagemap_t *pagemap, size_t phys_addr, size_t virt_addr,
+              size_t count, size_t flags) {
+    struct tlb_batch_t batch = new_tlb_batch(pagemap);
+    struct table_pool_t pool = {0};
+    size_t top = virt_addr + count * PAGE_SIZE;
+    int ret = 0;
+
+    spinlock_acquire(&pagemap->lock);
+
+    size_t tables = count_missing_tables(pagemap, virt_addr, top);
+    if (tables) {
+        pool.next = (size_t)pmm_allocz(tables);
+        if (pool.next)
+            pool.count = tables;
     }
 
-fail2:
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pdpt - MEM_PHYS_OFFSET, 1);
+    for (size_t virt = virt_addr; virt < top; ) {
+        pt_entry_t *pte = walk_to_entry(pagemap, virt, 1, 1, &pool);
+        if (!pte) {
+            ret = -1;
             break;
         }
-        if (pdpt[i] & 0x1) {
-            /* Table is not free */
-            goto fail1;
+
+        size_t n = PAGE_TABLE_ENTRIES - table_index(virt, 1);
+        if (n > (top - virt) / PAGE_SIZE)
+            n = (top - virt) / PAGE_SIZE;
+
+        for (size_t i = 0; i < n; i++, virt += PAGE_SIZE) {
+            if (pte[i] & 0x1)
+                tlb_batch_add(&batch, virt);
+            else if (pagemap != kernel_pagemap)
+                pagemap->resident_pages++;
+            pte[i] = (pt_entry_t)((phys_addr + (virt - virt_addr)) | flags);
         }
     }
 
-fail1:
+    /* Not present entries are never cached, only remapped ones need this */
+    tlb_batch_flush(&batch);
+
     spinlock_release(&pagemap->lock);
-    return -1;
+
+    if (pool.count)
+        pmm_free((void *)pool.next, pool.count);
+
+    return ret;
 }
 
-int unmap_page(struct pagemap_t *pagemap, size_t virt_addr) {
+/* Number of page tables splitting the large pages in [virt_addr, top)
+ * down to 4 KiB pages takes */
+static size_t count_split_tables(struct pagemap_t *pagemap, size_t virt_addr, size_t top) {
+    size_t count = 0;
+    size_t last_pd = (size_t)-1;
+
+    for (size_t addr = virt_addr & ~(LARGE_PAGE_SIZE - 1); addr < top; addr += LARGE_PAGE_SIZE) {
+        pt_entry_t entry = pagemap->pml4[table_index(addr, 4)];
+        if (!(entry & 0x1))
+            continue;
+        pt_entry_t *pdpt = (pt_entry_t *)((entry & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+
+        entry = pdpt[table_index(addr, 3)];
+        if (!(entry & 0x1))
+            continue;
+        if (entry & PT_FLAG_LARGE) {
+            if (addr >> 30 != last_pd) {
+                last_pd = addr >> 30;
+                count++;
+            }
+            count++;
+            continue;
+        }
+        pt_entry_t *pd = (pt_entry_t *)((entry & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
+
+        entry = pd[table_index(addr, 2)];
+        if ((entry & 0x1) && (entry & PT_FLAG_LARGE))
+            count++;
+    }
+
+    return count;
+}
+
+/* Allocate the tables for splitting the large pages in [virt_addr, top)
+ * up front, so that a walk of the range cannot fail halfway through.
+ * Returns -1 if out of memory. Call with the pagemap lock held. */
+static int alloc_split_tables(struct pagemap_t *pagemap, size_t virt_addr, size_t top,
+                              struct table_pool_t *pool) {
+    size_t tables = count_split_tables(pagemap, virt_addr, top);
+
+    pool->next = 0;
+    pool->count = 0;
+    if (!tables)
+        return 0;
+
+    pool->next = (size_t)pmm_allocz(tables);
+    if (!pool->next)
+        return -1;
+    pool->count = tables;
+    return 0;
+}
+
+/* Unmap count pages from virt_addr onwards, skipping holes, with the
+ * split tables allocated. Returns the tables left empty and, if release
+ * is set, the pages whose last mapping this was, linked through their
+ * first word, to be freed once the pagemap lock is dropped.
+ * Call with the pagemap lock held. */
+static size_t __unmap_pages(struct pagemap_t *pagemap, size_t virt_addr, size_t count,
+                            int release, struct table_pool_t *pool) {
+    struct tlb_batch_t batch = new_tlb_batch(pagemap);
+    size_t top = virt_addr + count * PAGE_SIZE;
+    size_t freed_list = 0;
+
+    for (size_t virt = virt_addr; virt < top; ) {
+        size_t span_top = (virt & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE;
+        if (span_top > top)
+            span_top = top;
+
+        /* Large pages are split from the pool, so NULL is a hole */
+        pt_entry_t *pte = walk_to_entry(pagemap, virt, 1, 0, pool);
+        if (!pte) {
+            virt = span_top;
+            continue;
+        }
+
+        size_t span_base = virt;
+        for (; virt < span_top; virt += PAGE_SIZE, pte++) {
+            if (!(*pte & 0x1))
+                continue;
+            if (pagemap != kernel_pagemap)
+                pagemap->resident_pages--;
+            size_t page = *pte & 0xfffffffffffff000;
+            *pte = 0;
+            tlb_batch_add(&batch, virt);
+            if (release && !pmm_page_unref((void *)page)) {
+                *(size_t *)(page + MEM_PHYS_OFFSET) = freed_list;
+                freed_list = page;
+            }
+        }
+
+        void *freed[3];
+        int freed_count = unlink_empty_tables(pagemap, span_base, freed);
+        for (int i = 0; i < freed_count; i++) {
+            *(size_t *)((size_t)freed[i] + MEM_PHYS_OFFSET) = freed_list;
+            freed_list = (size_t)freed[i];
+            tlb_batch_add(&batch, span_base);
+        }
+    }
+
+    tlb_batch_flush(&batch);
+
+    return freed_list;
+}
+
+static void free_page_list(size_t freed_list) {
+    while (freed_list) {
+        size_t next = *(size_t *)(freed_list + MEM_PHYS_OFFSET);
+        pmm_free((void *)freed_list, 1);
+        freed_list = next;
+    }
+}
+
+/* Unmap count pages from virt_addr onwards, skipping holes. Tables left
+ * empty are freed once no TLB can reference them anymore, and so are the
+ * pages themselves if release is set and this was their last mapping.
+ * Returns -1 and leaves the range alone if large pages in it cannot be
+ * split for lack of memory. */
+static int unmap_pages(struct pagemap_t *pagemap, size_t virt_addr, size_t count,
+                       int release) {
+    struct table_pool_t pool;
+
     spinlock_acquire(&pagemap->lock);
 
-    /* Calculate the indices in the various tables using the virtual address */
-    size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
-    size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
-    size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
-    size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
+    if (alloc_split_tables(pagemap, virt_addr, virt_addr + count * PAGE_SIZE, &pool)) {
+        spinlock_release(&pagemap->lock);
+        errno = ENOMEM;
+        return -1;
+    }
 
-    pt_entry_t *pdpt, *pd, *pt;
+    size_t freed_list = __unmap_pages(pagemap, virt_addr, count, release, &pool);
 
-    /* Get reference to the various tables in sequence. Return -1 if one of the tables is not present,
-     * since we cannot unmap a virtual address if we don't know what it's mapped to in the first place */
-    if (pagemap->pml4[pml4_entry] & 0x1) {
-        pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
+    spinlock_release(&pagemap->lock);
+
+    if (pool.count)
+        pmm_free((void *)pool.next, pool.count);
+    free_page_list(freed_list);
+
+    return 0;
+}
+
+int unmap_range(struct pagemap_t *pagemap, size_t virt_addr, size_t count) {
+    return unmap_pages(pagemap, virt_addr, count, 0);
+}
+
+/* Update the flags of the pages mapped in count pages from virt_addr on.
+ * Returns -1 and leaves the range alone if large pages in it cannot be
+ * split for lack of memory. */
+int protect_range(struct pagemap_t *pagemap, size_t virt_addr, size_t count, size_t flags) {
+    struct tlb_batch_t batch = new_tlb_batch(pagemap);
+    struct table_pool_t pool;
+    size_t top = virt_addr + count * PAGE_SIZE;
+
+    spinlock_acquire(&pagemap->lock);
+
+    if (alloc_split_tables(pagemap, virt_addr, top, &pool)) {
+        spinlock_release(&pagemap->lock);
+        errno = ENOMEM;
+        return -1;
     }
 
-    if (pdpt[pdpt_entry] & 0x1) {
-        pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
+    for (size_t virt = virt_addr; virt < top; ) {
+        size_t span_top = (virt & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE;
+        if (span_top > top)
+            span_top = top;
+
+        /* Large pages are split from the pool, so NULL is a hole */
+        pt_entry_t *pte = walk_to_entry(pagemap, virt, 1, 0, &pool);
+        if (!pte) {
+            virt = span_top;
+            continue;
+        }
+
+        for (; virt < span_top; virt += PAGE_SIZE, pte++) {
+            if (!(*pte & 0x1))
+                continue;
+            *pte = (*pte & 0xfffffffffffff000) | flags;
+            tlb_batch_add(&batch, virt);
+        }
     }
 
-    if (pd[pd_entry] & 0x1) {
-        pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
+    tlb_batch_flush(&batch);
+
+    spinlock_release(&pagemap->lock);
+
+    if (pool.count)
+        pmm_free((void *)pool.next, pool.count);
+
+    return 0;
+}
+
+/* Returns the entry mapping virt_addr, which is a PDPT or PD entry if it
+ * lies in a large page, or NULL if one of the tables on the way is not
+ * present. Call with the pagemap lock held. */
+static pt_entry_t *virt_to_pte(struct pagemap_t *pagemap, size_t virt_addr) {
+    pt_entry_t *table = pagemap->pml4;
+
+    for (int i = 4; i > 1; i--) {
+        pt_entry_t *entry = &table[table_index(virt_addr, i)];
+        if (!(*entry & 0x1))
+            return NULL;
+        if (i < 4 && (*entry & PT_FLAG_LARGE))
+            return entry;
+        table = (pt_entry_t *)((*entry & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
     }
 
-    /* Unmap entry */
-    pt[pt_entry] = 0;
+    return &table[table_index(virt_addr, 1)];
+}
 
-    if ((size_t)pagemap->pml4 == read_cr3()) {
-        // TODO: TLB shootdown
-        invlpg(virt_addr);
+/* Regular files currently backing some region, protected by vm_files_lock */
+static struct vm_file_t *vm_files = NULL;
+static lock_t vm_files_lock = new_lock;
+
+static int vm_file_io_lock(struct vm_file_t *file) {
+    while (locked_write(int, &file->io_busy, 1)) {
+        if (event_await(&file->io_event)) {
+            errno = EINTR;
+            return -1;
+        }
     }
+    return 0;
+}
 
-    /* Free previous levels if empty */
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pt - MEM_PHYS_OFFSET, 1);
-            break;
+static void vm_file_io_unlock(struct vm_file_t *file) {
+    locked_write(int, &file->io_busy, 0);
+    event_trigger(&file->io_event);
+}
+
+/* Make an existing object writable, for a shared writable mapping */
+static int vm_file_make_writable(struct vm_file_t *file, int fd) {
+    if (locked_read(int, &file->writable))
+        return 0;
+
+    int new_fd = reopen(fd, O_RDWR);
+    if (new_fd == -1)
+        return -1;
+
+    if (vm_file_io_lock(file)) {
+        close(new_fd);
+        return -1;
+    }
+    if (file->writable) {
+        vm_file_io_unlock(file);
+        close(new_fd);
+        return 0;
+    }
+    int old_fd = file->fd;
+    file->fd = new_fd;
+    locked_write(int, &file->writable, 1);
+    vm_file_io_unlock(file);
+
+    close(old_fd);
+    return 0;
+}
+
+/* Wrap an open file descriptor so that memory regions can share it. The
+ * file is opened again, the caller keeps its descriptor and its offset.
+ * writable asks for a descriptor that shared pages can be written back
+ * through. A regular file which already backs a region gets the existing
+ * object, with its page cache. */
+struct vm_file_t *vm_file_new(int fd, int writable) {
+    struct stat st;
+    int cached = !fstat(fd, &st) && S_ISREG(st.st_mode);
+
+    if (cached) {
+        spinlock_acquire(&vm_files_lock);
+        for (struct vm_file_t *file = vm_files; file; file = file->next) {
+            if (file->dev == st.st_dev && file->ino == st.st_ino) {
+                locked_inc(&file->refcount);
+                spinlock_release(&vm_files_lock);
+                if (writable && vm_file_make_writable(file, fd)) {
+                    vm_file_unref(file);
+                    return NULL;
+                }
+                return file;
+            }
         }
-        if (pt[i] & 0x1) {
-            /* Table is not free */
-            goto out;
+        spinlock_release(&vm_files_lock);
+    }
+
+    struct vm_file_t *file = kalloc(sizeof(struct vm_file_t));
+    if (!file) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    file->fd = reopen(fd, writable ? O_RDWR : O_RDONLY);
+    if (file->fd == -1) {
+        kfree(file);
+        return NULL;
+    }
+    file->writable = writable;
+    file->refcount = 1;
+    file->cache_lock = new_lock;
+
+    if (!cached)
+        return file;
+
+    file->cached = 1;
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+
+    spinlock_acquire(&vm_files_lock);
+    /* Somebody may have raced us to it */
+    for (struct vm_file_t *cur = vm_files; cur; cur = cur->next) {
+        if (cur->dev == file->dev && cur->ino == file->ino) {
+            locked_inc(&cur->refcount);
+            spinlock_release(&vm_files_lock);
+            close(file->fd);
+            kfree(file);
+            if (writable && vm_file_make_writable(cur, fd)) {
+                vm_file_unref(cur);
+                return NULL;
+            }
+            return cur;
         }
     }
+    file->next = vm_files;
+    vm_files = file;
+    spinlock_release(&vm_files_lock);
 
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pd - MEM_PHYS_OFFSET, 1);
-            break;
+    return file;
+}
+
+void vm_file_unref(struct vm_file_t *file) {
+    if (!file->cached) {
+        if (locked_dec(&file->refcount))
+            return;
+    } else {
+        /* Dropping the last reference and unlinking must be atomic with
+         * respect to vm_file_new() finding the file */
+        spinlock_acquire(&vm_files_lock);
+        if (locked_dec(&file->refcount)) {
+            spinlock_release(&vm_files_lock);
+            return;
+        }
+        for (struct vm_file_t **prev = &vm_files; *prev; prev = &(*prev)->next) {
+            if (*prev == file) {
+                *prev = file->next;
+                break;
+            }
         }
-        if (pd[i] & 0x1) {
-            /* Table is not free */
-            goto out;
+        spinlock_release(&vm_files_lock);
+
+        /* Pages still mapped somewhere hold their own reference */
+        for (size_t i = 0; i < file->cache_len; i++) {
+            void *page = (void *)file->cache[i];
+            if (page && !pmm_page_unref(page))
+                pmm_free(page, 1);
         }
+        kfree(file->cache);
+    }
+
+    close(file->fd);
+    kfree(file);
+}
+
+/* Read len bytes at offset from a backing file, zero-filling past EOF */
+static int vm_file_read(struct vm_file_t *file, void *buf, size_t offset, size_t len) {
+    if (vm_file_io_lock(file))
+        return -1;
+
+    int ret = lseek(file->fd, offset, SEEK_SET);
+    if (ret != -1)
+        ret = read(file->fd, buf, len);
+
+    vm_file_io_unlock(file);
+
+    if (ret == -1)
+        return -1;
+
+    memset(buf + ret, 0, len - ret);
+    return 0;
+}
+
+/* Write up to len bytes at offset back to a file. Mappings never extend
+ * a file, whatever lies past EOF is dropped. */
+static int vm_file_write(struct vm_file_t *file, const void *buf, size_t offset, size_t len) {
+    struct stat st;
+
+    if (vm_file_io_lock(file))
+        return -1;
+
+    int ret = -1;
+    if (!file->writable) {
+        errno = EBADF;
+        goto out;
     }
 
-    for (size_t i = 0; ; i++) {
-        if (i == PAGE_TABLE_ENTRIES) {
-            /* We reached the end, table is free */
-            pmm_free((void *)pdpt - MEM_PHYS_OFFSET, 1);
+    ret = fstat(file->fd, &st);
+    if (ret == -1 || offset >= (size_t)st.st_size)
+        goto out;
+    if (len > (size_t)st.st_size - offset)
+        len = (size_t)st.st_size - offset;
+
+    ret = lseek(file->fd, offset, SEEK_SET);
+    if (ret != -1)
+        ret = write(file->fd, buf, len) == (int)len ? 0 : -1;
+
+out:
+    vm_file_io_unlock(file);
+    return ret == -1 ? -1 : 0;
+}
+
+/* Cached page holding the index'th page of a file, 0 if not read in.
+ * Call with the cache lock held. */
+static inline size_t vm_file_cache_get(struct vm_file_t *file, size_t index) {
+    return index < file->cache_len ? file->cache[index] : 0;
+}
+
+/* Hand a freshly read page over to the cache. Returns the page which ends
+ * up cached, which is a different one if the page was read in meanwhile,
+ * or 0 if the cache could not grow and the page is still the caller's.
+ * Call with the cache lock held. */
+static size_t vm_file_cache_put(struct vm_file_t *file, size_t index, size_t page) {
+    if (index >= file->cache_len) {
+        size_t new_len = (index + PAGE_TABLE_ENTRIES) & ~(size_t)(PAGE_TABLE_ENTRIES - 1);
+        size_t *new_cache = krealloc(file->cache, new_len * sizeof(size_t));
+        if (!new_cache)
+            return 0;
+        file->cache = new_cache;
+        file->cache_len = new_len;
+    }
+
+    if (file->cache[index]) {
+        pmm_free((void *)page, 1);
+        return file->cache[index];
+    }
+
+    file->cache[index] = page;
+    return page;
+}
+
+static struct vma_t *find_vma(struct pagemap_t *pagemap, size_t virt_addr) {
+    for (struct vma_t *vma = pagemap->vmas; vma; vma = vma->next) {
+        if (vma->base > virt_addr)
             break;
+        if (virt_addr < vma->base + vma->length)
+            return vma;
+    }
+    return NULL;
+}
+
+/* Drop the parts of existing regions inside [base, base + length).
+ * Call with the pagemap lock held. */
+static int remove_vmas(struct pagemap_t *pagemap, size_t base, size_t length) {
+    size_t top = base + length;
+
+    for (struct vma_t **prev = &pagemap->vmas; *prev; ) {
+        struct vma_t *vma = *prev;
+        size_t vma_top = vma->base + vma->length;
+
+        if (vma_top <= base || vma->base >= top) {
+            prev = &vma->next;
+            continue;
+        }
+
+        if (vma->base < base && vma_top > top) {
+            /* Punch a hole: split off the upper part */
+            struct vma_t *upper = kalloc(sizeof(struct vma_t));
+            if (!upper)
+                return -1;
+            *upper = *vma;
+            upper->base = top;
+            upper->length = vma_top - top;
+            upper->file_offset += top - vma->base;
+            upper->file_size = vma->file_size > top - vma->base
+                             ? vma->file_size - (top - vma->base) : 0;
+            if (upper->file)
+                locked_inc(&upper->file->refcount);
+            vma->length = base - vma->base;
+            vma->next = upper;
+            pagemap->committed_pages -= length / PAGE_SIZE;
+            return 0;
+        }
+
+        if (vma->base < base) {
+            /* Trim the tail */
+            pagemap->committed_pages -= (vma_top - base) / PAGE_SIZE;
+            vma->length = base - vma->base;
+            prev = &vma->next;
+            continue;
         }
-        if (pdpt[i] & 0x1) {
-            /* Table is not free */
-            goto out;
+
+        if (vma_top > top) {
+            /* Trim the head */
+            size_t cut = top - vma->base;
+            pagemap->committed_pages -= cut / PAGE_SIZE;
+            vma->base = top;
+            vma->length -= cut;
+            vma->file_offset += cut;
+            vma->file_size = vma->file_size > cut ? vma->file_size - cut : 0;
+            prev = &vma->next;
+            continue;
         }
+
+        /* Fully covered */
+        pagemap->committed_pages -= vma->length / PAGE_SIZE;
+        *prev = vma->next;
+        if (vma->file)
+            vm_file_unref(vma->file);
+        kfree(vma);
     }
 
-out:
+    return 0;
+}
+
+/* Register a region to be populated on demand, replacing whatever region
+ * was there before. file may be NULL for zero-filled memory; otherwise a
+ * reference to it is taken. Returns 0 on success, -1 on failure. */
+int vmm_add_vma(struct pagemap_t *pagemap, size_t base, size_t length, size_t flags,
+                struct vm_file_t *file, size_t file_offset, size_t file_size) {
+    struct vma_t *new_vma = kalloc(sizeof(struct vma_t));
+    if (!new_vma)
+        return -1;
+
+    new_vma->base = base;
+    new_vma->length = length;
+    new_vma->flags = flags;
+    new_vma->file = file;
+    new_vma->file_offset = file_offset;
+    new_vma->file_size = file ? file_size : 0;
+
+    spinlock_acquire(&pagemap->lock);
+
+    if (remove_vmas(pagemap, base, length)) {
+        spinlock_release(&pagemap->lock);
+        kfree(new_vma);
+        return -1;
+    }
+
+    struct vma_t **prev = &pagemap->vmas;
+    while (*prev && (*prev)->base < base)
+        prev = &(*prev)->next;
+    new_vma->next = *prev;
+    *prev = new_vma;
+    pagemap->committed_pages += length / PAGE_SIZE;
+
+    if (file)
+        locked_inc(&file->refcount);
+
     spinlock_release(&pagemap->lock);
     return 0;
+}
 
-fail:
+/* Flags to map a page of the file cache with in a region. Private
+ * mappings must never write to it, they get a copy on the first write. */
+static inline size_t cached_page_flags(struct vma_t *vma) {
+    if (!(vma->flags & VMM_FLAG_SHARED) && (vma->flags & 0x02))
+        return (vma->flags & ~(size_t)0x02) | VMM_FLAG_COW;
+    return vma->flags;
+}
+
+/* Whether the page at rel into a file backed region can come straight from
+ * the file cache, that is it holds file data only */
+static inline int vma_page_cached(struct vma_t *vma, size_t rel) {
+    return vma->file->cached && !(vma->file_offset & (PAGE_SIZE - 1))
+        && rel + PAGE_SIZE <= vma->file_size;
+}
+
+/* Map a page of the file cache, reading it and its neighbours in first if
+ * needed. Called with the pagemap lock held, which is dropped around file
+ * I/O. */
+static int vma_fault_cached(struct pagemap_t *pagemap, struct vma_t *vma, size_t page) {
+    struct vm_file_t *file = vma->file;
+    size_t rel = page - vma->base;
+
+    spinlock_acquire(&file->cache_lock);
+    size_t phys = vm_file_cache_get(file, (vma->file_offset + rel) / PAGE_SIZE);
+    if (phys)
+        pmm_page_ref((void *)phys);
+    spinlock_release(&file->cache_lock);
+
+    if (phys) {
+        if (__map_page(pagemap, phys, page, cached_page_flags(vma))) {
+            pmm_page_unref((void *)phys);
+            return -1;
+        }
+        return 0;
+    }
+
+    /* Read around the faulting page, within the cacheable part */
+    size_t file_pages = vma->file_size / PAGE_SIZE;
+    size_t first = rel / PAGE_SIZE;
+    first = first > VMM_READAROUND_PAGES / 2 ? first - VMM_READAROUND_PAGES / 2 : 0;
+    size_t count = file_pages - first;
+    if (count > VMM_READAROUND_PAGES)
+        count = VMM_READAROUND_PAGES;
+
+    size_t window = vma->base + first * PAGE_SIZE;
+    size_t offset = vma->file_offset + first * PAGE_SIZE;
+
+    void *pages = pmm_alloc(count);
+    if (!pages)
+        return -1;
+
+    locked_inc(&file->refcount);
     spinlock_release(&pagemap->lock);
-    return -1;
+
+    int ret = vm_file_read(file, (void *)((size_t)pages + MEM_PHYS_OFFSET),
+                           offset, count * PAGE_SIZE);
+
+    /* Each page read is either cached or freed, the ones which end up in
+     * the cache are referenced here until mapped */
+    size_t cached[VMM_READAROUND_PAGES];
+    spinlock_acquire(&file->cache_lock);
+    for (size_t i = 0; i < count; i++) {
+        size_t phys = (size_t)pages + i * PAGE_SIZE;
+        cached[i] = ret ? 0 : vm_file_cache_put(file, offset / PAGE_SIZE + i, phys);
+        if (cached[i])
+            pmm_page_ref((void *)cached[i]);
+        else
+            pmm_free((void *)phys, 1);
+    }
+    spinlock_release(&file->cache_lock);
+
+    spinlock_acquire(&pagemap->lock);
+
+    /* The region may have changed while the lock was dropped, only map
+     * pages which are still covered by the same file at the same place */
+    for (size_t i = 0; i < count; i++) {
+        if (!cached[i])
+            continue;
+
+        size_t virt = window + i * PAGE_SIZE;
+        struct vma_t *cur = find_vma(pagemap, virt);
+        pt_entry_t *pte = virt_to_pte(pagemap, virt);
+
+        if (!cur || cur->file != file
+         || cur->file_offset + (virt - cur->base) != offset + i * PAGE_SIZE
+         || (pte && (*pte & 1))
+         || __map_page(pagemap, cached[i], virt, cached_page_flags(cur))) {
+            if (!pmm_page_unref((void *)cached[i]))
+                pmm_free((void *)cached[i], 1);
+        }
+    }
+
+    vm_file_unref(file);
+    return ret;
 }
 
-/* Update flags for a mapping */
-int remap_page(struct pagemap_t *pagemap, size_t virt_addr, size_t flags) {
+/* Populate a not present page of a region. Called with the pagemap lock
+ * held, which is dropped around file I/O. */
+static int vma_fault(struct pagemap_t *pagemap, struct vma_t *vma, size_t virt_addr) {
+    size_t page = virt_addr & ~(PAGE_SIZE - 1);
+    size_t rel = page - vma->base;
+
+    if (vma->file && vma_page_cached(vma, rel))
+        return vma_fault_cached(pagemap, vma, page);
+
+    if (rel >= vma->file_size) {
+        /* Past the end of the file data, a fresh zeroed page will do */
+        void *new_page = pmm_allocz(1);
+        if (!new_page)
+            return -1;
+        if (__map_page(pagemap, (size_t)new_page, page, vma->flags)) {
+            pmm_free(new_page, 1);
+            return -1;
+        }
+        return 0;
+    }
+
+    /* Read around the faulting page, within the file backed part */
+    size_t file_pages = (vma->file_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t first = rel / PAGE_SIZE;
+    first = first > VMM_READAROUND_PAGES / 2 ? first - VMM_READAROUND_PAGES / 2 : 0;
+    size_t count = file_pages - first;
+    if (count > VMM_READAROUND_PAGES)
+        count = VMM_READAROUND_PAGES;
+
+    size_t window = vma->base + first * PAGE_SIZE;
+    size_t offset = vma->file_offset + first * PAGE_SIZE;
+    size_t len = vma->file_size - first * PAGE_SIZE;
+    if (len > count * PAGE_SIZE)
+        len = count * PAGE_SIZE;
+    struct vm_file_t *file = vma->file;
+    size_t flags = vma->flags;
+
+    void *pages = pmm_alloc(count);
+    if (!pages)
+        return -1;
+
+    locked_inc(&file->refcount);
+    spinlock_release(&pagemap->lock);
+
+    int ret = vm_file_read(file, (void *)((size_t)pages + MEM_PHYS_OFFSET),
+                           offset, count * PAGE_SIZE);
+    /* Whatever lies past the file data in the last page must read as zero */
+    if (!ret)
+        memset((void *)((size_t)pages + MEM_PHYS_OFFSET + len), 0,
+               count * PAGE_SIZE - len);
+
     spinlock_acquire(&pagemap->lock);
 
-    /* Calculate the indices in the various tables using the virtual address */
-    size_t pml4_entry = (virt_addr & ((size_t)0x1ff << 39)) >> 39;
-    size_t pdpt_entry = (virt_addr & ((size_t)0x1ff << 30)) >> 30;
-    size_t pd_entry = (virt_addr & ((size_t)0x1ff << 21)) >> 21;
-    size_t pt_entry = (virt_addr & ((size_t)0x1ff << 12)) >> 12;
+    if (ret) {
+        vm_file_unref(file);
+        pmm_free(pages, count);
+        return -1;
+    }
 
-    pt_entry_t *pdpt, *pd, *pt;
+    /* The region may have changed while the lock was dropped, only map
+     * pages which are still covered by the same file at the same place */
+    for (size_t i = 0; i < count; i++) {
+        size_t virt = window + i * PAGE_SIZE;
+        size_t phys = (size_t)pages + i * PAGE_SIZE;
+        struct vma_t *cur = find_vma(pagemap, virt);
+        pt_entry_t *pte = virt_to_pte(pagemap, virt);
+
+        if (!cur || cur->file != file
+         || cur->file_offset + (virt - cur->base) != offset + i * PAGE_SIZE
+         || (pte && (*pte & 1))
+         || __map_page(pagemap, phys, virt, flags))
+            pmm_free((void *)phys, 1);
+    }
 
-    /* Get reference to the various tables in sequence. Return -1 if one of the tables is not present,
-     * since we cannot unmap a virtual address if we don't know what it's mapped to in the first place */
-    if (pagemap->pml4[pml4_entry] & 0x1) {
-        pdpt = (pt_entry_t *)((pagemap->pml4[pml4_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
-        goto fail;
+    vm_file_unref(file);
+    return 0;
+}
+
+/* Resolve a page fault. Not present pages inside a region are populated,
+ * writes to copy-on-write pages get a private copy. Returns 0 if the fault
+ * was handled and the faulting access can be retried, -1 otherwise. */
+int vmm_handle_fault(struct pagemap_t *pagemap, size_t virt_addr, size_t error_code) {
+    spinlock_acquire(&pagemap->lock);
+
+    pt_entry_t *pte = virt_to_pte(pagemap, virt_addr);
+
+    if (!pte || !(*pte & 0x1)) {
+        struct vma_t *vma = find_vma(pagemap, virt_addr);
+        if (!vma || !(vma->flags & 0x01))
+            goto fail;
+        if ((error_code & 0x02) && !(vma->flags & 0x02))
+            goto fail;
+        if (vma_fault(pagemap, vma, virt_addr))
+            goto fail;
+        /* A write to a page which got shared in the meantime is simply
+         * going to fault again */
+        goto out;
     }
 
-    if (pdpt[pdpt_entry] & 0x1) {
-        pd = (pt_entry_t *)((pdpt[pdpt_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
+    pt_entry_t entry = *pte;
+
+    /* The page was not present when we faulted, another thread
+     * populated it in the meantime */
+    if (!(error_code & 0x01))
+        goto out;
+
+    /* Only user writes to user pages are of interest from here on */
+    if ((error_code & 0x04) && !(entry & 0x04))
+        goto fail;
+    if (!(error_code & 0x02))
         goto fail;
-    }
 
-    if (pd[pd_entry] & 0x1) {
-        pt = (pt_entry_t *)((pd[pd_entry] & 0xfffffffffffff000) + MEM_PHYS_OFFSET);
-    } else {
+    /* Another thread may have resolved the fault already */
+    if (entry & 0x02)
+        goto out;
+
+    if (!(entry & VMM_FLAG_COW))
         goto fail;
+
+    size_t old_page = entry & 0xfffffffffffff000;
+    size_t flags = (entry & 0xfff & ~VMM_FLAG_COW) | 0x02;
+
+    if (!pmm_page_shared((void *)old_page)) {
+        /* Everybody else already copied the page, just take it */
+        *pte = old_page | flags;
+    } else {
+        void *new_page = pmm_alloc(1);
+        if (!new_page)
+            goto fail;
+        memcpy64((char *)((size_t)new_page + MEM_PHYS_OFFSET),
+                 (char *)(old_page + MEM_PHYS_OFFSET),
+                 PAGE_SIZE);
+        *pte = (size_t)new_page | flags;
+        /* Other threads must stop reading the old copy before it is freed */
+        tlb_shootdown(pagemap, virt_addr & ~(PAGE_SIZE - 1), 1);
+        if (!pmm_page_unref((void *)old_page))
+            pmm_free((void *)old_page, 1);
+        goto out;
     }
 
-    /* Update flags */
-    pt[pt_entry] = (pt[pt_entry] & 0xfffffffffffff000) | flags;
+    invlpg(virt_addr);
+
+out:
+    spinlock_release(&pagemap->lock);
+    return 0;
+
+fail:
+    spinlock_release(&pagemap->lock);
+    return -1;
+}
+
+/* Back a 2 MiB aligned chunk of a zero-filled region with a single large
+ * page, if nothing in it is mapped yet. Returns 0 on success. */
+static int populate_large_page(struct pagemap_t *pagemap, size_t virt_addr) {
+    spinlock_acquire(&pagemap->lock);
+
+    struct vma_t *vma = find_vma(pagemap, virt_addr);
+    if (!vma || vma->file || vma->base + vma->length < virt_addr + LARGE_PAGE_SIZE
+     || virt_to_pte(pagemap, virt_addr))
+        goto fail;
+
+    /* The buddy allocator hands out blocks aligned to their size */
+    void *page = pmm_alloc(LARGE_PAGE_SIZE / PAGE_SIZE);
+    if (!page)
+        goto fail;
+    memset((void *)((size_t)page + MEM_PHYS_OFFSET), 0, LARGE_PAGE_SIZE);
 
-    if ((size_t)pagemap->pml4 == read_cr3()) {
-        // TODO: TLB shootdown
-        invlpg(virt_addr);
+    if (__map_large_page(pagemap, (size_t)page, virt_addr, vma->flags, LARGE_PAGE_SIZE)) {
+        pmm_free(page, LARGE_PAGE_SIZE / PAGE_SIZE);
+        goto fail;
     }
 
     spinlock_release(&pagemap->lock);
@@ -360,58 +1456,324 @@ fail:
     return -1;
 }
 
+/* Back the not present pages of [virt_addr, top), which lies within one
+ * page table and a zero-filled region, with fresh pages.
+ * Call with the pagemap lock held. */
+static int populate_anon_span(struct pagemap_t *pagemap, struct vma_t *vma,
+                              size_t virt_addr, size_t top) {
+    /* Already backed by a large page, user mappings never set the PAT bit */
+    pt_entry_t *pte = virt_to_pte(pagemap, virt_addr);
+    if (pte && (*pte & 0x1) && (*pte & PT_FLAG_LARGE))
+        return 0;
+
+    pte = walk_to_entry(pagemap, virt_addr, 1, 1, NULL);
+    if (!pte)
+        return -1;
+
+    for (; virt_addr < top; virt_addr += PAGE_SIZE, pte++) {
+        if (*pte & 0x1)
+            continue;
+        void *page = pmm_allocz(1);
+        if (!page)
+            return -1;
+        /* Not present entries are never cached, no shootdown needed */
+        *pte = (pt_entry_t)((size_t)page | vma->flags);
+        if (pagemap != kernel_pagemap)
+            pagemap->resident_pages++;
+    }
+
+    return 0;
+}
+
+/* Address of the first page of [base, base + len) which is not present, or
+ * base + len if they all are. Takes the pagemap lock once for the range. */
+size_t vmm_first_absent(struct pagemap_t *pagemap, size_t base, size_t len) {
+    size_t top = base + len;
+    size_t virt;
+
+    spinlock_acquire(&pagemap->lock);
+
+    for (virt = base & ~(PAGE_SIZE - 1); virt < top; virt += PAGE_SIZE) {
+        pt_entry_t *pte = virt_to_pte(pagemap, virt);
+        if (!pte || !(*pte & 0x1))
+            break;
+        /* Rest of a large page */
+        if (*pte & PT_FLAG_LARGE)
+            virt = (virt & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE - PAGE_SIZE;
+    }
+
+    spinlock_release(&pagemap->lock);
+
+    return virt < top ? virt : top;
+}
+
+/* Make sure the pages in [base, base + len) are present, so the kernel can
+ * access them without faulting while it holds locks needed to populate
+ * them. Returns -1 if part of the range is not mapped at all. */
+int vmm_populate(struct pagemap_t *pagemap, size_t base, size_t len) {
+    size_t top = base + len;
+
+    for (size_t page = base & ~(PAGE_SIZE - 1); page < top; ) {
+        if (!(page % LARGE_PAGE_SIZE) && top - page >= LARGE_PAGE_SIZE
+         && !populate_large_page(pagemap, page)) {
+            page += LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        spinlock_acquire(&pagemap->lock);
+
+        struct vma_t *vma = find_vma(pagemap, page);
+        if (vma && !vma->file) {
+            /* Fill zero-filled regions a page table at a time */
+            size_t span_top = (page & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE;
+            if (span_top > vma->base + vma->length)
+                span_top = vma->base + vma->length;
+            if (span_top > top)
+                span_top = (top + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+            int ret = populate_anon_span(pagemap, vma, page, span_top);
+            spinlock_release(&pagemap->lock);
+            if (ret)
+                return -1;
+            page = span_top;
+            continue;
+        }
+
+        pt_entry_t *pte = virt_to_pte(pagemap, page);
+        int present = pte && (*pte & 0x1);
+        spinlock_release(&pagemap->lock);
+
+        if (!present && vmm_handle_fault(pagemap, page, 0))
+            return -1;
+
+        page += PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+/* Write the pages of shared file mappings in [base, base + len) which were
+ * modified since the last sync back to their files. Returns -1 if some
+ * could not be written. */
+int vmm_sync(struct pagemap_t *pagemap, size_t base, size_t len) {
+    size_t top = base + len;
+    int ret = 0;
+
+    for (size_t virt = base & ~(PAGE_SIZE - 1); virt < top; virt += PAGE_SIZE) {
+        spinlock_acquire(&pagemap->lock);
+
+        struct vma_t *vma = find_vma(pagemap, virt);
+        if (!vma || !vma->file || !(vma->flags & VMM_FLAG_SHARED)) {
+            spinlock_release(&pagemap->lock);
+            continue;
+        }
+
+        pt_entry_t *pte = virt_to_pte(pagemap, virt);
+        if (!pte) {
+            /* No page table, skip to the next one */
+            spinlock_release(&pagemap->lock);
+            virt = (virt & ~(LARGE_PAGE_SIZE - 1)) + LARGE_PAGE_SIZE - PAGE_SIZE;
+            continue;
+        }
+        if ((*pte & 0x81) != 0x01 || !(*pte & PT_FLAG_DIRTY)) {
+            spinlock_release(&pagemap->lock);
+            continue;
+        }
+
+        /* Clean the entry first, so that writes from here on mark it
+         * dirty again and get written by the next sync */
+        *pte &= ~PT_FLAG_DIRTY;
+        tlb_shootdown(pagemap, virt, 1);
+
+        size_t page = *pte & 0xfffffffffffff000;
+        size_t offset = vma->file_offset + (virt - vma->base);
+        struct vm_file_t *file = vma->file;
+        pmm_page_ref((void *)page);
+        locked_inc(&file->refcount);
+
+        spinlock_release(&pagemap->lock);
+
+        if (vm_file_write(file, (void *)(page + MEM_PHYS_OFFSET), offset, PAGE_SIZE)) {
+            ret = -1;
+            /* Dirty again, for the next sync to retry, unless the page
+             * was unmapped meanwhile */
+            spinlock_acquire(&pagemap->lock);
+            pte = virt_to_pte(pagemap, virt);
+            if (pte && (*pte & 0x81) == 0x01
+             && (*pte & 0xfffffffffffff000) == page)
+                *pte |= PT_FLAG_DIRTY;
+            spinlock_release(&pagemap->lock);
+        }
+
+        if (!pmm_page_unref((void *)page))
+            pmm_free((void *)page, 1);
+        vm_file_unref(file);
+    }
+
+    return ret;
+}
+
+/* Drop the regions in [base, base + len) along with their pages, after
+ * writing shared file pages back. Returns -1 with errno set to EIO if
+ * some could not be written, the range is unmapped all the same, or to
+ * ENOMEM if the range was left alone for lack of memory. */
+int vmm_unmap(struct pagemap_t *pagemap, size_t base, size_t len) {
+    struct table_pool_t pool;
+    int ret = vmm_sync(pagemap, base, len);
+
+    /* Regions and pages go together, or neither goes if memory runs out */
+    spinlock_acquire(&pagemap->lock);
+    if (alloc_split_tables(pagemap, base, base + len, &pool)) {
+        spinlock_release(&pagemap->lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (remove_vmas(pagemap, base, len)) {
+        spinlock_release(&pagemap->lock);
+        if (pool.count)
+            pmm_free((void *)pool.next, pool.count);
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t freed_list = __unmap_pages(pagemap, base, len / PAGE_SIZE, 1, &pool);
+    spinlock_release(&pagemap->lock);
+
+    if (pool.count)
+        pmm_free((void *)pool.next, pool.count);
+    free_page_list(freed_list);
+
+    if (ret)
+        errno = EIO;
+    return ret;
+}
+
+/* Map [base, top) of physical memory at MEM_PHYS_OFFSET + base using the
+ * largest pages available. Both ends must be 2 MiB aligned. */
+static int map_phys_range(struct pagemap_t *pagemap, size_t base, size_t top, int huge_pages) {
+    while (base < top) {
+        size_t size = LARGE_PAGE_SIZE;
+        if (huge_pages && !(base % HUGE_PAGE_SIZE) && top - base >= HUGE_PAGE_SIZE)
+            size = HUGE_PAGE_SIZE;
+        if (__map_large_page(pagemap, base, MEM_PHYS_OFFSET + base, 0x03, size))
+            return -1;
+        base += size;
+    }
+    return 0;
+}
+
+static int cpu_has_huge_pages(void) {
+    unsigned int eax, ebx, ecx, edx = 0;
+    __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+    return !!(edx & CPUID_PDPE1GB);
+}
+
 /* Map the first 4GiB of memory, this saves issues with MMIO hardware < 4GiB later on */
 /* Then use the e820 to map all the available memory (saves on allocation time and it's easier) */
 /* The physical memory is mapped at the beginning of the higher half (entry 256 of the pml4) onwards */
+/* All of it is mapped with 1 GiB pages if the CPU has them, 2 MiB pages otherwise */
 void init_vmm(void) {
+    uint64_t start = rdtsc(uint64_t);
+
     kernel_pagemap->pml4 = (pt_entry_t *)((size_t)pmm_allocz(1) + MEM_PHYS_OFFSET);
     if ((size_t)kernel_pagemap->pml4 == MEM_PHYS_OFFSET)
         panic("init_vmm failure", 0, 0, NULL);
 
-    spinlock_release(&kernel_pagemap->lock);
+    kernel_pagemap->lock = new_lock;
+
+    int huge_pages = cpu_has_huge_pages();
 
     kprint(KPRN_INFO, "vmm: Mapping memory as specified by the e820...");
 
-    /* Identity map the first 32 MiB */
-    /* Map 32 MiB for the phys mem area, and 32 MiB for the kernel in the higher half */
-    for (size_t i = 0; i < (0x2000000 / PAGE_SIZE); i++) {
-        size_t addr = i * PAGE_SIZE;
-        map_page(kernel_pagemap, addr, addr, 0x03, 0);
-        map_page(kernel_pagemap, addr, MEM_PHYS_OFFSET + addr, 0x03, 0);
-        map_page(kernel_pagemap, addr, KERNEL_PHYS_OFFSET + addr, 0x03, 0);
+    /* Identity map the first 32 MiB, and map it for the kernel in the higher half */
+    for (size_t addr = 0; addr < 0x2000000; addr += LARGE_PAGE_SIZE) {
+        __map_large_page(kernel_pagemap, addr, addr, 0x03, LARGE_PAGE_SIZE);
+        __map_large_page(kernel_pagemap, addr, KERNEL_PHYS_OFFSET + addr, 0x03, LARGE_PAGE_SIZE);
     }
 
-    /* Reload new pagemap */
-    asm volatile (
-        "mov cr3, rax;"
-        :
-        : "a" ((size_t)kernel_pagemap->pml4 - MEM_PHYS_OFFSET)
-    );
-
     /* Forcefully map the first 4 GiB for I/O into the higher half */
-    for (size_t i = 0; i < (0x100000000 / PAGE_SIZE); i++) {
-        size_t addr = i * PAGE_SIZE;
-
-        map_page(kernel_pagemap, addr, MEM_PHYS_OFFSET + addr, 0x03, 0);
-    }
+    if (map_phys_range(kernel_pagemap, 0, 0x100000000, huge_pages))
+        panic("init_vmm failure", 0, 0, NULL);
 
     /* Map the rest according to e820 into the higher half */
     for (size_t i = 0; e820_map[i].type; i++) {
-        size_t aligned_base = e820_map[i].base - (e820_map[i].base % PAGE_SIZE);
-        size_t aligned_length = (e820_map[i].length / PAGE_SIZE) * PAGE_SIZE;
-        if (e820_map[i].length % PAGE_SIZE) aligned_length += PAGE_SIZE;
-        if (e820_map[i].base % PAGE_SIZE) aligned_length += PAGE_SIZE;
+        size_t base = e820_map[i].base & ~(LARGE_PAGE_SIZE - 1);
+        size_t top = (e820_map[i].base + e820_map[i].length + LARGE_PAGE_SIZE - 1)
+                     & ~(LARGE_PAGE_SIZE - 1);
 
-        for (size_t j = 0; j * PAGE_SIZE < aligned_length; j++) {
-            size_t addr = aligned_base + j * PAGE_SIZE;
+        /* Skip over first 4 GiB */
+        if (base < 0x100000000)
+            base = 0x100000000;
 
-            /* Skip over first 4 GiB */
-            if (addr < 0x100000000)
-                continue;
+        if (map_phys_range(kernel_pagemap, base, top, huge_pages))
+            panic("init_vmm failure", base, 0, NULL);
+    }
+
+    /* Address spaces copy the higher half PML4 entries when created, so
+     * the kernel stack area must have its PDPT from the start */
+    pt_entry_t *kstack_pdpt = pmm_allocz(1);
+    if (!kstack_pdpt)
+        panic("init_vmm failure", 0, 0, NULL);
+    kernel_pagemap->pml4[table_index(KSTACK_AREA, 4)] = (size_t)kstack_pdpt | 0x03;
+
+    /* Reload new pagemap, every page table used so far lies in the
+     * 32 MiB mapped by the bootstrap tables */
+    load_cr3((size_t)kernel_pagemap->pml4 - MEM_PHYS_OFFSET);
 
-            map_page(kernel_pagemap, addr, MEM_PHYS_OFFSET + addr, 0x03, 0);
+    kprint(KPRN_INFO, "vmm: Mapped memory using %s pages in %U TSC cycles",
+           huge_pages ? "1 GiB" : "2 MiB", rdtsc(uint64_t) - start);
+
+    return;
+}
+
+/* Free the page tables of a pagemap which was never loaded, not the pages
+ * they map */
+static void free_page_tables(pt_entry_t *table, int level) {
+    for (size_t i = 0; level > 1 && i < PAGE_TABLE_ENTRIES; i++) {
+        if (!(table[i] & 0x1) || (table[i] & PT_FLAG_LARGE))
+            continue;
+        free_page_tables((pt_entry_t *)((table[i] & 0xfffffffffffff000) + MEM_PHYS_OFFSET),
+                         level - 1);
+    }
+    pmm_free((void *)table - MEM_PHYS_OFFSET, 1);
+}
+
+/* Time building the direct map of the first 4 GiB into a throwaway pagemap,
+ * once with 4 KiB pages, the way it was done before large pages, and once
+ * the way init_vmm() does it now. The 4 KiB tables take 8 MiB for a while. */
+void vmm_bench(void) {
+    int huge_pages = cpu_has_huge_pages();
+    uint64_t cycles[2];
+
+    for (int large = 0; large < 2; large++) {
+        struct pagemap_t *pagemap = kalloc(sizeof(struct pagemap_t));
+        if (!pagemap)
+            goto oom;
+        pagemap->lock = new_lock;
+        pagemap->pml4 = (pt_entry_t *)((size_t)pmm_allocz(1) + MEM_PHYS_OFFSET);
+        if ((size_t)pagemap->pml4 == MEM_PHYS_OFFSET) {
+            kfree(pagemap);
+            goto oom;
+        }
+
+        uint64_t start = rdtsc(uint64_t);
+        int ret = 0;
+        if (large) {
+            ret = map_phys_range(pagemap, 0, 0x100000000, huge_pages);
+        } else {
+            for (size_t addr = 0; !ret && addr < 0x100000000; addr += PAGE_SIZE)
+                ret = map_page(pagemap, addr, MEM_PHYS_OFFSET + addr, 0x03, 0);
         }
+        cycles[large] = rdtsc(uint64_t) - start;
+
+        free_page_tables(pagemap->pml4, 4);
+        kfree(pagemap);
+        if (ret)
+            goto oom;
     }
 
+    kprint(KPRN_INFO, "vmm: Direct map of 4 GiB built in %U TSC cycles with 4 KiB pages, "
+                      "%U with %s pages", cycles[0], cycles[1], huge_pages ? "1 GiB" : "2 MiB");
     return;
+
+oom:
+    kprint(KPRN_WARN, "vmm: Out of memory for the benchmark");
 }
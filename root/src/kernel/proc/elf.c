@@ -43,6 +43,13 @@ int elf_load(int fd, struct pagemap_t *pagemap, size_t base, struct auxval_t *au
         return -1;
     }
 
+    /* Segments are read in from the file when first touched */
+    struct vm_file_t *file = vm_file_new(fd, 0);
+    if (!file) {
+        kfree(phdr);
+        return -1;
+    }
+
     auxval->at_phdr = 0;
     auxval->at_phent = sizeof(struct elf_phdr_t);
     auxval->at_phnum = hdr.ph_num;
@@ -54,12 +61,14 @@ int elf_load(int fd, struct pagemap_t *pagemap, size_t base, struct auxval_t *au
 
             ld_path = kalloc(phdr[i].p_filesz + 1);
             if (!ld_path) {
+                vm_file_unref(file);
                 kfree(phdr);
                 return -1;
             }
 
             ret = lseek(fd, phdr[i].p_offset, SEEK_SET);
             if (ret == -1) {
+                vm_file_unref(file);
                 kfree(phdr);
                 kfree(ld_path);
                 return -1;
@@ -67,6 +76,7 @@ int elf_load(int fd, struct pagemap_t *pagemap, size_t base, struct auxval_t *au
 
             ret = read(fd, ld_path, phdr[i].p_filesz);
             if (ret == -1) {
+                vm_file_unref(file);
                 kfree(phdr);
                 kfree(ld_path);
                 return -1;
@@ -80,41 +90,25 @@ int elf_load(int fd, struct pagemap_t *pagemap, size_t base, struct auxval_t *au
         size_t misalign = phdr[i].p_vaddr & (PAGE_SIZE - 1);
         size_t page_count = (misalign + phdr[i].p_memsz + (PAGE_SIZE - 1)) / PAGE_SIZE;
 
-        /* Allocate space */
-        void *addr = pmm_allocz(page_count);
-        if (!addr) {
-            kfree(phdr);
-            kfree(ld_path);
-            return -1;
-        }
-
         size_t pf = 0x05;
         if(phdr[i].p_flags & PF_W)
             pf |= 0x02;
-        for (size_t j = 0; j < page_count; j++) {
-            size_t virt = base + phdr[i].p_vaddr + (j * PAGE_SIZE);
-            size_t phys = (size_t)addr + (j * PAGE_SIZE);
-            map_page(pagemap, phys, virt, pf, VMM_ATTR_REG);
-        }
-
-        ret = lseek(fd, phdr[i].p_offset, SEEK_SET);
-        if (ret == -1) {
-            kfree(phdr);
-            kfree(ld_path);
-            return -1;
-        }
 
-        /* Segments need to be cleared to zero; however, pmm_allocz() already returns
-           zeroed pages. Thus we just need to read the file contents. */
-        char *buf = (char *)((size_t)addr + MEM_PHYS_OFFSET);
-        ret = read(fd, buf + misalign, phdr[i].p_filesz);
-        if (ret == -1) {
+        /* Map from the start of the page: the first page also gets whatever
+           precedes the segment in the file. Past p_filesz reads as zero. */
+        if (phdr[i].p_offset < misalign
+         || vmm_add_vma(pagemap, base + phdr[i].p_vaddr - misalign,
+                        page_count * PAGE_SIZE, pf, file,
+                        phdr[i].p_offset - misalign,
+                        misalign + phdr[i].p_filesz)) {
+            vm_file_unref(file);
             kfree(phdr);
             kfree(ld_path);
             return -1;
         }
     }
 
+    vm_file_unref(file);
     kfree(phdr);
 
     auxval->at_entry = base + hdr.entry;
@@ -6,6 +6,7 @@
 #include <lib/lock.h>
 #include <fd/vfs/vfs.h>
 #include <fd/pipe/pipe.h>
+#include <fd/shm/shm.h>
 #include <fd/perfmon/perfmon.h>
 #include <proc/task.h>
 #include <mm/mm.h>
@@ -15,31 +16,51 @@
 #include <devices/term/tty/tty.h>
 #include <sys/urm.h>
 
+/* Whether [base, base + len) lies outside of the lower half. Written so
+ * that base + len never has to be computed, as it may wrap. */
+static inline int user_range_check(size_t base, size_t len) {
+    return base >= (size_t)0x800000000000
+        || len > (size_t)0x800000000000 - base;
+}
+
 static inline int privilege_check(size_t base, size_t len) {
-    if ( base & (size_t)0x800000000000
-     || (base + len) & (size_t)0x800000000000)
+    if (user_range_check(base, len)) {
+        errno = EFAULT;
         return 1;
-    else
-        return 0;
+    }
+
+    /* Fault the range in now, as the kernel may later touch it while
+     * holding locks that populating a file backed page needs. Most of the
+     * time it is resident already, and that is checked in one go. */
+    pid_t current_process = CURRENT_PROCESS;
+    struct pagemap_t *pagemap = process_table[current_process]->pagemap;
+    size_t absent = vmm_first_absent(pagemap, base, len);
+    if (absent < base + len
+     && vmm_populate(pagemap, absent, base + len - absent)) {
+        errno = EFAULT;
+        return 1;
+    }
+
+    return 0;
 }
 
 void enter_syscall(int syscall) {
-    spinlock_acquire(&scheduler_lock);
+    struct thread_t *thread = task_table[CURRENT_TASK];
+    struct process_t *process = process_table[CURRENT_PROCESS];
 
-    while (locked_read(int, &task_table[CURRENT_TASK]->event_abrt)) {
-        spinlock_release(&scheduler_lock);
+    /* Raise in_syscall before looking for a pending abort, both with full
+     * barriers: task_tkill() and task_tpause() raise event_abrt before
+     * looking at in_syscall, so either they wait for this syscall or we
+     * see the abort, without taking scheduler_lock on every syscall. */
+    for (;;) {
+        locked_write(int, &thread->in_syscall, 1);
+        if (!locked_read(int, &thread->event_abrt))
+            break;
+        locked_write(int, &thread->in_syscall, 0);
         yield();
-        spinlock_acquire(&scheduler_lock);
     }
 
-    pid_t current_task = cpu_locals[current_cpu].current_task;
-    pid_t current_process = cpu_locals[current_cpu].current_process;
-
-    locked_write(int, &task_table[current_task]->in_syscall, 1);
-    task_table[current_task]->last_syscall = syscall;
-
-    struct thread_t *thread = task_table[current_task];
-    struct process_t *process = process_table[current_process];
+    thread->last_syscall = syscall;
 
     /* Account thread statistics since last syscall. */
     int64_t cputime_delta = thread->total_cputime - thread->accounted_cputime;
@@ -51,15 +72,11 @@ void enter_syscall(int syscall) {
     spinlock_release(&process->perfmon_lock);
 
     thread->syscall_entry_time = uptime_raw;
-    spinlock_release(&scheduler_lock);
 }
 
 void leave_syscall(void) {
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_task = cpu_locals[current_cpu].current_task;
-    pid_t current_process = cpu_locals[current_cpu].current_process;
-    struct thread_t *thread = task_table[current_task];
-    struct process_t *process = process_table[current_process];
+    struct thread_t *thread = task_table[CURRENT_TASK];
+    struct process_t *process = process_table[CURRENT_PROCESS];
 
     spinlock_acquire(&process->usage_lock);
     time_t syscall_time = uptime_raw - thread->syscall_entry_time;
@@ -77,11 +94,7 @@ void leave_syscall(void) {
                 uptime_raw - thread->syscall_entry_time);
     spinlock_release(&process->perfmon_lock);
 
-    int *in_syscall_ptr = &task_table[CURRENT_TASK]->in_syscall;
-
-    spinlock_release(&scheduler_lock);
-
-    locked_write(int, in_syscall_ptr, 0);
+    locked_write(int, &thread->in_syscall, 0);
 }
 
 /* Prototype syscall: int syscall_name(struct regs_t *regs) */
@@ -108,16 +121,13 @@ int syscall_sigaction(struct regs_t *regs) {
     struct sigaction *act = (void *)regs->rsi;
     struct sigaction *oldact = (void *)regs->rdx;
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t pid = cpu_locals[current_cpu].current_process;
-    struct process_t *process = process_table[pid];
+    struct process_t *process = process_table[CURRENT_PROCESS];
 
     if (oldact)
         *oldact = process->signal_handlers[signum];
     if (act)
         process->signal_handlers[signum] = *act;
 
-    spinlock_release(&scheduler_lock);
     return 0;
 }
 
@@ -145,10 +155,8 @@ int syscall_getrusage(struct regs_t *regs) {
     }
 
     struct rusage_t *usage = (struct rusage_t *)regs->rsi;
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
     spinlock_acquire(&process->usage_lock);
 
     switch (regs->rdi) {
@@ -192,10 +200,8 @@ int syscall_tcgetattr(struct regs_t *regs) {
         return -1;
     }
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     if (regs->rdi >= MAX_FILE_HANDLES) {
         errno = EBADF;
@@ -225,10 +231,8 @@ int syscall_tcsetattr(struct regs_t *regs) {
         return -1;
     }
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     if (regs->rdi >= MAX_FILE_HANDLES) {
         errno = EBADF;
@@ -252,10 +256,8 @@ int syscall_tcflow(struct regs_t *regs) {
     /* rdi: fd
      * rsi: action
      */
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     if (regs->rdi >= MAX_FILE_HANDLES) {
         errno = EBADF;
@@ -277,10 +279,8 @@ int syscall_tcflow(struct regs_t *regs) {
 int syscall_isatty(struct regs_t *regs) {
     /* rdi: fd
      */
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     if (regs->rdi >= MAX_FILE_HANDLES) {
         errno = EBADF;
@@ -305,10 +305,8 @@ int syscall_getcwd(struct regs_t *regs) {
         return -1;
     }
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     char *buf = (char *)regs->rdi;
     size_t limit = (size_t)regs->rsi;
@@ -336,10 +334,8 @@ int syscall_readdir(struct regs_t *regs) {
         return -1;
     }
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
     if (process->file_handles[fd] == -1) {
@@ -368,10 +364,8 @@ int syscall_chdir(struct regs_t *regs) {
     if (privilege_check(regs->rdi, strlen(new_path) + 1))
         return -1;
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     char abs_path[2048];
     spinlock_acquire(&process->cwd_lock);
@@ -404,14 +398,12 @@ int syscall_waitpid(struct regs_t *regs) {
     int *status = (int *)regs->rsi;
     int flags = (int)regs->rdx;
 
-    if (privilege_check(regs->rsi, sizeof(int))) {
+    if (status && privilege_check(regs->rsi, sizeof(int))) {
         return -1;
     }
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     for (;;) {
         spinlock_acquire(&process->child_event_lock);
@@ -429,11 +421,11 @@ int syscall_waitpid(struct regs_t *regs) {
                     sizeof(struct child_event_t) * process->child_event_i);
                 spinlock_release(&process->child_event_lock);
                 spinlock_acquire(&scheduler_lock);
-                kfree(child_process);
                 process_table[child_pid] = (void *)(-1);
                 /* the child has been waited for so we need to add the usage */
                 add_usage(&process->child_usage, &child_process->own_usage);
                 add_usage(&process->child_usage, &child_process->child_usage);
+                process_free(child_process);
                 spinlock_release(&scheduler_lock);
                 return child_pid;
             }
@@ -455,7 +447,7 @@ int syscall_waitpid(struct regs_t *regs) {
 }
 
 int syscall_exit(struct regs_t *regs) {
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
 
     exit_send_request(current_process, regs->rdi, 0);
 
@@ -467,14 +459,11 @@ int syscall_exit(struct regs_t *regs) {
 int syscall_execve(struct regs_t *regs) {
     /* FIXME check if filename and argv/envp are in userspace */
 
-    spinlock_acquire(&scheduler_lock);
-    int _current_cpu = current_cpu;
-    pid_t current_process = cpu_locals[_current_cpu].current_process;
-    tid_t current_thread = cpu_locals[_current_cpu].current_thread;
-    tid_t current_task = cpu_locals[_current_cpu].current_task;
+    pid_t current_process = CURRENT_PROCESS;
+    tid_t current_thread = CURRENT_THREAD;
+    tid_t current_task = CURRENT_TASK;
     struct process_t *process = process_table[current_process];
     struct thread_t *thread = task_table[current_task];
-    spinlock_release(&scheduler_lock);
 
     char *path = (char *)regs->rdi;
 
@@ -514,17 +503,12 @@ int syscall_execve(struct regs_t *regs) {
 int syscall_fork(struct regs_t *regs) {
     struct perfmon_timer_t mm_timer = PERFMON_TIMER_INITIALIZER;
 
-    spinlock_acquire(&scheduler_lock);
-
-    pid_t current_task = cpu_locals[current_cpu].current_task;
-
-    struct thread_t *calling_thread = task_table[current_task];
+    struct thread_t *calling_thread = task_table[CURRENT_TASK];
 
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
 
     struct process_t *old_process = process_table[current_process];
 
-    spinlock_release(&scheduler_lock);
     pid_t new_pid = task_pcreate();
     if (new_pid == -1)
         return -1;
@@ -536,6 +520,15 @@ int syscall_fork(struct regs_t *regs) {
 
     struct process_t *new_process = process_table[new_pid];
 
+    if (!new_pagemap) {
+        process_table[new_pid] = EMPTY;
+        spinlock_release(&scheduler_lock);
+        free_address_space(new_process->pagemap);
+        process_free(new_process);
+        errno = ENOMEM;
+        return -1;
+    }
+
     new_process->ppid = current_process;
 
     free_address_space(new_process->pagemap);
@@ -568,7 +561,7 @@ int syscall_fork(struct regs_t *regs) {
             old_process->signal_handlers[i].sa_handler;
     new_process->sigmask = old_process->sigmask;
 
-    new_process->threads[0] = kalloc(sizeof(struct thread_t));
+    new_process->threads[0] = thread_alloc();
     struct thread_t *new_thread = new_process->threads[0];
 
     /* Search for free global task ID */
@@ -588,8 +581,7 @@ found_new_task_id:
     new_thread->lock = new_lock;
     new_thread->yield_target = 0;
     new_thread->active_on_cpu = -1;
-    /* TODO: fix this */
-    new_thread->kstack = (size_t)kalloc(32768) + 32768;
+    new_thread->kstack = task_kstack(new_task_id);
     new_thread->fs_base = calling_thread->fs_base;
     new_thread->ctx.regs = *regs;
     new_thread->ctx.regs.rax = 0;
@@ -610,37 +602,36 @@ found_new_task_id:
 int syscall_set_fs_base(struct regs_t *regs) {
     // rdi: new fs base
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_task = cpu_locals[current_cpu].current_task;
-    struct thread_t *thread = task_table[current_task];
+    struct thread_t *thread = task_table[CURRENT_TASK];
 
+    /* Preemption in between reloads fs from thread->fs_base anyway */
     thread->fs_base = regs->rdi;
     load_fs_base(regs->rdi);
 
-    spinlock_release(&scheduler_lock);
-
     return 0;
 }
 
+/* Map the pages right away instead of on first touch */
+#define ALLOC_AT_POPULATE 1
+
 void *syscall_alloc_at(struct regs_t *regs) {
     // rdi: virtual address / 0 for sbrk-like allocation
     // rsi: page count
+    // rdx: flags
     struct perfmon_timer_t mm_timer = PERFMON_TIMER_INITIALIZER;
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     size_t base_address;
     if (regs->rdi) {
         base_address = regs->rdi;
-        if (privilege_check(base_address, regs->rsi * PAGE_SIZE))
+        if (user_range_check(base_address, regs->rsi * PAGE_SIZE))
             return (void *)0;
     } else {
         spinlock_acquire(&process->cur_brk_lock);
         base_address = process->cur_brk;
-        if (privilege_check(base_address, regs->rsi * PAGE_SIZE)) {
+        if (user_range_check(base_address, regs->rsi * PAGE_SIZE)) {
             spinlock_release(&process->cur_brk_lock);
             return (void *)0;
         }
@@ -649,19 +640,182 @@ void *syscall_alloc_at(struct regs_t *regs) {
     }
 
     perfmon_timer_start(&mm_timer);
-    void *ptr = pmm_allocz(regs->rsi);
-    if (!ptr) {
+    /* Pages get zero-filled on first touch */
+    if (vmm_add_vma(process->pagemap, base_address, regs->rsi * PAGE_SIZE,
+                    0x07, NULL, 0, 0)) {
+        errno = ENOMEM;
+        return (void *)0;
+    }
+    if ((regs->rdx & ALLOC_AT_POPULATE)
+     && vmm_populate(process->pagemap, base_address, regs->rsi * PAGE_SIZE)) {
         errno = ENOMEM;
         return (void *)0;
     }
-    for (size_t i = 0; i < regs->rsi; i++) {
-        if (map_page(process->pagemap, (size_t)ptr + i * PAGE_SIZE,
-            base_address + i * PAGE_SIZE, 0x07, VMM_ATTR_REG)) {
-            pmm_free(ptr, regs->rsi);
+    perfmon_timer_stop(&mm_timer);
+
+    spinlock_acquire(&process->perfmon_lock);
+    if (process->active_perfmon)
+        atomic_add_uint64_relaxed(&process->active_perfmon->mman_time, mm_timer.elapsed);
+    spinlock_release(&process->perfmon_lock);
+
+    return (void *)base_address;
+}
+
+/* from options/posix/include/sys/mman.h in mlibc */
+#define PROT_NONE 0x00
+#define PROT_READ 0x01
+#define PROT_WRITE 0x02
+#define PROT_EXEC 0x04
+
+#define MAP_PRIVATE 0x01
+#define MAP_SHARED 0x02
+#define MAP_FIXED 0x04
+#define MAP_ANONYMOUS 0x08
+
+#define MS_ASYNC 0x01
+#define MS_SYNC 0x02
+#define MS_INVALIDATE 0x04
+
+/* Like privilege_check(), without faulting the range in */
+static inline int mman_range_check(size_t base, size_t len) {
+    if ((base & (PAGE_SIZE - 1)) || !len || user_range_check(base, len))
+        return 1;
+    return 0;
+}
+
+void *syscall_mmap(struct regs_t *regs) {
+    // rdi: address, a hint unless MAP_FIXED
+    // rsi: length
+    // rdx: prot
+    // r10: flags
+    // r8:  fd, ignored with MAP_ANONYMOUS
+    // r9:  offset
+    struct perfmon_timer_t mm_timer = PERFMON_TIMER_INITIALIZER;
+
+    size_t len = (regs->rsi + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    int prot = (int)regs->rdx;
+    int flags = (int)regs->r10;
+    int fd = (int)regs->r8;
+
+    if (!len || (regs->r9 & (PAGE_SIZE - 1))
+     || !(flags & MAP_SHARED) == !(flags & MAP_PRIVATE)) {
+        errno = EINVAL;
+        return (void *)0;
+    }
+
+    pid_t current_process = CURRENT_PROCESS;
+    struct process_t *process = process_table[current_process];
+
+    perfmon_timer_start(&mm_timer);
+
+    if (!(flags & MAP_ANONYMOUS) && (fd < 0 || fd >= MAX_FILE_HANDLES)) {
+        errno = EBADF;
+        return (void *)0;
+    }
+
+    size_t base_address;
+    if (flags & MAP_FIXED) {
+        base_address = regs->rdi;
+        if (mman_range_check(base_address, len)) {
+            errno = EINVAL;
+            return (void *)0;
+        }
+    } else {
+        spinlock_acquire(&process->cur_brk_lock);
+        base_address = process->cur_brk;
+        if (mman_range_check(base_address, len)) {
+            spinlock_release(&process->cur_brk_lock);
             errno = ENOMEM;
             return (void *)0;
         }
+        process->cur_brk += len;
+        spinlock_release(&process->cur_brk_lock);
+    }
+
+    size_t pte_flags = 0x04;
+    if (prot & (PROT_READ | PROT_WRITE | PROT_EXEC))
+        pte_flags |= 0x01;
+    if (prot & PROT_WRITE)
+        pte_flags |= 0x02;
+    if (flags & MAP_SHARED)
+        pte_flags |= VMM_FLAG_SHARED;
+
+    struct vm_file_t *file = NULL;
+    if (!(flags & MAP_ANONYMOUS)) {
+        spinlock_acquire(&process->file_handles_lock);
+        int global_fd = process->file_handles[fd];
+        if (global_fd == -1) {
+            spinlock_release(&process->file_handles_lock);
+            errno = EBADF;
+            return (void *)0;
+        }
+
+        /* Objects like shared memory map their own pages, and replace
+         * whatever was mapped there themselves */
+        if (!mmap(global_fd, process->pagemap, base_address, len,
+                  regs->r9, pte_flags)) {
+            spinlock_release(&process->file_handles_lock);
+            goto out;
+        }
+        if (errno != ENODEV) {
+            spinlock_release(&process->file_handles_lock);
+            return (void *)0;
+        }
+
+        /* Only regular files have their pages cached */
+        struct stat st;
+        if (fstat(global_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            spinlock_release(&process->file_handles_lock);
+            errno = ENODEV;
+            return (void *)0;
+        }
+
+        /* Any mapping reads the file, a shared writable one writes it */
+        int acc_mode = getflflags(global_fd) & O_ACCMODE;
+        int writable = (flags & MAP_SHARED) && (prot & PROT_WRITE);
+        if ((acc_mode != O_RDONLY && acc_mode != O_RDWR)
+         || (writable && acc_mode != O_RDWR)) {
+            spinlock_release(&process->file_handles_lock);
+            errno = EACCES;
+            return (void *)0;
+        }
+
+        file = vm_file_new(global_fd, writable);
+        spinlock_release(&process->file_handles_lock);
+
+        /* errno is set by vm_file_new() */
+        if (!file)
+            return (void *)0;
     }
+
+    /* Whatever was mapped there goes away, now that nothing but a lack of
+     * memory can fail the call */
+    if ((flags & MAP_FIXED) && vmm_unmap(process->pagemap, base_address, len)
+     && errno == ENOMEM) {
+        if (file)
+            vm_file_unref(file);
+        return (void *)0;
+    }
+
+    /* The whole region is file backed, pages past EOF read as zero */
+    int ret = vmm_add_vma(process->pagemap, base_address, len, pte_flags,
+                          file, regs->r9, file ? len : 0);
+    if (file)
+        vm_file_unref(file);
+    if (ret) {
+        errno = ENOMEM;
+        return (void *)0;
+    }
+
+    /* Shared anonymous memory must exist before a fork() to be shared */
+    if (!file && (flags & MAP_SHARED) && (pte_flags & 0x01)
+     && vmm_populate(process->pagemap, base_address, len)) {
+        vmm_unmap(process->pagemap, base_address, len);
+        errno = ENOMEM;
+        return (void *)0;
+    }
+
+out:
     perfmon_timer_stop(&mm_timer);
 
     spinlock_acquire(&process->perfmon_lock);
@@ -672,6 +826,123 @@ void *syscall_alloc_at(struct regs_t *regs) {
     return (void *)base_address;
 }
 
+int syscall_munmap(struct regs_t *regs) {
+    // rdi: address
+    // rsi: length
+    size_t len = (regs->rsi + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    if (mman_range_check(regs->rdi, len)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pid_t current_process = CURRENT_PROCESS;
+    struct process_t *process = process_table[current_process];
+
+    /* errno is set by vmm_unmap(). Shared pages which fail to be written
+     * back are lost all the same. */
+    if (vmm_unmap(process->pagemap, regs->rdi, len) == -1)
+        return -1;
+
+    return 0;
+}
+
+int syscall_msync(struct regs_t *regs) {
+    // rdi: address
+    // rsi: length
+    // rdx: flags
+    size_t len = (regs->rsi + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    if (mman_range_check(regs->rdi, len)
+     || (regs->rdx & MS_ASYNC && regs->rdx & MS_SYNC)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pid_t current_process = CURRENT_PROCESS;
+    struct process_t *process = process_table[current_process];
+
+    /* Mappings share the cached pages, so there is nothing to invalidate,
+     * and MS_ASYNC is just as synchronous as MS_SYNC */
+    if (vmm_sync(process->pagemap, regs->rdi, len)) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+int syscall_ftruncate(struct regs_t *regs) {
+    // rdi: fd
+    // rsi: length
+
+    pid_t current_process = CURRENT_PROCESS;
+    struct process_t *process = process_table[current_process];
+
+    if (regs->rdi >= MAX_FILE_HANDLES) {
+        errno = EBADF;
+        return -1;
+    }
+    spinlock_acquire(&process->file_handles_lock);
+    if (process->file_handles[regs->rdi] == -1) {
+        spinlock_release(&process->file_handles_lock);
+        errno = EBADF;
+        return -1;
+    }
+
+    int ret = ftruncate(process->file_handles[regs->rdi], (off_t)regs->rsi);
+
+    spinlock_release(&process->file_handles_lock);
+    return ret;
+}
+
+int syscall_shm_open(struct regs_t *regs) {
+    // rdi: name, NULL for an anonymous object
+    // rsi: flags
+
+    pid_t current_process = CURRENT_PROCESS;
+    struct process_t *process = process_table[current_process];
+
+    if (regs->rdi
+     && privilege_check(regs->rdi, strlen((const char *)regs->rdi) + 1)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    spinlock_acquire(&process->file_handles_lock);
+
+    int local_fd;
+
+    for (local_fd = 0; process->file_handles[local_fd] != -1; local_fd++)
+        if (local_fd + 1 == MAX_FILE_HANDLES) {
+            spinlock_release(&process->file_handles_lock);
+            errno = EMFILE;
+            return -1;
+        }
+
+    int fd = shm_open((const char *)regs->rdi, (int)regs->rsi);
+    if (fd < 0) {
+        spinlock_release(&process->file_handles_lock);
+        return -1;
+    }
+
+    process->file_handles[local_fd] = fd;
+
+    spinlock_release(&process->file_handles_lock);
+    return local_fd;
+}
+
+int syscall_shm_unlink(struct regs_t *regs) {
+    // rdi: name
+
+    if (privilege_check(regs->rdi, strlen((const char *)regs->rdi) + 1)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    return shm_unlink((const char *)regs->rdi);
+}
+
 int syscall_debug_print(struct regs_t *regs) {
     // rdi: print type
     // rsi: string
@@ -685,8 +956,8 @@ int syscall_debug_print(struct regs_t *regs) {
         return -1;
 
     kprint(regs->rdi, "[%u:%u:%u] %s",
-           cpu_locals[current_cpu].current_process,
-           cpu_locals[current_cpu].current_thread,
+           CURRENT_PROCESS,
+           CURRENT_THREAD,
            current_cpu,
            regs->rsi);
 
@@ -694,24 +965,19 @@ int syscall_debug_print(struct regs_t *regs) {
 }
 
 pid_t syscall_getpid(void) {
-    return cpu_locals[current_cpu].current_process;
+    return CURRENT_PROCESS;
 }
 
 pid_t syscall_getppid(void) {
-    spinlock_acquire(&scheduler_lock);
-    pid_t ret = process_table[CURRENT_PROCESS]->ppid;
-    spinlock_release(&scheduler_lock);
-    return ret;
+    return process_table[CURRENT_PROCESS]->ppid;
 }
 
 int syscall_pipe(struct regs_t *regs) {
     int *pipefd = (int *)regs->rdi;
     int flflags = (int)regs->rsi;
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     if (privilege_check(pipefd, sizeof(int) * 2))
         return -1;
@@ -763,10 +1029,8 @@ int syscall_pipe(struct regs_t *regs) {
 int syscall_unlink(struct regs_t *regs) {
     // rdi: path
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     const char *path = (const char *)regs->rdi;
 
@@ -792,10 +1056,8 @@ int syscall_unlink(struct regs_t *regs) {
 int syscall_mkdir(struct regs_t *regs) {
     // rdi: path
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     char abs_path[2048];
     spinlock_acquire(&process->cwd_lock);
@@ -810,10 +1072,8 @@ int syscall_open(struct regs_t *regs) {
     // rsi: mode
     struct perfmon_timer_t io_timer = PERFMON_TIMER_INITIALIZER;
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     if (privilege_check(regs->rdi, strlen((const char *)regs->rdi) + 1)) {
         errno = EFAULT;
@@ -870,10 +1130,8 @@ int syscall_open(struct regs_t *regs) {
 #define F_SETOWN 11
 
 static int fcntl_dupfd(int fd, int lowest_fd, int cloexec) {
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
     int old_fd_sys = process->file_handles[fd];
@@ -905,10 +1163,8 @@ fnd:;
 }
 
 static int fcntl_getfd(int fd) {
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
     int fd_sys = process->file_handles[fd];
@@ -923,10 +1179,8 @@ static int fcntl_getfd(int fd) {
 }
 
 static int fcntl_setfd(int fd, int fdflags) {
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
     int fd_sys = process->file_handles[fd];
@@ -941,10 +1195,8 @@ static int fcntl_setfd(int fd, int fdflags) {
 }
 
 static int fcntl_getfl(int fd) {
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
     int fd_sys = process->file_handles[fd];
@@ -959,10 +1211,8 @@ static int fcntl_getfl(int fd) {
 }
 
 static int fcntl_setfl(int fd, int flflags) {
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
     int fd_sys = process->file_handles[fd];
@@ -1038,10 +1288,8 @@ int syscall_dup2(struct regs_t *regs) {
     int old_fd = (int)regs->rdi;
     int new_fd = (int)regs->rsi;
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
     int old_fd_sys = process->file_handles[old_fd];
@@ -1073,10 +1321,8 @@ int syscall_dup2(struct regs_t *regs) {
 int syscall_close(struct regs_t *regs) {
     // rdi: fd
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     if (regs->rdi >= MAX_FILE_HANDLES) {
         return -1;
@@ -1105,10 +1351,8 @@ int syscall_lseek(struct regs_t *regs) {
     // rsi: offset
     // rdx: type
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     if (regs->rdi >= MAX_FILE_HANDLES) {
         return -1;
@@ -1134,10 +1378,8 @@ int syscall_fstat(struct regs_t *regs) {
         return -1;
     }
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
     if (process->file_handles[regs->rdi] == -1) {
@@ -1160,10 +1402,8 @@ int syscall_read(struct regs_t *regs) {
     // rdx: len
     struct perfmon_timer_t io_timer = PERFMON_TIMER_INITIALIZER;
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     if (privilege_check(regs->rsi, regs->rdx)) {
         return -1;
@@ -1207,10 +1447,8 @@ int syscall_write(struct regs_t *regs) {
     // rdx: len
     struct perfmon_timer_t io_timer = PERFMON_TIMER_INITIALIZER;
 
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     if (privilege_check(regs->rsi, regs->rdx)) {
         return -1;
@@ -1249,10 +1487,8 @@ int syscall_write(struct regs_t *regs) {
 }
 
 int syscall_perfmon_create(struct regs_t *regs) {
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     int sys_fd = perfmon_create();
     if (sys_fd == -1)
@@ -1274,10 +1510,8 @@ int syscall_perfmon_create(struct regs_t *regs) {
 }
 
 int syscall_perfmon_attach(struct regs_t *regs) {
-    spinlock_acquire(&scheduler_lock);
-    pid_t current_process = cpu_locals[current_cpu].current_process;
+    pid_t current_process = CURRENT_PROCESS;
     struct process_t *process = process_table[current_process];
-    spinlock_release(&scheduler_lock);
 
     spinlock_acquire(&process->file_handles_lock);
     if (process->file_handles[regs->rdi] == -1) {
@@ -3,6 +3,7 @@
 #include <proc/task.h>
 #include <mm/mm.h>
 #include <lib/klib.h>
+#include <lib/objcache.h>
 #include <sys/panic.h>
 #include <sys/smp.h>
 #include <lib/lock.h>
@@ -12,6 +13,7 @@
 #include <fd/vfs/vfs.h>
 #include <lib/time.h>
 #include <lib/event.h>
+#include <lib/rcu.h>
 #include <lib/signal.h>
 #include <misc/pit.h>
 #include <sys/urm.h>
@@ -37,6 +39,61 @@ static struct regs_t default_usr_regs = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x23,0x
 
 static uint8_t default_fxstate[512] __attribute__((aligned(16)));
 
+/* Freed threads and processes are recycled, processes along with their
+ * thread and file handle tables */
+#define THREAD_CACHE_MAX 256
+#define PROCESS_CACHE_MAX 64
+
+static struct objcache_t thread_cache =
+    new_objcache(sizeof(struct thread_t), THREAD_CACHE_MAX);
+static struct objcache_t process_cache =
+    new_objcache(sizeof(struct process_t), PROCESS_CACHE_MAX);
+static struct objcache_t threads_table_cache =
+    new_objcache(MAX_THREADS * sizeof(struct thread_t *), PROCESS_CACHE_MAX);
+static struct objcache_t file_handles_cache =
+    new_objcache(MAX_FILE_HANDLES * sizeof(int), PROCESS_CACHE_MAX);
+
+/* Bitmap of the task IDs whose kernel stack slot is mapped */
+static uint8_t *kstack_mapped;
+static lock_t kstack_lock = new_lock;
+
+struct thread_t *thread_alloc(void) {
+    return objcache_alloc(&thread_cache);
+}
+
+void thread_free(struct thread_t *thread) {
+    objcache_free(&thread_cache, thread);
+}
+
+/* Returns a zeroed process with zeroed thread and file handle tables */
+struct process_t *process_alloc(void) {
+    struct process_t *process = objcache_alloc(&process_cache);
+    if (!process)
+        return NULL;
+
+    process->threads = objcache_alloc(&threads_table_cache);
+    process->file_handles = objcache_alloc(&file_handles_cache);
+    if (!process->threads || !process->file_handles) {
+        process_free(process);
+        return NULL;
+    }
+
+    return process;
+}
+
+/* Give back the file handle table of an exiting process early, the rest
+ * of it lingers until the parent waits for it */
+void process_free_file_handles(struct process_t *process) {
+    objcache_free(&file_handles_cache, process->file_handles);
+    process->file_handles = NULL;
+}
+
+void process_free(struct process_t *process) {
+    objcache_free(&threads_table_cache, process->threads);
+    objcache_free(&file_handles_cache, process->file_handles);
+    objcache_free(&process_cache, process);
+}
+
 void init_sched(void) {
     fxsave(&default_fxstate);
 
@@ -49,6 +106,9 @@ void init_sched(void) {
     if ((process_table = kalloc(MAX_PROCESSES * sizeof(struct process_t *))) == 0) {
         panic("sched: Unable to allocate process table.", 0, 0, NULL);
     }
+    if ((kstack_mapped = kalloc(MAX_TASKS / 8)) == 0) {
+        panic("sched: Unable to allocate kernel stack bitmap.", 0, 0, NULL);
+    }
     /* Now make space for PID 0 */
     kprint(KPRN_INFO, "sched: Creating PID 0");
     if ((process_table[0] = kalloc(sizeof(struct process_t))) == 0) {
@@ -164,7 +224,7 @@ int kill(pid_t pid, int signal) {
 }
 
 /* Search for a new task to run */
-static inline tid_t task_get_next(tid_t current_task) {
+static inline tid_t task_get_next(tid_t current_task, int cpu) {
     if (current_task != -1) {
         current_task++;
     } else {
@@ -185,6 +245,9 @@ static inline tid_t task_get_next(tid_t current_task) {
         if (thread->yield_target > uptime_raw) {
             goto next;
         }
+        if (thread->bound_cpu != -1 && thread->bound_cpu != cpu) {
+            goto next;
+        }
         if (!spinlock_test_and_acquire(&thread->lock)) {
             /* If unable to acquire the thread's lock, skip */
             goto next;
@@ -198,6 +261,10 @@ static inline tid_t task_get_next(tid_t current_task) {
                 if (locked_read(event_t, thread->event_ptr)) {
                     locked_dec(thread->event_ptr);
                     thread->event_ptr = 0;
+                } else if (thread->event_deadline
+                        && thread->event_deadline <= uptime_raw) {
+                    /* Timed out */
+                    thread->event_ptr = 0;
                 } else {
                     spinlock_release(&thread->lock);
                     goto next;
@@ -222,6 +289,10 @@ __attribute__((noinline)) static void _idle(void) {
     cpu_locals[_current_cpu].current_process = -1;
     spinlock_release(&scheduler_lock);
     spinlock_release(&resched_lock);
+    /* Zero pages in advance while there is nothing else to do, one at a
+     * time, letting pending interrupts in between */
+    while (zero_pool_idle())
+        asm volatile ("sti; nop; cli;" ::: "memory");
     asm volatile (
         "sti;"
         "1: "
@@ -241,13 +312,16 @@ __attribute__((noinline)) static void idle(void) {
         "mov rsp, qword ptr gs:[8];"
         "jmp _idle;"
         :
-        : "a" ((size_t)kernel_pagemap->pml4 - MEM_PHYS_OFFSET)
+        : "a" (tlb_pagemap_switch(kernel_pagemap))
     );
     /* Dead call so GCC doesn't garbage collect _idle */
     _idle();
 }
 
 void task_resched(struct regs_t *regs) {
+    /* Whatever was interrupted is not inside an RCU read section */
+    rcu_quiescent_state(current_cpu);
+
     spinlock_acquire(&resched_lock);
 
     if (!spinlock_test_and_acquire(&scheduler_lock)) {
@@ -259,7 +333,6 @@ void task_resched(struct regs_t *regs) {
 
     pid_t current_task = cpu_locals[_current_cpu].current_task;
     pid_t current_process = cpu_locals[_current_cpu].current_process;
-    pid_t last_task = current_task;
 
     if (current_task != -1) {
         struct thread_t *current_thread = task_table[current_task];
@@ -283,7 +356,7 @@ void task_resched(struct regs_t *regs) {
     cpu_locals[_current_cpu].last_schedule_time = uptime_raw;
 
     /* Get to the next task */
-    current_task = task_get_next(current_task);
+    current_task = task_get_next(current_task, _current_cpu);
     /* If there's nothing to do, idle */
     if (current_task == -1)
         idle();
@@ -307,10 +380,12 @@ void task_resched(struct regs_t *regs) {
 
     thread->active_on_cpu = _current_cpu;
 
+    struct pagemap_t *pagemap = process_table[thread->process]->pagemap;
+
     /* Swap cr3, if necessary */
-    if (task_table[last_task]->process != thread->process) {
+    if (cpu_local->active_pagemap != pagemap) {
         /* Switch cr3 and return to the thread */
-        task_spinup(&thread->ctx.regs, (size_t)process_table[thread->process]->pagemap->pml4 - MEM_PHYS_OFFSET);
+        task_spinup(&thread->ctx.regs, tlb_pagemap_switch(pagemap));
     } else {
         /* Don't switch cr3 and return to the thread */
         task_spinup(&thread->ctx.regs, 0);
@@ -361,7 +436,7 @@ found_new_pid:
     spinlock_release(&scheduler_lock);
 
     /* Try to make space for this new task */
-    struct process_t *new_process = kalloc(sizeof(struct process_t));
+    struct process_t *new_process = process_alloc();
     if (!new_process) {
         spinlock_acquire(&scheduler_lock);
         process_table[new_pid] = EMPTY;
@@ -369,23 +444,6 @@ found_new_pid:
         return -1;
     }
 
-    if ((new_process->threads = kalloc(MAX_THREADS * sizeof(struct thread_t *))) == 0) {
-        kfree(new_process);
-        spinlock_acquire(&scheduler_lock);
-        process_table[new_pid] = EMPTY;
-        spinlock_release(&scheduler_lock);
-        return -1;
-    }
-
-    if ((new_process->file_handles = kalloc(MAX_FILE_HANDLES * sizeof(int))) == 0) {
-        kfree(new_process->threads);
-        kfree(new_process);
-        spinlock_acquire(&scheduler_lock);
-        process_table[new_pid] = EMPTY;
-        spinlock_release(&scheduler_lock);
-        return -1;
-    }
-
     /* Initially, mark all file handles as unused */
     for (size_t i = 0; i < MAX_FILE_HANDLES; i++) {
         new_process->file_handles[i] = -1;
@@ -411,12 +469,12 @@ found_new_pid:
     memset(&new_process->child_usage, 0, sizeof(struct rusage_t));
     new_process->usage_lock = new_lock;
 
+    urm_init_process(new_process);
+
     /* Create a new pagemap for the process */
     new_process->pagemap = new_address_space();
     if (!new_process->pagemap) {
-        kfree(new_process->file_handles);
-        kfree(new_process->threads);
-        kfree(new_process);
+        process_free(new_process);
         spinlock_acquire(&scheduler_lock);
         process_table[new_pid] = EMPTY;
         spinlock_release(&scheduler_lock);
@@ -433,7 +491,7 @@ found_new_pid:
 }
 
 void abort_thread_exec(size_t scheduler_not_locked) {
-    load_cr3((size_t)kernel_pagemap->pml4 - MEM_PHYS_OFFSET);
+    load_cr3(tlb_pagemap_switch(kernel_pagemap));
 
     int _current_cpu = current_cpu;
 
@@ -457,6 +515,37 @@ void abort_thread_exec(size_t scheduler_not_locked) {
 #define STACK_LOCATION_TOP ((size_t)0x0000800000000000)
 #define STACK_SIZE ((size_t)32768)
 
+/* Each task ID has a kernel stack slot in KSTACK_AREA, with an unmapped
+ * guard page below the stack. Slots stay mapped once used, so the next
+ * task with the same ID finds its stack ready. */
+#define KSTACK_SLOT_SIZE (STACK_SIZE + PAGE_SIZE)
+
+/* Returns the top of the kernel stack of a task ID, 0 on failure */
+size_t task_kstack(tid_t task_id) {
+    size_t bottom = KSTACK_AREA + task_id * KSTACK_SLOT_SIZE + PAGE_SIZE;
+
+    spinlock_acquire(&kstack_lock);
+
+    if (!(kstack_mapped[task_id / 8] & (1 << (task_id % 8)))) {
+        void *pages = pmm_alloc(STACK_SIZE / PAGE_SIZE);
+        if (!pages) {
+            spinlock_release(&kstack_lock);
+            return 0;
+        }
+        if (map_range(kernel_pagemap, (size_t)pages, bottom,
+                      STACK_SIZE / PAGE_SIZE, 0x03)) {
+            spinlock_release(&kstack_lock);
+            pmm_free(pages, STACK_SIZE / PAGE_SIZE);
+            return 0;
+        }
+        kstack_mapped[task_id / 8] |= 1 << (task_id % 8);
+    }
+
+    spinlock_release(&kstack_lock);
+
+    return bottom + STACK_SIZE;
+}
+
 int task_tpause(pid_t pid, tid_t tid) {
     spinlock_acquire(&scheduler_lock);
 
@@ -510,6 +599,18 @@ int task_tresume(pid_t pid, tid_t tid) {
     return 0;
 }
 
+/* Keep the calling thread on cpu from now on, or let it run anywhere again
+ * if cpu is -1 */
+void task_bind(int cpu) {
+    struct thread_t *thread = task_table[CURRENT_TASK];
+
+    locked_write(int, &thread->bound_cpu, cpu);
+
+    /* Once rescheduled, it only comes back on the right CPU */
+    if (cpu != -1 && cpu != current_cpu)
+        yield();
+}
+
 /* Kill a thread in a given process */
 /* Return -1 on failure */
 int task_tkill(pid_t pid, tid_t tid) {
@@ -541,26 +642,21 @@ int task_tkill(pid_t pid, tid_t tid) {
 
     task_table[process_table[pid]->threads[tid]->task_id] = (void *)(-1);
 
-    void *kstack = (void *)(process_table[pid]->threads[tid]->kstack - STACK_SIZE);
-
-    kfree(process_table[pid]->threads[tid]);
+    /* The kernel stack stays with the task ID */
+    thread_free(process_table[pid]->threads[tid]);
 
     process_table[pid]->threads[tid] = (void *)(-1);
 
     task_count--;
 
     if (active_on_cpu == current_cpu) {
+        /* Leave the stack before the task ID can be reused */
         asm volatile (
             "mov rsp, qword ptr gs:[8];"
-            "call kfree;"
             "cli;"
             "mov rdi, 0;"
             "call abort_thread_exec;"
-            :
-            : "D" (kstack)
         );
-    } else {
-        kfree(kstack);
     }
 
     spinlock_release(&scheduler_lock);
@@ -600,7 +696,7 @@ found_new_task_id:;
 
     /* Try to make space for this new thread */
     struct thread_t *new_thread;
-    if (!(new_thread = kalloc(sizeof(struct thread_t)))) {
+    if (!(new_thread = thread_alloc())) {
         spinlock_acquire(&scheduler_lock);
         process_table[pid]->threads[new_tid] = EMPTY;
         task_table[new_task_id] = EMPTY;
@@ -609,9 +705,9 @@ found_new_task_id:;
     }
 
     /* Set up a kernel stack for the thread */
-    new_thread->kstack = (size_t)kalloc(STACK_SIZE) + STACK_SIZE;
-    if (new_thread->kstack == STACK_SIZE) {
-        kfree(new_thread);
+    new_thread->kstack = task_kstack(new_task_id);
+    if (!new_thread->kstack) {
+        thread_free(new_thread);
         spinlock_acquire(&scheduler_lock);
         process_table[pid]->threads[new_tid] = EMPTY;
         task_table[new_task_id] = EMPTY;
@@ -620,6 +716,7 @@ found_new_task_id:;
     }
 
     new_thread->active_on_cpu = -1;
+    new_thread->bound_cpu = -1;
 
     /* Set registers to defaults */
     if (pid)
@@ -637,8 +734,7 @@ found_new_task_id:;
         /* Allocate physical memory for the stack and initialize it. */
         char *stack_pm = pmm_allocz(STACK_SIZE / PAGE_SIZE);
         if (!stack_pm) {
-            kfree((void *)(new_thread->kstack - STACK_SIZE));
-            kfree(new_thread);
+            thread_free(new_thread);
             spinlock_acquire(&scheduler_lock);
             process_table[pid]->threads[new_tid] = EMPTY;
             task_table[new_task_id] = EMPTY;
@@ -710,13 +806,11 @@ found_new_task_id:;
         panic_unless(!((size_t)sp & 0xF) && "Stack must be 16-byte aligned on x86_64");
 
         /* Map the stack */
-        for (size_t i = 0; i < STACK_SIZE / PAGE_SIZE; i++) {
-            map_page(process_table[pid]->pagemap,
-                     (size_t)(stack_pm + (i * PAGE_SIZE)),
-                     (size_t)(stack_bottom + (i * PAGE_SIZE)),
-                     pid ? 0x07 : 0x03,
-                     VMM_ATTR_REG);
-        }
+        map_range(process_table[pid]->pagemap,
+                  (size_t)stack_pm,
+                  (size_t)stack_bottom,
+                  STACK_SIZE / PAGE_SIZE,
+                  pid ? 0x07 : 0x03);
         /* Add a guard page */
         unmap_page(process_table[pid]->pagemap, stack_guardpage);
         new_thread->ctx.regs.rsp = stack_bottom + STACK_SIZE - ((sbase - sp) * sizeof(size_t));
@@ -742,7 +836,7 @@ found_new_task_id:;
     new_thread->tid = new_tid;
     new_thread->task_id = new_task_id;
     new_thread->process = pid;
-    spinlock_release(&new_thread->lock);
+    new_thread->lock = new_lock;
 
     /* Actually "enable" the new thread */
     spinlock_acquire(&scheduler_lock);
@@ -9,15 +9,16 @@
 #include <lib/time.h>
 #include <lib/types.h>
 #include <lib/signal.h>
+#include <lib/workqueue.h>
 
 #define MAX_PROCESSES 65536
 #define MAX_THREADS 1024
 #define MAX_TASKS (MAX_PROCESSES*16)
 #define MAX_FILE_HANDLES 256
 
-#define CURRENT_PROCESS cpu_locals[current_cpu].current_process
-#define CURRENT_THREAD cpu_locals[current_cpu].current_thread
-#define CURRENT_TASK cpu_locals[current_cpu].current_task
+#define CURRENT_PROCESS cpu_local_read(current_process)
+#define CURRENT_THREAD cpu_local_read(current_thread)
+#define CURRENT_TASK cpu_local_read(current_task)
 
 #define fxsave(ptr) ({ \
     asm volatile ( \
@@ -86,7 +87,11 @@ struct thread_t {
     uint64_t yield_target;
     int paused;
     event_t *event_ptr;
+    /* uptime_raw at which waiting on event_ptr gives up, 0 if never */
+    uint64_t event_deadline;
     int active_on_cpu;
+    /* Only runs on this CPU if not -1, see task_bind() */
+    int bound_cpu;
     uint64_t syscall_entry_time;
     int64_t total_cputime;
     int64_t accounted_cputime;
@@ -136,6 +141,12 @@ struct process_t {
     struct rusage_t child_usage;
     struct sigaction signal_handlers[SIGNAL_MAX];
     sigset_t sigmask;
+    /* Pending urm requests, run one at a time by urm_work, see sys/urm.c */
+    struct urm_request_t *urm_requests;
+    int urm_running;
+    int urm_exiting;
+    lock_t urm_lock;
+    struct work_t urm_work;
 };
 
 int task_send_child_event(pid_t, struct child_event_t *);
@@ -177,8 +188,16 @@ struct tcreate_elf_exec_data {
 tid_t task_tcreate(pid_t, enum tcreate_abi, const void *);
 pid_t task_pcreate(void);
 int task_tkill(pid_t, tid_t);
+size_t task_kstack(tid_t);
+
+struct thread_t *thread_alloc(void);
+void thread_free(struct thread_t *);
+struct process_t *process_alloc(void);
+void process_free_file_handles(struct process_t *);
+void process_free(struct process_t *);
 int task_tpause(pid_t, tid_t);
 int task_tresume(pid_t, tid_t);
+void task_bind(int);
 
 void force_resched(void);
 
@@ -146,12 +146,12 @@ int exec(pid_t pid, const char *filename, const char *argv[], const char *envp[]
              0x05,
              VMM_ATTR_REG);
 
-    /* Free previous address space */
-    free_address_space(old_pagemap);
-
     /* Load new pagemap */
     process->pagemap = new_pagemap;
 
+    /* Free previous address space in the background */
+    reap_address_space(old_pagemap);
+
     /* Create main thread */
     task_tcreate(pid, tcreate_elf_exec, tcreate_elf_exec_data((void *)entry, argv, envp, &auxval));
 
@@ -5,8 +5,17 @@
 #include <stdint.h>
 #include <lib/types.h>
 
+struct pagemap_t;
+
 #define MAX_CPUS 128
 
+/* Per-CPU magazine of free order-0 pages in front of the PMM */
+#define PAGE_CACHE_SIZE 64
+#define PAGE_CACHE_BATCH 32
+
+/* Process-context identifiers, see mm/tlb.c */
+#define PCID_COUNT 4096
+
 #define current_cpu ({ \
     size_t cpu_number; \
     asm volatile ("mov %0, qword ptr gs:[0]" \
@@ -33,8 +42,39 @@ struct cpu_local_t {
     uint8_t lapic_id;
     int ipi_abortexec_received;
     int ipi_resched_received;
+    /* Physical addresses of cached free pages, see mm/pmm.c */
+    size_t page_cache_count;
+    void *page_cache[PAGE_CACHE_SIZE];
+    uint64_t page_cache_hits;
+    uint64_t page_cache_misses;
+    uint64_t page_cache_refills;
+    uint64_t page_cache_drains;
+    /* Pagemap loaded in CR3, see mm/tlb.c */
+    struct pagemap_t *active_pagemap;
+    int tlb_shootdown_pending;
+    uint64_t tlb_ipis_sent;
+    uint64_t tlb_pages_invalidated;
+    uint64_t tlb_full_flushes;
+    /* PCIDs whose translations must be flushed before next use */
+    uint64_t pcid_stale[PCID_COUNT / 64];
+    /* PCID 0 only holds kernel pagemap translations */
+    int pcid0_kernel;
+    /* rcu_gp_seq as of the last reschedule, see lib/rcu.h */
+    uint64_t rcu_gp;
 };
 
 extern struct cpu_local_t cpu_locals[MAX_CPUS];
 
+/* Read a member of the running CPU's cpu_local_t. Unlike going through
+ * cpu_locals[current_cpu], this is a single load, so the value always
+ * belongs to the CPU the caller was on, even if it migrates right after. */
+#define cpu_local_read(MEMBER) ({ \
+    __typeof__(((struct cpu_local_t *)0)->MEMBER) ret; \
+    asm volatile ("mov %0, gs:[%c1]" \
+                    : "=r" (ret) \
+                    : "i" (offsetof(struct cpu_local_t, MEMBER)) \
+                    : "memory"); \
+    ret; \
+})
+
 #endif
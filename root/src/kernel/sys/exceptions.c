@@ -65,6 +65,19 @@ static const char *exception_names[] = {
 
 void exception_handler(int exception, struct regs_t *regs, size_t error_code) {
 
+    /* Demand paging and copy-on-write faults, possibly from the kernel
+     * accessing user memory */
+    if (exception == EXC_PAGEFAULT) {
+        size_t cr2 = read_cr2();
+        pid_t current_process = cpu_locals[current_cpu].current_process;
+        /* Populating a page may need to wait for disk I/O */
+        if (regs->rflags & 0x200)
+            asm volatile ("sti");
+        if (cr2 < 0x800000000000 && current_process != -1
+         && !vmm_handle_fault(process_table[current_process]->pagemap, cr2, error_code))
+            return;
+    }
+
     if (regs->cs == 0x23) {
         // userspace
         switch (exception) {
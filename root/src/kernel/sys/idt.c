@@ -42,6 +42,7 @@ void init_idt(void) {
     register_interrupt_handler(IPI_ABORT, ipi_abort, 1, 0x8e);
     register_interrupt_handler(IPI_RESCHED, ipi_resched, 1, 0x8e);
     register_interrupt_handler(IPI_ABORTEXEC, ipi_abortexec, 1, 0x8e);
+    register_interrupt_handler(IPI_TLB, ipi_tlb, 1, 0x8e);
 
     /* Register a bunch of Local APIC NMI handlers */
     for (size_t i = 0; i < 16; i++)
@@ -57,6 +57,9 @@ static void ap_kernel_entry(void) {
     /* Enable this AP's local APIC */
     lapic_enable();
 
+    /* Tag TLB entries with process-context identifiers */
+    pcid_enable();
+
     /* Enable interrupts */
     asm volatile ("sti");
 
@@ -75,6 +78,7 @@ static inline void setup_cpu_local(int cpu_number, uint8_t lapic_id) {
     cpu_locals[cpu_number].current_thread = -1;
     cpu_locals[cpu_number].current_task = -1;
     cpu_locals[cpu_number].lapic_id = lapic_id;
+    cpu_locals[cpu_number].active_pagemap = kernel_pagemap;
 
     /* Prepare TSS */
     cpu_tss[cpu_number].rsp0 = (uint64_t)&cpu_stacks[cpu_number].stack[CPU_STACK_SIZE];
@@ -122,6 +126,8 @@ static void init_cpu0(void) {
 
     smp_init_cpu0_local(cpu_local, tss);
 
+    init_pcid();
+
     return;
 }
 
@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <lib/types.h>
 #include <lib/lock.h>
 #include <lib/event.h>
@@ -6,6 +7,8 @@
 #include <sys/panic.h>
 #include <fd/fd.h>
 #include <sys/urm.h>
+#include <lib/workqueue.h>
+#include <lib/errno.h>
 
 // Macros from mlibc: options/posix/include/sys/wait.h
 #define WAITPID_IFCONTINUED 0x00000100
@@ -16,39 +19,80 @@
 #define WAITPID_STOPSIG(x) (((x) & 0x000000ff) << 16)
 #define WAITPID_TERMSIG(x) (((x) & 0x000000ff) << 24)
 
-#define USER_REQUEST_EXECVE 1
-#define USER_REQUEST_EXIT 2
-
-struct userspace_request_t {
-    int type;
-    void *opaque_data;
+/* Requests are run as work. Those of one process run one at a time and in
+ * the order they were sent, those of different processes in parallel. */
+struct urm_request_t {
+    struct urm_request_t *next;
+    void (*fn)(struct urm_request_t *);
+    pid_t pid;
 };
 
-static size_t userspace_request_i = 0;
-static struct userspace_request_t *userspace_requests = 0;
-static lock_t userspace_request_lock = new_lock;
-static event_t userspace_event;
-
-static void userspace_send_request(int type, void *opaque_data) {
-    spinlock_acquire(&userspace_request_lock);
-
-    userspace_request_i++;
-    userspace_requests = krealloc(userspace_requests,
-        sizeof(struct userspace_request_t) * userspace_request_i);
+static void urm_run(struct work_t *work) {
+    struct process_t *process =
+        (struct process_t *)((char *)work - offsetof(struct process_t, urm_work));
 
-    struct userspace_request_t *userspace_request =
-                    &userspace_requests[userspace_request_i - 1];
+    for (;;) {
+        spinlock_acquire(&process->urm_lock);
+        struct urm_request_t *request = process->urm_requests;
+        if (!request) {
+            process->urm_running = 0;
+            spinlock_release(&process->urm_lock);
+            return;
+        }
+        process->urm_requests = request->next;
+        /* Nothing is queued after an exit, and the process may be freed
+         * as soon as it is done */
+        int last = process->urm_exiting && !request->next;
+        spinlock_release(&process->urm_lock);
+
+        request->fn(request);
+        if (last)
+            return;
+    }
+}
 
-    userspace_request->type = type;
-    userspace_request->opaque_data = opaque_data;
+/* Returns -1 if the process is exiting already */
+static int urm_send(struct urm_request_t *request, int exit) {
+    spinlock_acquire(&scheduler_lock);
+    struct process_t *process = process_table[request->pid];
+    spinlock_release(&scheduler_lock);
 
-    event_trigger(&userspace_event);
+    spinlock_acquire(&process->urm_lock);
+    if (process->urm_exiting) {
+        spinlock_release(&process->urm_lock);
+        return -1;
+    }
+    if (exit)
+        process->urm_exiting = 1;
+    request->next = NULL;
+    struct urm_request_t **tail = &process->urm_requests;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = request;
+    int idle = !process->urm_running;
+    process->urm_running = 1;
+    spinlock_release(&process->urm_lock);
+
+    if (idle)
+        queue_work(&process->urm_work);
+    return 0;
+}
 
-    spinlock_release(&userspace_request_lock);
+void urm_init_process(struct process_t *process) {
+    process->urm_requests = NULL;
+    process->urm_running = 0;
+    process->urm_exiting = 0;
+    process->urm_lock = new_lock;
+    process->urm_work = (struct work_t)new_work(urm_run);
 }
 
+/* Exits of a parent and its children overlap. Under this lock, each of
+ * them sees the ppid of a child either before or after the parent handed
+ * it on, so no child event is lost in, or sent to, a parent gone already. */
+static lock_t family_lock = new_lock;
+
 struct execve_request_t {
-    pid_t pid;
+    struct urm_request_t request;
     tid_t tid;
     char *filename;
     char **argv;
@@ -57,11 +101,14 @@ struct execve_request_t {
     int *call_errno;
 };
 
+static void execve_receive_request(struct urm_request_t *);
+static void execve_free_request(struct execve_request_t *);
+
 void execve_send_request(pid_t pid, tid_t tid, const char *filename, const char **argv, const char **envp,
                     event_t **err_event, int **call_errno) {
     struct execve_request_t *execve_request = kalloc(sizeof(struct execve_request_t));
 
-    execve_request->pid = pid;
+    execve_request->request.pid = pid;
     execve_request->tid = tid;
 
     execve_request->filename = kalloc(strlen(filename) + 1);
@@ -99,12 +146,22 @@ void execve_send_request(pid_t pid, tid_t tid, const char *filename, const char
     execve_request->call_errno = kalloc(sizeof(int));
     *call_errno = execve_request->call_errno;
 
-    userspace_send_request(USER_REQUEST_EXECVE, execve_request);
+    execve_request->request.fn = execve_receive_request;
+    if (urm_send(&execve_request->request, 0)) {
+        /* The calling thread is about to be killed with the process */
+        *execve_request->call_errno = EINTR;
+        event_trigger(execve_request->err_event);
+        execve_free_request(execve_request);
+    }
 }
 
-static void execve_receive_request(struct execve_request_t *execve_request) {
+static void execve_receive_request(struct urm_request_t *request) {
+    struct execve_request_t *execve_request = (struct execve_request_t *)request;
+
+    kprint(KPRN_INFO, "urm: execve request received");
+
     int ret = exec(
-        execve_request->pid,
+        execve_request->request.pid,
         execve_request->filename,
         (const char **)execve_request->argv,
         (const char **)execve_request->envp
@@ -112,7 +169,18 @@ static void execve_receive_request(struct execve_request_t *execve_request) {
 
     *execve_request->call_errno = errno;
 
-    /* free request mem */
+    if (ret)
+        event_trigger(execve_request->err_event);
+    else {
+        kfree(execve_request->call_errno);
+        kfree(execve_request->err_event);
+        locked_write(int, &task_table[execve_request->tid]->in_syscall, 0);
+    }
+
+    execve_free_request(execve_request);
+}
+
+static void execve_free_request(struct execve_request_t *execve_request) {
     kfree(execve_request->filename);
 
     for (size_t i = 0; ; i++) {
@@ -129,42 +197,44 @@ static void execve_receive_request(struct execve_request_t *execve_request) {
     }
     kfree(execve_request->envp);
 
-    if (ret)
-        event_trigger(execve_request->err_event);
-    else {
-        kfree(execve_request->call_errno);
-        kfree(execve_request->err_event);
-        locked_write(int, &task_table[execve_request->tid]->in_syscall, 0);
-    }
-
     kfree(execve_request);
 }
 
 struct exit_request_t {
-    pid_t pid;
+    struct urm_request_t request;
     int signal;
     int exit_code;
 };
 
+static void exit_receive_request(struct urm_request_t *);
+
 void exit_send_request(pid_t pid, int exit_code, int signal) {
     struct exit_request_t *exit_request = kalloc(sizeof(struct exit_request_t));
 
-    exit_request->pid = pid;
+    exit_request->request.pid = pid;
     exit_request->exit_code = exit_code;
     exit_request->signal = signal;
 
-    userspace_send_request(USER_REQUEST_EXIT, exit_request);
+    exit_request->request.fn = exit_receive_request;
+    /* Exiting already */
+    if (urm_send(&exit_request->request, 1))
+        kfree(exit_request);
 }
 
-static void exit_receive_request(struct exit_request_t *exit_request) {
-    struct process_t *process = process_table[exit_request->pid];
+static void exit_receive_request(struct urm_request_t *request) {
+    struct exit_request_t *exit_request = (struct exit_request_t *)request;
+    pid_t pid = request->pid;
+
+    kprint(KPRN_INFO, "urm: exit request received");
+
+    struct process_t *process = process_table[pid];
 
     if (!process->ppid)
         panic("Going nowhere without my init!", 0, 0, NULL);
 
     /* Kill all associated threads */
     for (size_t i = 0; i < MAX_THREADS; i++)
-        task_tkill(exit_request->pid, i);
+        task_tkill(pid, i);
 
     /* Close all file handles */
     for (size_t i = 0; i < MAX_FILE_HANDLES; i++) {
@@ -172,19 +242,16 @@ static void exit_receive_request(struct exit_request_t *exit_request) {
             continue;
         close(process->file_handles[i]);
     }
-    kfree(process->file_handles);
+    process_free_file_handles(process);
 
-    if (process->child_events)
-        kfree(process->child_events);
-
-    free_address_space(process->pagemap);
+    reap_address_space(process->pagemap);
 
     if (process->active_perfmon)
         perfmon_unref(process->active_perfmon);
 
     struct child_event_t child_event;
 
-    child_event.pid = exit_request->pid;
+    child_event.pid = pid;
     child_event.status = 0;
     child_event.status |= WAITPID_EXITSTATUS(exit_request->exit_code);
 
@@ -195,40 +262,36 @@ static void exit_receive_request(struct exit_request_t *exit_request) {
         child_event.status |= WAITPID_IFEXITED;
     }
 
-    task_send_child_event(process->ppid, &child_event);
-
-    kfree(exit_request);
-}
+    spinlock_acquire(&family_lock);
 
-void userspace_request_monitor(void *arg) {
-    (void)arg;
+    /* Hand the children over to the parent */
+    spinlock_acquire(&scheduler_lock);
+    for (size_t i = 0; i < MAX_PROCESSES; i++) {
+        struct process_t *child = process_table[i];
+        if (!child || child == EMPTY || child == (void *)(-2))
+            continue;
+        if (child->ppid == pid)
+            child->ppid = process->ppid;
+    }
+    spinlock_release(&scheduler_lock);
+
+    /* Children which exited already are left for the parent to wait for */
+    spinlock_acquire(&process->child_event_lock);
+    struct child_event_t *child_events = process->child_events;
+    size_t child_event_i = process->child_event_i;
+    process->child_events = NULL;
+    process->child_event_i = 0;
+    spinlock_release(&process->child_event_lock);
+
+    for (size_t i = 0; i < child_event_i; i++)
+        task_send_child_event(process->ppid, &child_events[i]);
+    if (child_events)
+        kfree(child_events);
+
+    /* The parent may free the process from here on */
+    task_send_child_event(process->ppid, &child_event);
 
-    kprint(KPRN_INFO, "urm: Userspace request monitor launched.");
+    spinlock_release(&family_lock);
 
-    /* main event loop */
-    for (;;) {
-        spinlock_acquire(&userspace_request_lock);
-        if (userspace_request_i) {
-            switch (userspace_requests[0].type) {
-                case USER_REQUEST_EXECVE:
-                    kprint(KPRN_INFO, "urm: execve request received");
-                    execve_receive_request(userspace_requests[0].opaque_data);
-                    break;
-                case USER_REQUEST_EXIT:
-                    kprint(KPRN_INFO, "urm: exit request received");
-                    exit_receive_request(userspace_requests[0].opaque_data);
-                    break;
-                default:
-                    kprint(KPRN_ERR, "urm: Invalid request received");
-                    break;
-            }
-            userspace_request_i--;
-            for (size_t i = 0; i < userspace_request_i; i++)
-                userspace_requests[i] = userspace_requests[i + 1];
-            userspace_requests = krealloc(userspace_requests,
-                sizeof(struct userspace_request_t) * userspace_request_i);
-        }
-        spinlock_release(&userspace_request_lock);
-        event_await(&userspace_event);
-    }
+    kfree(exit_request);
 }
@@ -3,10 +3,11 @@
 
 #include <lib/lock.h>
 #include <lib/event.h>
+#include <proc/task.h>
 
 void execve_send_request(pid_t, tid_t, const char *, const char **, const char **, event_t **, int **);
 void exit_send_request(pid_t, int, int);
-void userspace_request_monitor(void *);
+void urm_init_process(struct process_t *);
 
 #define WNOHANG 2
 
@@ -0,0 +1,258 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Reports the lock profile kept by kernels built with LOCKSTAT=yes. The
+ * layout of /dev/lockstat mirrors kernel/lib/lockstat.h. */
+
+#define LOCKSTAT_DEV "/dev/lockstat"
+
+#define LOCKSTAT_MAGIC ((uint64_t)0x746174736b636f6c)
+#define LOCKSTAT_NAME_MAX 64
+#define LOCKSTAT_MANY_LOCKS ((uint64_t)-1)
+
+struct lockstat_header_t {
+    uint64_t magic;
+    uint64_t record_size;
+    uint64_t record_count;
+    uint64_t elapsed_ms;
+    uint64_t tsc_per_ms;
+};
+
+struct lockstat_record_t {
+    char lockname[LOCKSTAT_NAME_MAX];
+    char file[LOCKSTAT_NAME_MAX];
+    char func[LOCKSTAT_NAME_MAX];
+    uint64_t line;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_total;
+    uint64_t wait_max;
+    uint64_t hold_total;
+    uint64_t hold_max;
+    uint64_t lock;
+};
+
+enum sort_key { SORT_WAIT, SORT_HOLD, SORT_CONTENDED, SORT_ACQUISITIONS };
+
+static enum sort_key sort_key = SORT_WAIT;
+static uint64_t tsc_per_ms;
+
+static void usage(void) {
+    fprintf(stderr,
+        "lockstat usage: lockstat [-l] [-n COUNT] [-s wait|hold|contended|acq] [COMMAND [ARGUMENTS...]]\n"
+        "                lockstat -r\n"
+        "  -l  one line per lock instead of per call site, sites which took\n"
+        "      several locks, like one lock of each process, stay on their own\n"
+        "  -n  show the top COUNT lines, 20 by default, 0 for all\n"
+        "  -s  sort by total wait (default), total hold, contentions or acquisitions\n"
+        "  -r  reset the counters\n"
+        "With a COMMAND, the counters are reset and only its run is reported.\n");
+    exit(EXIT_FAILURE);
+}
+
+static void reset(void) {
+    int fd = open(LOCKSTAT_DEV, O_WRONLY);
+    if (fd < 0) {
+        fprintf(stderr, "lockstat: Cannot open " LOCKSTAT_DEV ", is the kernel built with LOCKSTAT=yes? Error: %m\n");
+        exit(EXIT_FAILURE);
+    }
+    if (write(fd, "0", 1) != 1) {
+        fprintf(stderr, "lockstat: Resetting the counters failed. Error: %m\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+/* Returns the whole snapshot, header first */
+static void *read_snapshot(void) {
+    int fd = open(LOCKSTAT_DEV, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "lockstat: Cannot open " LOCKSTAT_DEV ", is the kernel built with LOCKSTAT=yes? Error: %m\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t size = 0, cap = 65536;
+    char *buf = malloc(cap);
+    for (;;) {
+        if (!buf) {
+            fprintf(stderr, "lockstat: Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        ssize_t ret = read(fd, buf + size, cap - size);
+        if (ret < 0) {
+            fprintf(stderr, "lockstat: Reading " LOCKSTAT_DEV " failed. Error: %m\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!ret)
+            break;
+        size += ret;
+        if (size == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+    }
+    close(fd);
+
+    struct lockstat_header_t *header = (void *)buf;
+    if (size < sizeof(struct lockstat_header_t)
+     || header->magic != LOCKSTAT_MAGIC
+     || header->record_size != sizeof(struct lockstat_record_t)
+     || size < sizeof(struct lockstat_header_t)
+               + header->record_count * sizeof(struct lockstat_record_t)) {
+        fprintf(stderr, "lockstat: Unexpected " LOCKSTAT_DEV " contents\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return buf;
+}
+
+/* Folds the records of every site of the same lock into the first one. Locks
+ * are told apart by address, as the same expression may name different
+ * locks in different places. */
+static size_t merge_by_lock(struct lockstat_record_t *records, size_t count) {
+    size_t out = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t j = out;
+        if (records[i].lock != LOCKSTAT_MANY_LOCKS)
+            for (j = 0; j < out; j++)
+                if (records[j].lock == records[i].lock)
+                    break;
+        if (j == out) {
+            records[out++] = records[i];
+            continue;
+        }
+        records[j].acquisitions += records[i].acquisitions;
+        records[j].contended += records[i].contended;
+        records[j].wait_total += records[i].wait_total;
+        records[j].hold_total += records[i].hold_total;
+        if (records[i].wait_max > records[j].wait_max)
+            records[j].wait_max = records[i].wait_max;
+        if (records[i].hold_max > records[j].hold_max)
+            records[j].hold_max = records[i].hold_max;
+    }
+    return out;
+}
+
+static uint64_t sort_value(const struct lockstat_record_t *record) {
+    switch (sort_key) {
+        case SORT_HOLD:
+            return record->hold_total;
+        case SORT_CONTENDED:
+            return record->contended;
+        case SORT_ACQUISITIONS:
+            return record->acquisitions;
+        default:
+            return record->wait_total;
+    }
+}
+
+static int compare(const void *a, const void *b) {
+    uint64_t x = sort_value(a), y = sort_value(b);
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* Microseconds if the TSC rate is known, cycles otherwise */
+static uint64_t duration(uint64_t cycles) {
+    if (!tsc_per_ms)
+        return cycles;
+    return cycles * 1000 / tsc_per_ms;
+}
+
+static void report(struct lockstat_header_t *header, int per_lock, size_t top) {
+    struct lockstat_record_t *records = (void *)(header + 1);
+    size_t count = header->record_count;
+    tsc_per_ms = header->tsc_per_ms;
+
+    if (per_lock)
+        count = merge_by_lock(records, count);
+    qsort(records, count, sizeof(struct lockstat_record_t), compare);
+    if (top && top < count)
+        count = top;
+
+    const char *unit = tsc_per_ms ? "us" : "cyc";
+    printf("lockstat: %lu ms profiled, %lu TSC cycles per ms, times in %s\n",
+           header->elapsed_ms, tsc_per_ms, unit);
+    printf("%10s %9s %6s %11s %9s %11s %9s  %s\n",
+           "acquired", "contended", "cont%", "wait", "wait max",
+           "hold", "hold max", per_lock ? "lock" : "lock, site");
+
+    for (size_t i = 0; i < count; i++) {
+        struct lockstat_record_t *r = &records[i];
+        const char *file = r->file;
+        if (!strncmp(file, "./", 2))
+            file += 2;
+
+        printf("%10lu %9lu %5lu%% %11lu %9lu %11lu %9lu  %s",
+               r->acquisitions, r->contended,
+               r->acquisitions ? r->contended * 100 / r->acquisitions : 0,
+               duration(r->wait_total), duration(r->wait_max),
+               duration(r->hold_total), duration(r->hold_max),
+               r->lockname);
+        if (per_lock && r->lock != LOCKSTAT_MANY_LOCKS)
+            printf(" at %#lx\n", r->lock);
+        else
+            printf(", %s:%lu %s()\n", file, r->line, r->func);
+    }
+}
+
+int main(int argc, char **argv) {
+    int per_lock = 0;
+    size_t top = 20;
+
+    int i;
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-r")) {
+            reset();
+            return EXIT_SUCCESS;
+        } else if (!strcmp(argv[i], "-l")) {
+            per_lock = 1;
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            top = strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            const char *key = argv[++i];
+            if (!strcmp(key, "wait"))
+                sort_key = SORT_WAIT;
+            else if (!strcmp(key, "hold"))
+                sort_key = SORT_HOLD;
+            else if (!strcmp(key, "contended"))
+                sort_key = SORT_CONTENDED;
+            else if (!strcmp(key, "acq"))
+                sort_key = SORT_ACQUISITIONS;
+            else
+                usage();
+        } else {
+            usage();
+        }
+    }
+
+    if (i < argc) {
+        reset();
+
+        int child = fork();
+        if (child < 0) {
+            fprintf(stderr, "lockstat: fork() failed. Error: %m\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!child) {
+            execvp(argv[i], argv + i);
+            fprintf(stderr, "lockstat: execvp() failed in child. Error: %m\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (waitpid(child, NULL, 0) < 0) {
+            fprintf(stderr, "lockstat: waitpid() failed. Error: %m\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    void *snapshot = read_snapshot();
+    report(snapshot, per_lock, top);
+    free(snapshot);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,167 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Compares reading a file through read() into a malloc'd buffer against
+ * mapping it with mmap(), the way tools like grep consume their input.
+ * The kernel syscalls are invoked directly, numbers from the kernel's
+ * syscall table. */
+
+#define SYSCALL_MMAP 36
+#define SYSCALL_MUNMAP 37
+
+#define PROT_READ 0x01
+#define MAP_PRIVATE 0x01
+
+/* Returns NULL on failure */
+static void *qword_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off) {
+    void *ret;
+    register size_t rdx asm("rdx") = prot;
+    register size_t r10 asm("r10") = flags;
+    register size_t r8 asm("r8") = fd;
+    register size_t r9 asm("r9") = off;
+    asm volatile (
+        "syscall"
+        : "=a" (ret), "+r" (rdx)
+        : "a" (SYSCALL_MMAP), "D" (addr), "S" (len),
+          "r" (r10), "r" (r8), "r" (r9)
+        : "rcx", "r11", "memory"
+    );
+    return ret;
+}
+
+static int qword_munmap(void *addr, size_t len) {
+    int ret;
+    asm volatile (
+        "syscall"
+        : "=a" (ret)
+        : "a" (SYSCALL_MUNMAP), "D" (addr), "S" (len)
+        : "rcx", "rdx", "r11", "memory"
+    );
+    return ret;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Touch every byte, so that neither method gets away without the data */
+static uint64_t checksum(const unsigned char *buf, size_t len) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < len; i++)
+        sum += buf[i];
+    return sum;
+}
+
+static double bench_read(const char *path, size_t size, uint64_t *sum) {
+    double start = now();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "mmapbench: open() failed. Error: %m\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned char *buf = malloc(size);
+    if (!buf) {
+        fprintf(stderr, "mmapbench: malloc() failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t ret = read(fd, buf + done, size - done);
+        if (ret <= 0) {
+            fprintf(stderr, "mmapbench: read() failed. Error: %m\n");
+            exit(EXIT_FAILURE);
+        }
+        done += ret;
+    }
+
+    *sum = checksum(buf, size);
+
+    free(buf);
+    close(fd);
+
+    return now() - start;
+}
+
+static double bench_mmap(const char *path, size_t size, uint64_t *sum) {
+    double start = now();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "mmapbench: open() failed. Error: %m\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned char *buf = qword_mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (!buf) {
+        fprintf(stderr, "mmapbench: mmap() failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    *sum = checksum(buf, size);
+
+    qword_munmap(buf, size);
+    close(fd);
+
+    return now() - start;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "mmapbench usage: mmapbench FILE [ROUNDS]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    if (rounds < 1)
+        rounds = 1;
+
+    struct stat st;
+    if (stat(argv[1], &st)) {
+        fprintf(stderr, "mmapbench: stat() failed. Error: %m\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t size = st.st_size;
+    if (!size) {
+        fprintf(stderr, "mmapbench: %s is empty\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    double mib = size / (1024.0 * 1024.0);
+    printf("mmapbench: %s, %zu bytes, %d rounds\n", argv[1], size, rounds);
+    printf("%-6s %12s %12s %12s %12s\n",
+           "round", "read (s)", "read MiB/s", "mmap (s)", "mmap MiB/s");
+
+    double read_total = 0, mmap_total = 0;
+    for (int i = 0; i < rounds; i++) {
+        uint64_t read_sum, mmap_sum;
+        double read_time = bench_read(argv[1], size, &read_sum);
+        double mmap_time = bench_mmap(argv[1], size, &mmap_sum);
+
+        if (read_sum != mmap_sum) {
+            fprintf(stderr, "mmapbench: checksum mismatch, %lu != %lu\n",
+                    read_sum, mmap_sum);
+            exit(EXIT_FAILURE);
+        }
+
+        printf("%-6d %12.4f %12.2f %12.4f %12.2f\n", i,
+               read_time, mib / read_time, mmap_time, mib / mmap_time);
+        read_total += read_time;
+        mmap_total += mmap_time;
+    }
+
+    printf("%-6s %12.4f %12.2f %12.4f %12.2f\n", "avg",
+           read_total / rounds, mib * rounds / read_total,
+           mmap_total / rounds, mib * rounds / mmap_total);
+
+    return 0;
+}